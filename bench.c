@@ -0,0 +1,428 @@
+/*
+Benchmark harness for the library (make bench).
+
+Generates synthetic PPM and PGM inputs at several sizes, then times parsing,
+every drawing primitive, fill_layer, save_image for each file type and
+export_to_array for each array format at several layer counts. Results are
+written as JSON, one record per measurement, in Mpix/s and bytes/s.
+
+Usage: bench [output.json] [threads]
+    output.json  where to write the results (default: bench.json)
+    threads      thread pool size, 0 for every CPU (default: 1, the library default)
+*/
+#include "images.h"
+#include "images-flatten.h"
+#include "images-parser.h"
+#include "images-primitives.h"
+#include "images-threads.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every measurement repeats its operation for at least this long and keeps the fastest run
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_ITERATIONS 1000
+
+typedef struct
+{
+    int width, height;
+} BenchSize;
+
+static const BenchSize bench_sizes[] = {{640, 480}, {1920, 1080}, {3840, 2160}};
+static const int bench_layer_counts[] = {1, 4, 16};
+
+#define COUNT_OF(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+typedef void (*BenchFunc)(void *ctx);
+
+static FILE *json_out;
+static int json_records;
+static char temp_dir[256];
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+Runs func until BENCH_MIN_SECONDS have passed (at least twice) and writes one
+JSON record. pixels and bytes are the work done by a single call.
+*/
+static void run_bench(const char *group, const char *name, int width, int height, int layers,
+                      double pixels, double bytes, BenchFunc func, void *ctx)
+{
+    double best = 1e30, start = now_seconds();
+    int iterations = 0;
+    while (iterations < 2 || (now_seconds() - start < BENCH_MIN_SECONDS && iterations < BENCH_MAX_ITERATIONS))
+    {
+        double t0 = now_seconds();
+        func(ctx);
+        double elapsed = now_seconds() - t0;
+        if (elapsed < best)
+            best = elapsed;
+        iterations++;
+    }
+
+    fprintf(json_out, "%s    {\"group\": \"%s\", \"name\": \"%s\", \"width\": %d, \"height\": %d, \"layers\": %d, "
+                      "\"iterations\": %d, \"seconds\": %.9f, \"mpix_per_s\": %.3f, \"bytes_per_s\": %.0f}",
+            json_records++ ? ",\n" : "", group, name, width, height, layers,
+            iterations, best, pixels / best / 1e6, bytes / best);
+    fprintf(stderr, "%-8s %-22s %5dx%-5d layers %2d: %9.3f ms %10.1f Mpix/s\n",
+            group, name, width, height, layers, best * 1e3, pixels / best / 1e6);
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+/* =========================================================================
+ * SYNTHETIC INPUTS
+ * ========================================================================= */
+
+// A smooth gradient with some noise, so no format sees only constant data
+static int write_synthetic_file(const char *path, ImageFileType type, int width, int height)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Could not open file %s for writing\n", path);
+        return 1;
+    }
+
+    int channels = type == IMAGE_FILE_PPM ? 3 : 1;
+    fprintf(fp, "P%d\n%d %d\n255\n", type == IMAGE_FILE_PPM ? 6 : 5, width, height);
+
+    unsigned char *row = (unsigned char *)malloc((size_t)width * channels);
+    unsigned int seed = 12345;
+    for (int y = 0; row && y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            unsigned int noise = (seed >> 16) & 15;
+            for (int c = 0; c < channels; c++)
+                row[(size_t)x * channels + c] = (unsigned char)((x * 255 / width + y * 255 / height * c + noise) & 0xFF);
+        }
+        fwrite(row, 1, (size_t)width * channels, fp);
+    }
+    free(row);
+    return fclose(fp) != 0 || !row;
+}
+
+/* =========================================================================
+ * PARSE
+ * ========================================================================= */
+
+static void bench_parse(void *ctx)
+{
+    ImageFileType type;
+    Layer *layer = parse_image_file((const char *)ctx, &type);
+    release_layer(layer);
+}
+
+static void bench_parsing(const BenchSize *size)
+{
+    static const struct
+    {
+        const char *name;
+        ImageFileType type;
+    } inputs[] = {{"parse_ppm", IMAGE_FILE_PPM}, {"parse_pgm", IMAGE_FILE_PGM}};
+
+    for (int i = 0; i < COUNT_OF(inputs); i++)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/input_%dx%d.%s", temp_dir, size->width, size->height,
+                 inputs[i].type == IMAGE_FILE_PPM ? "ppm" : "pgm");
+        if (write_synthetic_file(path, inputs[i].type, size->width, size->height) != 0)
+            continue;
+
+        run_bench("parse", inputs[i].name, size->width, size->height, 1,
+                  (double)size->width * size->height, (double)file_size(path), bench_parse, path);
+        unlink(path);
+    }
+}
+
+/* =========================================================================
+ * DRAW
+ * ========================================================================= */
+
+typedef struct
+{
+    Layer *layer;
+    uint32_t color;
+} DrawBench;
+
+static void bench_fill_layer(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    fill_layer(bench->layer, bench->color);
+}
+
+static void bench_pixels(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    for (int i = 0; i < 100000; i++)
+        draw_pixel_safe(layer, (int)((i * 7919u) % layer->width), (int)((i * 104729u) % layer->height), bench->color);
+}
+
+static void bench_lines(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    for (int i = 0; i < 64; i++)
+        draw_line(layer, 0, i * (layer->height - 1) / 63, layer->width - 1, (63 - i) * (layer->height - 1) / 63, bench->color);
+}
+
+static void bench_rect_filled(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    draw_rect_filled(layer, layer->width / 8, layer->height / 8, layer->width * 3 / 4, layer->height * 3 / 4, bench->color);
+}
+
+static void bench_rect_outline(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    for (int i = 0; i < 64; i++)
+        draw_rect_outline(layer, i, i, layer->width - 2 * i, layer->height - 2 * i, bench->color);
+}
+
+static int bench_radius(const Layer *layer)
+{
+    return (layer->width < layer->height ? layer->width : layer->height) * 3 / 8;
+}
+
+static void bench_circle_filled(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    draw_circle_filled(layer, layer->width / 2, layer->height / 2, bench_radius(layer), bench->color);
+}
+
+static void bench_circle_outline(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    for (int i = 0; i < 64; i++)
+        draw_circle_outline(layer, layer->width / 2, layer->height / 2, bench_radius(layer) - i, bench->color);
+}
+
+static void bench_ellipse_filled(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    draw_ellipse_filled(layer, layer->width / 2, layer->height / 2, layer->width * 3 / 8, layer->height * 3 / 8, bench->color);
+}
+
+static void bench_ellipse_outline(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    for (int i = 0; i < 64; i++)
+        draw_ellipse_outline(layer, layer->width / 2, layer->height / 2, layer->width * 3 / 8 - i, layer->height * 3 / 8 - i, bench->color);
+}
+
+static void bench_polygon_filled(void *ctx)
+{
+    DrawBench *bench = (DrawBench *)ctx;
+    Layer *layer = bench->layer;
+    // a five-pointed star, self-intersecting
+    ImagePoint star[5];
+    static const int star_x[5] = {50, 79, 2, 98, 21}, star_y[5] = {0, 90, 35, 35, 90};
+    for (int i = 0; i < 5; i++)
+    {
+        star[i].x = star_x[i] * (layer->width - 1) / 100;
+        star[i].y = star_y[i] * (layer->height - 1) / 100;
+    }
+    draw_polygon_filled(layer, star, 5, FILL_RULE_NON_ZERO, bench->color);
+}
+
+static void bench_drawing(const BenchSize *size)
+{
+    int w = size->width, h = size->height;
+    int r = (w < h ? w : h) * 3 / 8;
+    double pi = 3.14159265358979;
+
+    // pixels written by one call of each benchmark (approximate for curves)
+    struct
+    {
+        const char *name;
+        BenchFunc func;
+        double pixels;
+    } draws[] = {
+        {"fill_layer", bench_fill_layer, (double)w * h},
+        {"draw_pixel_safe", bench_pixels, 100000.0},
+        {"draw_line", bench_lines, 64.0 * w},
+        {"draw_rect_filled", bench_rect_filled, (double)(w * 3 / 4) * (h * 3 / 4)},
+        {"draw_rect_outline", bench_rect_outline, 64.0 * 2 * (w + h)},
+        {"draw_circle_filled", bench_circle_filled, pi * r * r},
+        {"draw_circle_outline", bench_circle_outline, 64.0 * 2 * pi * r},
+        {"draw_ellipse_filled", bench_ellipse_filled, pi * (w * 3 / 8) * (h * 3 / 8)},
+        {"draw_ellipse_outline", bench_ellipse_outline, 64.0 * pi * (w * 3 / 8 + h * 3 / 8)},
+        {"draw_polygon_filled", bench_polygon_filled, 0.25 * w * h},
+    };
+
+    for (int blend = 0; blend < 2; blend++)
+    {
+        Layer *layer = create_layer(w, h);
+        if (!layer)
+            return;
+        fill_layer(layer, COLOR(255, 32, 32, 32));
+        set_layer_paint_mode(layer, blend ? PAINT_MODE_BLEND : PAINT_MODE_REPLACE);
+
+        // translucent colors only matter when blending
+        DrawBench bench = {layer, blend ? COLOR(128, 255, 64, 0) : COLOR(255, 255, 64, 0)};
+        for (int i = 0; i < COUNT_OF(draws); i++)
+        {
+            run_bench(blend ? "blend" : "draw", draws[i].name, w, h, 1,
+                      draws[i].pixels, draws[i].pixels * sizeof(uint32_t), draws[i].func, &bench);
+        }
+        release_layer(layer);
+    }
+}
+
+/* =========================================================================
+ * SAVE AND EXPORT
+ * ========================================================================= */
+
+typedef struct
+{
+    Image *img;
+    ImageFileType type;
+    ArrayDataFormat format;
+    const char *path;
+} OutputBench;
+
+static void bench_save(void *ctx)
+{
+    OutputBench *bench = (OutputBench *)ctx;
+    save_image(bench->img, bench->path, bench->type);
+}
+
+static void bench_export(void *ctx)
+{
+    OutputBench *bench = (OutputBench *)ctx;
+    void *array = NULL;
+    size_t len;
+    if (export_to_array(bench->img, &array, &len, bench->format) == 0)
+        free(array);
+}
+
+// An opaque background plus translucent layers, each with a few shapes
+static Image *create_layered_image(const BenchSize *size, int layers)
+{
+    Image *img = create_image(size->width, size->height);
+    if (!img)
+        return NULL;
+
+    for (int i = 0; i < layers; i++)
+    {
+        Layer *layer = add_layer(img);
+        if (!layer)
+            break;
+        if (i == 0)
+        {
+            fill_layer(layer, COLOR(255, 40, 80, 120));
+            continue;
+        }
+        int w = size->width, h = size->height;
+        draw_rect_filled(layer, (i * 97) % w, (i * 61) % h, w / 3, h / 3, COLOR(160, 255, i * 16, 0));
+        draw_circle_filled(layer, (i * 131) % w, (i * 73) % h, h / 4, COLOR(96, 0, 255, i * 16));
+    }
+    return img;
+}
+
+static void bench_outputs(const BenchSize *size)
+{
+    static const struct
+    {
+        const char *name;
+        ImageFileType type;
+    } files[] = {{"save_ppm", IMAGE_FILE_PPM}, {"save_pgm", IMAGE_FILE_PGM}, {"save_pbm", IMAGE_FILE_PBM}};
+    static const struct
+    {
+        const char *name;
+        ArrayDataFormat format;
+        double bits;
+    } formats[] = {{"export_rgba32", ARRAY_DATA_FORMAT_RGBA32, 32},
+                   {"export_rgb24", ARRAY_DATA_FORMAT_RGB24, 24},
+                   {"export_grayscale8", ARRAY_DATA_FORMAT_GRAYSCALE8, 8},
+                   {"export_binary1", ARRAY_DATA_FORMAT_BINARY1, 1}};
+
+    double pixels = (double)size->width * size->height;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/output.pnm", temp_dir);
+
+    for (int l = 0; l < COUNT_OF(bench_layer_counts); l++)
+    {
+        int layers = bench_layer_counts[l];
+        Image *img = create_layered_image(size, layers);
+        if (!img)
+            return;
+
+        for (int i = 0; i < COUNT_OF(files); i++)
+        {
+            OutputBench bench = {img, files[i].type, ARRAY_DATA_FORMAT_RGBA32, path};
+            bench_save(&bench);
+            run_bench("save", files[i].name, size->width, size->height, layers,
+                      pixels, (double)file_size(path), bench_save, &bench);
+        }
+        unlink(path);
+
+        for (int i = 0; i < COUNT_OF(formats); i++)
+        {
+            OutputBench bench = {img, IMAGE_FILE_UNKNOWN, formats[i].format, NULL};
+            run_bench("export", formats[i].name, size->width, size->height, layers,
+                      pixels, pixels * formats[i].bits / 8, bench_export, &bench);
+        }
+        free_image(img);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = argc > 1 ? argv[1] : "bench.json";
+    if (argc > 2)
+        set_thread_count(atoi(argv[2]));
+
+    snprintf(temp_dir, sizeof(temp_dir), "%s/images-bench-XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(temp_dir))
+    {
+        fprintf(stderr, "Failed to create a temporary directory\n");
+        return 1;
+    }
+
+    json_out = fopen(output, "w");
+    if (!json_out)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", output);
+        rmdir(temp_dir);
+        return 1;
+    }
+
+    fprintf(json_out, "{\n  \"threads\": %d,\n  \"simd_level\": %d,\n  \"results\": [\n",
+            get_thread_count(), (int)get_simd_level());
+
+    for (int s = 0; s < COUNT_OF(bench_sizes); s++)
+    {
+        bench_parsing(&bench_sizes[s]);
+        bench_drawing(&bench_sizes[s]);
+        bench_outputs(&bench_sizes[s]);
+    }
+
+    fprintf(json_out, "\n  ]\n}\n");
+    fclose(json_out);
+    rmdir(temp_dir);
+    fprintf(stderr, "Results written to %s\n", output);
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include "images-display-list.h"
+#include "images-internal.h"
+#include "images-threads.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DISPLAY_LIST_INITIAL_CAPACITY 256
+
+struct DisplayList
+{
+    Layer *layer; // retained
+    DrawCommand *commands;
+    int num_commands, capacity;
+
+    // Rebuilt by every execute. prepared holds the commands with their colors in
+    // the layer's representation; the commands of tile t are
+    // prepared[bin_items[bin_start[t]]] .. prepared[bin_items[bin_start[t + 1] - 1]].
+    DrawCommand *prepared;
+    int *bin_start; // num_tiles + 1 entries
+    int *bin_fill;  // next free slot of every tile while binning
+    int num_tiles;
+    int *bin_items;
+    size_t bin_capacity;
+};
+
+DisplayList *create_display_list(Layer *layer)
+{
+    if (!layer)
+        return NULL;
+
+    DisplayList *list = (DisplayList *)calloc(1, sizeof(DisplayList));
+    if (!list)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for display list\n");
+        return NULL;
+    }
+
+    retain_layer(layer);
+    list->layer = layer;
+    return list;
+}
+
+void free_display_list(DisplayList *list)
+{
+    if (!list)
+        return;
+
+    release_layer(list->layer);
+    free(list->commands);
+    free(list->prepared);
+    free(list->bin_start);
+    free(list->bin_fill);
+    free(list->bin_items);
+    free(list);
+}
+
+void clear_display_list(DisplayList *list)
+{
+    if (list)
+        list->num_commands = 0;
+}
+
+int get_display_list_length(const DisplayList *list)
+{
+    return list ? list->num_commands : 0;
+}
+
+static int record_command(DisplayList *list, DrawCommand cmd)
+{
+    if (!list)
+        return 1;
+
+    if (list->num_commands == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : DISPLAY_LIST_INITIAL_CAPACITY;
+        DrawCommand *commands = (DrawCommand *)realloc(list->commands, (size_t)capacity * sizeof(DrawCommand));
+        if (!commands)
+        {
+            fprintf(stderr, "Error: Unable to grow display list\n");
+            return 1;
+        }
+        list->commands = commands;
+        list->capacity = capacity;
+    }
+
+    list->commands[list->num_commands++] = cmd;
+    return 0;
+}
+
+int record_pixel(DisplayList *list, int x, int y, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_PIXEL, x, y, 0, 0, color});
+}
+
+int record_line(DisplayList *list, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_LINE, x0, y0, x1, y1, color});
+}
+
+int record_rect_filled(DisplayList *list, int x, int y, int w, int h, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_RECT_FILLED, x, y, w, h, color});
+}
+
+int record_rect_outline(DisplayList *list, int x, int y, int w, int h, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_RECT_OUTLINE, x, y, w, h, color});
+}
+
+int record_circle_filled(DisplayList *list, int xc, int yc, int r, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_CIRCLE_FILLED, xc, yc, r, 0, color});
+}
+
+int record_circle_outline(DisplayList *list, int xc, int yc, int r, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_CIRCLE_OUTLINE, xc, yc, r, 0, color});
+}
+
+int record_ellipse_filled(DisplayList *list, int xc, int yc, int rx, int ry, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_ELLIPSE_FILLED, xc, yc, rx, ry, color});
+}
+
+int record_ellipse_outline(DisplayList *list, int xc, int yc, int rx, int ry, uint32_t color)
+{
+    return record_command(list, (DrawCommand){DRAW_COMMAND_ELLIPSE_OUTLINE, xc, yc, rx, ry, color});
+}
+
+/* =========================================================================
+ * BINNING
+ * ========================================================================= */
+
+/*
+Columns [*x_first, *x_last] that a sloped line can reach within rows [y_first, y_last].
+Bresenham pixels stay within one pixel of the ideal line, so the ideal line is
+evaluated one row beyond the band on each side and padded by two columns.
+This keeps long diagonal lines out of most of the tiles of their bounding box.
+*/
+static void line_band_columns(const DrawCommand *cmd, int y_first, int y_last, int *x_first, int *x_last)
+{
+    long long dx = (long long)cmd->x1 - cmd->x0;
+    long long dy = (long long)cmd->y1 - cmd->y0;
+    long long xa = cmd->x0 + ((long long)(y_first - 1) - cmd->y0) * dx / dy;
+    long long xb = cmd->x0 + ((long long)(y_last + 1) - cmd->y0) * dx / dy;
+    long long lo = (xa < xb ? xa : xb) - 2;
+    long long hi = (xa < xb ? xb : xa) + 2;
+
+    // never wider than the line itself
+    int x_min = cmd->x0 < cmd->x1 ? cmd->x0 : cmd->x1;
+    int x_max = cmd->x0 < cmd->x1 ? cmd->x1 : cmd->x0;
+    *x_first = lo < x_min ? x_min : (int)lo;
+    *x_last = hi > x_max ? x_max : (int)hi;
+}
+
+// Counts (fill == 0) or stores (fill != 0) the command in every tile it may touch
+static void bin_command(DisplayList *list, int index, int tiles_x, int fill)
+{
+    const Layer *layer = list->layer;
+    const DrawCommand *cmd = &list->prepared[index];
+    ImageRect bounds = draw_command_bounds(cmd);
+
+    int x0 = bounds.x < 0 ? 0 : bounds.x;
+    int y0 = bounds.y < 0 ? 0 : bounds.y;
+    int x1 = bounds.x + bounds.w > layer->width ? layer->width : bounds.x + bounds.w;
+    int y1 = bounds.y + bounds.h > layer->height ? layer->height : bounds.y + bounds.h;
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    int sloped = cmd->type == DRAW_COMMAND_LINE && cmd->x0 != cmd->x1 && cmd->y0 != cmd->y1;
+    for (int ty = y0 / DISPLAY_LIST_TILE_SIZE; ty <= (y1 - 1) / DISPLAY_LIST_TILE_SIZE; ty++)
+    {
+        int first = x0, last = x1 - 1;
+        if (sloped)
+        {
+            int band_top = ty * DISPLAY_LIST_TILE_SIZE;
+            line_band_columns(cmd, band_top > y0 ? band_top : y0,
+                              band_top + DISPLAY_LIST_TILE_SIZE - 1 < y1 - 1 ? band_top + DISPLAY_LIST_TILE_SIZE - 1 : y1 - 1,
+                              &first, &last);
+            first = first < x0 ? x0 : first;
+            last = last > x1 - 1 ? x1 - 1 : last;
+            if (last < first)
+                continue;
+        }
+
+        for (int tx = first / DISPLAY_LIST_TILE_SIZE; tx <= last / DISPLAY_LIST_TILE_SIZE; tx++)
+        {
+            int tile = ty * tiles_x + tx;
+            if (fill)
+                list->bin_items[list->bin_fill[tile]++] = index;
+            else
+                list->bin_start[tile + 1]++;
+        }
+    }
+}
+
+// Prepares the commands and sorts them into tile bins; returns the number of prepared commands or -1
+static int bin_commands(DisplayList *list, int tiles_x, int tiles_y)
+{
+    int num_tiles = tiles_x * tiles_y;
+    if (num_tiles > list->num_tiles)
+    {
+        int *bin_start = (int *)realloc(list->bin_start, (size_t)(num_tiles + 1) * sizeof(int));
+        if (bin_start)
+            list->bin_start = bin_start;
+        int *bin_fill = (int *)realloc(list->bin_fill, (size_t)num_tiles * sizeof(int));
+        if (bin_fill)
+            list->bin_fill = bin_fill;
+        if (!bin_start || !bin_fill)
+            return -1;
+        list->num_tiles = num_tiles;
+    }
+
+    DrawCommand *prepared = (DrawCommand *)realloc(list->prepared, (size_t)list->capacity * sizeof(DrawCommand));
+    if (!prepared)
+        return -1;
+    list->prepared = prepared;
+
+    // Every change is recorded here, on the calling thread, exactly as immediate drawing does
+    int count = 0;
+    for (int i = 0; i < list->num_commands; i++)
+    {
+        prepared[count] = list->commands[i];
+        if (prepare_draw_command(list->layer, &prepared[count]) == 0)
+            count++;
+    }
+
+    memset(list->bin_start, 0, (size_t)(num_tiles + 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        bin_command(list, i, tiles_x, 0);
+    }
+
+    // Counts to offsets; filling in command order keeps every bin in recorded order
+    for (int t = 0; t < num_tiles; t++)
+    {
+        list->bin_start[t + 1] += list->bin_start[t];
+        list->bin_fill[t] = list->bin_start[t];
+    }
+
+    size_t total = (size_t)list->bin_start[num_tiles];
+    if (total > list->bin_capacity)
+    {
+        int *bin_items = (int *)realloc(list->bin_items, total * sizeof(int));
+        if (!bin_items)
+            return -1;
+        list->bin_items = bin_items;
+        list->bin_capacity = total;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        bin_command(list, i, tiles_x, 1);
+    }
+    return count;
+}
+
+/* =========================================================================
+ * PARALLEL REPLAY
+ * ========================================================================= */
+
+typedef struct
+{
+    DisplayList *list;
+    int tiles_x;
+} ReplayJob;
+
+static void replay_tile(void *ctx, int tile)
+{
+    ReplayJob *job = (ReplayJob *)ctx;
+    DisplayList *list = job->list;
+    const Layer *layer = list->layer;
+
+    int first = list->bin_start[tile];
+    int last = list->bin_start[tile + 1];
+    if (first == last)
+        return;
+
+    int x = (tile % job->tiles_x) * DISPLAY_LIST_TILE_SIZE;
+    int y = (tile / job->tiles_x) * DISPLAY_LIST_TILE_SIZE;
+
+    // A layer covering only this tile, over the same pixels: the rasterizers clip
+    // to it, and shapes moved by (-x, -y) draw exactly the pixels they would have
+    // drawn here on the whole layer. Tiles never share pixels, so no locking is needed.
+    Layer target = *layer;
+    target.width = layer->width - x < DISPLAY_LIST_TILE_SIZE ? layer->width - x : DISPLAY_LIST_TILE_SIZE;
+    target.height = layer->height - y < DISPLAY_LIST_TILE_SIZE ? layer->height - y : DISPLAY_LIST_TILE_SIZE;
+    if (layer->data)
+        target.data = layer->data + (size_t)y * layer->stride + x;
+    else
+        target.tiles = layer->tiles + (size_t)(y / LAYER_TILE_SIZE) * layer->tiles_x + x / LAYER_TILE_SIZE;
+
+    for (int i = first; i < last; i++)
+    {
+        DrawCommand cmd = list->prepared[list->bin_items[i]];
+        cmd.x0 -= x;
+        cmd.y0 -= y;
+        if (cmd.type == DRAW_COMMAND_LINE)
+        {
+            cmd.x1 -= x;
+            cmd.y1 -= y;
+        }
+        rasterize_command(&target, &cmd);
+    }
+}
+
+int execute_display_list(DisplayList *list)
+{
+    if (!list)
+        return 1;
+    if (list->num_commands == 0)
+        return 0;
+
+    Layer *layer = list->layer;
+    int tiles_x = (layer->width + DISPLAY_LIST_TILE_SIZE - 1) / DISPLAY_LIST_TILE_SIZE;
+    int tiles_y = (layer->height + DISPLAY_LIST_TILE_SIZE - 1) / DISPLAY_LIST_TILE_SIZE;
+
+    if (bin_commands(list, tiles_x, tiles_y) < 0)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for display list bins.\n");
+        return 1;
+    }
+
+    ReplayJob job = {list, tiles_x};
+    parallel_for(tiles_x * tiles_y, replay_tile, &job);
+    return 0;
+}
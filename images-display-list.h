@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include "images.h"
+
+/* =========================================================================
+ * DISPLAY LISTS
+ *
+ * Record drawing primitives for a layer and draw them later, all at once.
+ * When the list is executed, the layer is split into DISPLAY_LIST_TILE_SIZE
+ * square tiles, every command is binned into the tiles it can touch, and the
+ * tiles are drawn in parallel on the thread pool (see set_thread_count).
+ * Within a tile the commands run in the order they were recorded, so the
+ * result is identical to calling the primitives of images-primitives.h directly,
+ * in any paint mode.
+ * ========================================================================= */
+
+// Side of the tiles commands are binned into; a multiple of LAYER_TILE_SIZE
+#define DISPLAY_LIST_TILE_SIZE 128
+
+typedef struct DisplayList DisplayList;
+
+/**
+ * @brief Creates an empty display list that draws on a layer.
+ * * The list retains the layer until it is freed.
+ * * @param layer The layer the recorded commands will draw on.
+ * @return The new list, or NULL on allocation failure.
+ */
+DisplayList *create_display_list(Layer *layer);
+
+/**
+ * @brief Frees a display list and releases its layer.
+ */
+void free_display_list(DisplayList *list);
+
+/**
+ * @brief Removes every recorded command, keeping the memory for the next frame.
+ */
+void clear_display_list(DisplayList *list);
+
+/**
+ * @brief Returns the number of recorded commands.
+ */
+int get_display_list_length(const DisplayList *list);
+
+/*
+ * Record the primitive of the same name in images-primitives.h, with the same
+ * arguments. Nothing is drawn until execute_display_list.
+ * Each returns 0 on success, 1 on allocation failure.
+ */
+int record_pixel(DisplayList *list, int x, int y, uint32_t color);
+int record_line(DisplayList *list, int x0, int y0, int x1, int y1, uint32_t color);
+int record_rect_filled(DisplayList *list, int x, int y, int w, int h, uint32_t color);
+int record_rect_outline(DisplayList *list, int x, int y, int w, int h, uint32_t color);
+int record_circle_filled(DisplayList *list, int xc, int yc, int r, uint32_t color);
+int record_circle_outline(DisplayList *list, int xc, int yc, int r, uint32_t color);
+int record_ellipse_filled(DisplayList *list, int xc, int yc, int rx, int ry, uint32_t color);
+int record_ellipse_outline(DisplayList *list, int xc, int yc, int rx, int ry, uint32_t color);
+
+/**
+ * @brief Draws every recorded command on the layer.
+ * * Changes are recorded on the layer (begin_layer_write) command by command,
+ * as immediate drawing would, then the tiles are drawn in parallel. The layer's
+ * paint mode and pixel representation are read at this point, not when recording.
+ * The commands stay recorded, so a list can be executed again; call
+ * clear_display_list to start the next frame.
+ * * @param list The display list.
+ * @return 0 on success, 1 on failure.
+ */
+int execute_display_list(DisplayList *list);
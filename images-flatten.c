@@ -0,0 +1,1436 @@
+#include "images-flatten.h"
+#include "images-internal.h"
+#include "images-threads.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGES_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* =========================================================================
+ * BLEND KERNELS
+ *
+ * All kernels compute (fg * a + bg * (255 - a)) / 255 per channel with an
+ * exact integer division, so every level matches blend_pixels bit for bit.
+ * The destination is always opaque while flattening, which lets the same
+ * formula cover the alpha == 0 and alpha == 255 cases.
+ *
+ * Premultiplied layers (set_layer_premultiplied) use the "_premul" kernels
+ * instead: fg + bg * (255 - a) / 255, one multiply-add per channel.
+ * ========================================================================= */
+
+static void blend_row_scalar(uint32_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = blend_pixels(dst[i], src[i]);
+    }
+}
+
+static inline uint32_t blend_pixels_premul(uint32_t bg_color, uint32_t fg_color)
+{
+    unsigned int inv_alpha = 255 - GET_A(fg_color);
+    if (inv_alpha == 255)
+        return bg_color;
+
+    // exact x / 255 as in the SIMD kernels; never exceeds 255 since fg <= alpha
+    unsigned int r = GET_R(bg_color) * inv_alpha;
+    unsigned int g = GET_G(bg_color) * inv_alpha;
+    unsigned int b = GET_B(bg_color) * inv_alpha;
+    return COLOR(255,
+                 GET_R(fg_color) + ((r * 0x8081) >> 23),
+                 GET_G(fg_color) + ((g * 0x8081) >> 23),
+                 GET_B(fg_color) + ((b * 0x8081) >> 23));
+}
+
+static void blend_row_premul_scalar(uint32_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = blend_pixels_premul(dst[i], src[i]);
+    }
+}
+
+#ifdef IMAGES_X86_SIMD
+
+// x / 255 for 0 <= x <= 65535, computed as (x * 0x8081) >> 23
+__attribute__((target("sse2"))) static inline __m128i div255_epu16_sse2(__m128i x)
+{
+    return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16((short)0x8081)), 7);
+}
+
+// Blends two pixels widened to 16-bit lanes: (fg * a + bg * (255 - a)) / 255
+__attribute__((target("sse2"))) static inline __m128i blend_epu16_sse2(__m128i fg, __m128i bg)
+{
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(fg, alpha), _mm_mullo_epi16(bg, inv_alpha));
+    return div255_epu16_sse2(sum);
+}
+
+__attribute__((target("sse2"))) static void blend_row_sse2(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i fg = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i fg_alpha = _mm_and_si128(fg, alpha_mask);
+
+        // Fast paths: fully transparent leaves dst untouched, fully opaque replaces it
+        int transparent = _mm_movemask_epi8(_mm_cmpeq_epi32(fg_alpha, zero));
+        if (transparent == 0xFFFF)
+            continue;
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(fg_alpha, alpha_mask));
+        if (opaque == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i *)(dst + i), fg);
+            continue;
+        }
+
+        __m128i bg = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = blend_epu16_sse2(_mm_unpacklo_epi8(fg, zero), _mm_unpacklo_epi8(bg, zero));
+        __m128i hi = blend_epu16_sse2(_mm_unpackhi_epi8(fg, zero), _mm_unpackhi_epi8(bg, zero));
+        __m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+        _mm_storeu_si128((__m128i *)(dst + i), result);
+    }
+
+    blend_row_scalar(dst + i, src + i, count - i);
+}
+
+// Premultiplied pixels widened to 16-bit lanes: fg + bg * (255 - a) / 255
+__attribute__((target("sse2"))) static inline __m128i blend_premul_epu16_sse2(__m128i fg, __m128i bg)
+{
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return _mm_add_epi16(fg, div255_epu16_sse2(_mm_mullo_epi16(bg, inv_alpha)));
+}
+
+__attribute__((target("sse2"))) static void blend_row_premul_sse2(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i fg = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i fg_alpha = _mm_and_si128(fg, alpha_mask);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(fg_alpha, zero)) == 0xFFFF)
+            continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(fg_alpha, alpha_mask)) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i *)(dst + i), fg);
+            continue;
+        }
+
+        __m128i bg = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = blend_premul_epu16_sse2(_mm_unpacklo_epi8(fg, zero), _mm_unpacklo_epi8(bg, zero));
+        __m128i hi = blend_premul_epu16_sse2(_mm_unpackhi_epi8(fg, zero), _mm_unpackhi_epi8(bg, zero));
+        __m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+        _mm_storeu_si128((__m128i *)(dst + i), result);
+    }
+
+    blend_row_premul_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i blend_epu16_avx2(__m256i fg, __m256i bg)
+{
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(fg, alpha), _mm256_mullo_epi16(bg, inv_alpha));
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi16((short)0x8081)), 7);
+}
+
+__attribute__((target("avx2"))) static void blend_row_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i fg = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i fg_alpha = _mm256_and_si256(fg, alpha_mask);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_alpha, zero)) == -1)
+            continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_alpha, alpha_mask)) == -1)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + i), fg);
+            continue;
+        }
+
+        // unpack/pack work per 128-bit lane, so the pixel order is preserved
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = blend_epu16_avx2(_mm256_unpacklo_epi8(fg, zero), _mm256_unpacklo_epi8(bg, zero));
+        __m256i hi = blend_epu16_avx2(_mm256_unpackhi_epi8(fg, zero), _mm256_unpackhi_epi8(bg, zero));
+        __m256i result = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), result);
+    }
+
+    blend_row_sse2(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i blend_premul_epu16_avx2(__m256i fg, __m256i bg)
+{
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    __m256i product = _mm256_mullo_epi16(bg, inv_alpha);
+    return _mm256_add_epi16(fg, _mm256_srli_epi16(_mm256_mulhi_epu16(product, _mm256_set1_epi16((short)0x8081)), 7));
+}
+
+__attribute__((target("avx2"))) static void blend_row_premul_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i fg = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i fg_alpha = _mm256_and_si256(fg, alpha_mask);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_alpha, zero)) == -1)
+            continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_alpha, alpha_mask)) == -1)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + i), fg);
+            continue;
+        }
+
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = blend_premul_epu16_avx2(_mm256_unpacklo_epi8(fg, zero), _mm256_unpacklo_epi8(bg, zero));
+        __m256i hi = blend_premul_epu16_avx2(_mm256_unpackhi_epi8(fg, zero), _mm256_unpackhi_epi8(bg, zero));
+        __m256i result = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), result);
+    }
+
+    blend_row_premul_sse2(dst + i, src + i, count - i);
+}
+
+#endif // IMAGES_X86_SIMD
+
+/* =========================================================================
+ * SPAN BLEND KERNELS
+ *
+ * Blend one color over a run of layer pixels, for the blend paint mode of the
+ * drawing primitives. Unlike flattening, the destination may be translucent,
+ * so the result is a full source-over with its own alpha. Opaque destination
+ * pixels take the same arithmetic as blend_pixels and are done in SIMD; others
+ * fall back to the scalar formula. Opaque colors are filled by the primitives
+ * instead, but every kernel handles any alpha.
+ * ========================================================================= */
+
+// Source-over of a straight color onto a straight pixel that may be translucent
+static inline uint32_t blend_color_straight(uint32_t dst, uint32_t color)
+{
+    unsigned int alpha = GET_A(color);
+    unsigned int dst_alpha = GET_A(dst);
+    if (alpha == 0)
+        return dst;
+    if (alpha == 255 || dst_alpha == 0)
+        return color;
+    if (dst_alpha == 255)
+        return blend_pixels(dst, color);
+
+    // Out alpha is a + da * (255 - a) / 255; each channel is weighted by what it contributes
+    unsigned int dst_weight = dst_alpha * (255 - alpha);
+    unsigned int total = alpha * 255 + dst_weight; // out alpha * 255
+    unsigned int r = (GET_R(color) * alpha * 255 + GET_R(dst) * dst_weight + total / 2) / total;
+    unsigned int g = (GET_G(color) * alpha * 255 + GET_G(dst) * dst_weight + total / 2) / total;
+    unsigned int b = (GET_B(color) * alpha * 255 + GET_B(dst) * dst_weight + total / 2) / total;
+    return COLOR((total + 127) / 255, r, g, b);
+}
+
+// Source-over of a premultiplied color onto a premultiplied pixel, alpha included
+static inline uint32_t blend_color_premul(uint32_t dst, uint32_t color)
+{
+    unsigned int inv_alpha = 255 - GET_A(color);
+    unsigned int a = GET_A(dst) * inv_alpha;
+    unsigned int r = GET_R(dst) * inv_alpha;
+    unsigned int g = GET_G(dst) * inv_alpha;
+    unsigned int b = GET_B(dst) * inv_alpha;
+    return COLOR(GET_A(color) + ((a * 0x8081) >> 23),
+                 GET_R(color) + ((r * 0x8081) >> 23),
+                 GET_G(color) + ((g * 0x8081) >> 23),
+                 GET_B(color) + ((b * 0x8081) >> 23));
+}
+
+static void blend_span_scalar(uint32_t *dst, int count, uint32_t color)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = blend_color_straight(dst[i], color);
+    }
+}
+
+static void blend_span_premul_scalar(uint32_t *dst, int count, uint32_t color)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = blend_color_premul(dst[i], color);
+    }
+}
+
+#ifdef IMAGES_X86_SIMD
+
+__attribute__((target("sse2"))) static void blend_span_sse2(uint32_t *dst, int count, uint32_t color)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    // fg * a is the same for every pixel; only bg * (255 - a) changes
+    const __m128i alpha = _mm_set1_epi16((short)GET_A(color));
+    const __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    const __m128i fg_term = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero), alpha);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i bg = _mm_loadu_si128((const __m128i *)(dst + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(bg, alpha_mask), alpha_mask)) != 0xFFFF)
+        {
+            blend_span_scalar(dst + i, 4, color);
+            continue;
+        }
+
+        __m128i lo = _mm_add_epi16(fg_term, _mm_mullo_epi16(_mm_unpacklo_epi8(bg, zero), inv_alpha));
+        __m128i hi = _mm_add_epi16(fg_term, _mm_mullo_epi16(_mm_unpackhi_epi8(bg, zero), inv_alpha));
+        __m128i result = _mm_packus_epi16(div255_epu16_sse2(lo), div255_epu16_sse2(hi));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(result, alpha_mask));
+    }
+
+    blend_span_scalar(dst + i, count - i, color);
+}
+
+__attribute__((target("sse2"))) static void blend_span_premul_sse2(uint32_t *dst, int count, uint32_t color)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fg = _mm_set1_epi32((int)color);
+    const __m128i inv_alpha = _mm_set1_epi16((short)(255 - GET_A(color)));
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        // fg + bg * (255 - a) / 255 never exceeds 255 per byte, so the add cannot carry
+        __m128i bg = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = div255_epu16_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(bg, zero), inv_alpha));
+        __m128i hi = div255_epu16_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(bg, zero), inv_alpha));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(_mm_packus_epi16(lo, hi), fg));
+    }
+
+    blend_span_premul_scalar(dst + i, count - i, color);
+}
+
+__attribute__((target("avx2"))) static inline __m256i div255_epu16_avx2(__m256i x)
+{
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(x, _mm256_set1_epi16((short)0x8081)), 7);
+}
+
+__attribute__((target("avx2"))) static void blend_span_avx2(uint32_t *dst, int count, uint32_t color)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i alpha = _mm256_set1_epi16((short)GET_A(color));
+    const __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    const __m256i fg_term = _mm256_mullo_epi16(_mm256_unpacklo_epi8(_mm256_set1_epi32((int)color), zero), alpha);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(dst + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(bg, alpha_mask), alpha_mask)) != -1)
+        {
+            blend_span_scalar(dst + i, 8, color);
+            continue;
+        }
+
+        __m256i lo = _mm256_add_epi16(fg_term, _mm256_mullo_epi16(_mm256_unpacklo_epi8(bg, zero), inv_alpha));
+        __m256i hi = _mm256_add_epi16(fg_term, _mm256_mullo_epi16(_mm256_unpackhi_epi8(bg, zero), inv_alpha));
+        __m256i result = _mm256_packus_epi16(div255_epu16_avx2(lo), div255_epu16_avx2(hi));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(result, alpha_mask));
+    }
+
+    blend_span_sse2(dst + i, count - i, color);
+}
+
+__attribute__((target("avx2"))) static void blend_span_premul_avx2(uint32_t *dst, int count, uint32_t color)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fg = _mm256_set1_epi32((int)color);
+    const __m256i inv_alpha = _mm256_set1_epi16((short)(255 - GET_A(color)));
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = div255_epu16_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(bg, zero), inv_alpha));
+        __m256i hi = div255_epu16_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(bg, zero), inv_alpha));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi8(_mm256_packus_epi16(lo, hi), fg));
+    }
+
+    blend_span_premul_sse2(dst + i, count - i, color);
+}
+
+#endif // IMAGES_X86_SIMD
+
+/* =========================================================================
+ * BLEND MODE KERNELS
+ *
+ * Layers with another blend mode than BLEND_MODE_NORMAL, or an opacity below
+ * 255, are composited as (B(fg, bg) * a + bg * (255 - a)) / 255 per channel,
+ * where a is the pixel alpha times the opacity / 255 and B the mode function.
+ * For NORMAL at full opacity this is the formula of the blend kernels above.
+ * The templates below take the mode as a constant and are always inlined, so
+ * every mode gets its own loop without any per-pixel branch on the mode.
+ * All levels use the same exact integer arithmetic and match bit for bit.
+ * ========================================================================= */
+
+#define DIV255(x) (((x) * 0x8081u) >> 23)
+
+#define BLEND_MODE_INLINE static inline __attribute__((always_inline))
+
+BLEND_MODE_INLINE unsigned int blend_mode_channel(BlendMode mode, unsigned int bg, unsigned int fg)
+{
+    switch (mode)
+    {
+    case BLEND_MODE_MULTIPLY:
+        return DIV255(fg * bg);
+    case BLEND_MODE_SCREEN:
+        return fg + bg - DIV255(fg * bg);
+    case BLEND_MODE_ADD:
+        return fg + bg < 255 ? fg + bg : 255;
+    case BLEND_MODE_DIFFERENCE:
+        return fg > bg ? fg - bg : bg - fg;
+    default:
+        return fg;
+    }
+}
+
+BLEND_MODE_INLINE uint32_t blend_mode_pixel(BlendMode mode, uint32_t bg, uint32_t fg, unsigned int opacity)
+{
+    unsigned int alpha = DIV255(GET_A(fg) * opacity);
+    if (alpha == 0)
+        return bg;
+
+    unsigned int inv_alpha = 255 - alpha;
+    unsigned int r = blend_mode_channel(mode, GET_R(bg), GET_R(fg)) * alpha + GET_R(bg) * inv_alpha;
+    unsigned int g = blend_mode_channel(mode, GET_G(bg), GET_G(fg)) * alpha + GET_G(bg) * inv_alpha;
+    unsigned int b = blend_mode_channel(mode, GET_B(bg), GET_B(fg)) * alpha + GET_B(bg) * inv_alpha;
+    return COLOR(255, DIV255(r), DIV255(g), DIV255(b));
+}
+
+BLEND_MODE_INLINE void blend_mode_row_scalar(BlendMode mode, uint32_t *dst, const uint32_t *src, int count, unsigned int opacity)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = blend_mode_pixel(mode, dst[i], src[i], opacity);
+    }
+}
+
+#ifdef IMAGES_X86_SIMD
+
+// Mode function on 16-bit lanes; every intermediate value fits in an unsigned lane
+__attribute__((target("sse2"))) BLEND_MODE_INLINE __m128i blend_mode_epu16_sse2(BlendMode mode, __m128i bg, __m128i fg)
+{
+    switch (mode)
+    {
+    case BLEND_MODE_MULTIPLY:
+        return div255_epu16_sse2(_mm_mullo_epi16(fg, bg));
+    case BLEND_MODE_SCREEN:
+        return _mm_sub_epi16(_mm_add_epi16(fg, bg), div255_epu16_sse2(_mm_mullo_epi16(fg, bg)));
+    case BLEND_MODE_ADD:
+        return _mm_min_epi16(_mm_add_epi16(fg, bg), _mm_set1_epi16(255));
+    case BLEND_MODE_DIFFERENCE:
+        return _mm_sub_epi16(_mm_max_epi16(fg, bg), _mm_min_epi16(fg, bg));
+    default:
+        return fg;
+    }
+}
+
+// Two pixels widened to 16-bit lanes
+__attribute__((target("sse2"))) BLEND_MODE_INLINE __m128i blend_mode_pair_sse2(BlendMode mode, __m128i fg, __m128i bg, __m128i opacity)
+{
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = div255_epu16_sse2(_mm_mullo_epi16(alpha, opacity));
+    __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(blend_mode_epu16_sse2(mode, bg, fg), alpha), _mm_mullo_epi16(bg, inv_alpha));
+    return div255_epu16_sse2(sum);
+}
+
+__attribute__((target("sse2"))) BLEND_MODE_INLINE void blend_mode_row_sse2(BlendMode mode, uint32_t *dst, const uint32_t *src, int count, unsigned int opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i opacity16 = _mm_set1_epi16((short)opacity);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i fg = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(fg, alpha_mask), zero)) == 0xFFFF)
+            continue;
+
+        __m128i bg = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = blend_mode_pair_sse2(mode, _mm_unpacklo_epi8(fg, zero), _mm_unpacklo_epi8(bg, zero), opacity16);
+        __m128i hi = blend_mode_pair_sse2(mode, _mm_unpackhi_epi8(fg, zero), _mm_unpackhi_epi8(bg, zero), opacity16);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask));
+    }
+
+    blend_mode_row_scalar(mode, dst + i, src + i, count - i, opacity);
+}
+
+__attribute__((target("avx2"))) BLEND_MODE_INLINE __m256i blend_mode_epu16_avx2(BlendMode mode, __m256i bg, __m256i fg)
+{
+    const __m256i magic = _mm256_set1_epi16((short)0x8081);
+    switch (mode)
+    {
+    case BLEND_MODE_MULTIPLY:
+        return _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(fg, bg), magic), 7);
+    case BLEND_MODE_SCREEN:
+        return _mm256_sub_epi16(_mm256_add_epi16(fg, bg), _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(fg, bg), magic), 7));
+    case BLEND_MODE_ADD:
+        return _mm256_min_epi16(_mm256_add_epi16(fg, bg), _mm256_set1_epi16(255));
+    case BLEND_MODE_DIFFERENCE:
+        return _mm256_sub_epi16(_mm256_max_epi16(fg, bg), _mm256_min_epi16(fg, bg));
+    default:
+        return fg;
+    }
+}
+
+__attribute__((target("avx2"))) BLEND_MODE_INLINE __m256i blend_mode_pair_avx2(BlendMode mode, __m256i fg, __m256i bg, __m256i opacity)
+{
+    const __m256i magic = _mm256_set1_epi16((short)0x8081);
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(alpha, opacity), magic), 7);
+    __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(blend_mode_epu16_avx2(mode, bg, fg), alpha), _mm256_mullo_epi16(bg, inv_alpha));
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(sum, magic), 7);
+}
+
+__attribute__((target("avx2"))) BLEND_MODE_INLINE void blend_mode_row_avx2(BlendMode mode, uint32_t *dst, const uint32_t *src, int count, unsigned int opacity)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i opacity16 = _mm256_set1_epi16((short)opacity);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i fg = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(fg, alpha_mask), zero)) == -1)
+            continue;
+
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = blend_mode_pair_avx2(mode, _mm256_unpacklo_epi8(fg, zero), _mm256_unpacklo_epi8(bg, zero), opacity16);
+        __m256i hi = blend_mode_pair_avx2(mode, _mm256_unpackhi_epi8(fg, zero), _mm256_unpackhi_epi8(bg, zero), opacity16);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask));
+    }
+
+    blend_mode_row_sse2(mode, dst + i, src + i, count - i, opacity);
+}
+
+#endif // IMAGES_X86_SIMD
+
+typedef void (*BlendModeKernel)(uint32_t *dst, const uint32_t *src, int count, unsigned int opacity);
+
+// X(name, mode) for every blend mode; instantiates the templates once per mode and level
+#define FOR_EACH_BLEND_MODE(X)             \
+    X(normal, BLEND_MODE_NORMAL)           \
+    X(multiply, BLEND_MODE_MULTIPLY)       \
+    X(screen, BLEND_MODE_SCREEN)           \
+    X(add, BLEND_MODE_ADD)                 \
+    X(difference, BLEND_MODE_DIFFERENCE)
+
+#define DEFINE_BLEND_MODE_KERNEL(level, target_attribute, name, mode)                                                \
+    target_attribute static void blend_##name##_row_##level(uint32_t *dst, const uint32_t *src, int count, unsigned int opacity) \
+    {                                                                                                                 \
+        blend_mode_row_##level(mode, dst, src, count, opacity);                                                       \
+    }
+
+#define DEFINE_SCALAR_BLEND_MODE_KERNEL(name, mode) DEFINE_BLEND_MODE_KERNEL(scalar, , name, mode)
+FOR_EACH_BLEND_MODE(DEFINE_SCALAR_BLEND_MODE_KERNEL)
+
+#define SCALAR_BLEND_MODE_ENTRY(name, mode) [mode] = blend_##name##_row_scalar,
+static const BlendModeKernel blend_mode_kernels_scalar[BLEND_MODE_COUNT] = {FOR_EACH_BLEND_MODE(SCALAR_BLEND_MODE_ENTRY)};
+
+#ifdef IMAGES_X86_SIMD
+#define DEFINE_SSE2_BLEND_MODE_KERNEL(name, mode) DEFINE_BLEND_MODE_KERNEL(sse2, __attribute__((target("sse2"))), name, mode)
+#define DEFINE_AVX2_BLEND_MODE_KERNEL(name, mode) DEFINE_BLEND_MODE_KERNEL(avx2, __attribute__((target("avx2"))), name, mode)
+FOR_EACH_BLEND_MODE(DEFINE_SSE2_BLEND_MODE_KERNEL)
+FOR_EACH_BLEND_MODE(DEFINE_AVX2_BLEND_MODE_KERNEL)
+
+#define SSE2_BLEND_MODE_ENTRY(name, mode) [mode] = blend_##name##_row_sse2,
+#define AVX2_BLEND_MODE_ENTRY(name, mode) [mode] = blend_##name##_row_avx2,
+static const BlendModeKernel blend_mode_kernels_sse2[BLEND_MODE_COUNT] = {FOR_EACH_BLEND_MODE(SSE2_BLEND_MODE_ENTRY)};
+static const BlendModeKernel blend_mode_kernels_avx2[BLEND_MODE_COUNT] = {FOR_EACH_BLEND_MODE(AVX2_BLEND_MODE_ENTRY)};
+#endif
+
+/* =========================================================================
+ * KERNEL DISPATCH
+ * ========================================================================= */
+
+typedef void (*BlendRowKernel)(uint32_t *dst, const uint32_t *src, int count);
+typedef void (*BlendSpanKernel)(uint32_t *dst, int count, uint32_t color);
+
+static BlendRowKernel blend_row_kernel = NULL;
+static BlendRowKernel blend_row_premul_kernel = NULL;
+static BlendSpanKernel blend_span_kernel = blend_span_scalar;
+static BlendSpanKernel blend_span_premul_kernel = blend_span_premul_scalar;
+static const BlendModeKernel *blend_mode_kernels = blend_mode_kernels_scalar;
+static SimdLevel simd_level = SIMD_LEVEL_SCALAR;
+
+static void select_conversion_kernels(SimdLevel level);
+static SimdLevel detect_simd_level(void)
+{
+#ifdef IMAGES_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_LEVEL_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_LEVEL_SSE2;
+#endif
+    return SIMD_LEVEL_SCALAR;
+}
+
+SimdLevel set_simd_level(SimdLevel level)
+{
+    SimdLevel supported = detect_simd_level();
+    if (level > supported)
+        level = supported;
+
+    switch (level)
+    {
+#ifdef IMAGES_X86_SIMD
+    case SIMD_LEVEL_AVX2:
+        blend_row_kernel = blend_row_avx2;
+        blend_row_premul_kernel = blend_row_premul_avx2;
+        blend_span_kernel = blend_span_avx2;
+        blend_span_premul_kernel = blend_span_premul_avx2;
+        blend_mode_kernels = blend_mode_kernels_avx2;
+        break;
+    case SIMD_LEVEL_SSE2:
+        blend_row_kernel = blend_row_sse2;
+        blend_row_premul_kernel = blend_row_premul_sse2;
+        blend_span_kernel = blend_span_sse2;
+        blend_span_premul_kernel = blend_span_premul_sse2;
+        blend_mode_kernels = blend_mode_kernels_sse2;
+        break;
+#endif
+    default:
+        level = SIMD_LEVEL_SCALAR;
+        blend_row_kernel = blend_row_scalar;
+        blend_row_premul_kernel = blend_row_premul_scalar;
+        blend_span_kernel = blend_span_scalar;
+        blend_span_premul_kernel = blend_span_premul_scalar;
+        blend_mode_kernels = blend_mode_kernels_scalar;
+        break;
+    }
+
+    select_conversion_kernels(level);
+    simd_level = level;
+    return level;
+}
+
+SimdLevel get_simd_level(void)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+    return simd_level;
+}
+
+void blend_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+    blend_row_kernel(dst, src, count);
+}
+
+void blend_row_premultiplied(uint32_t *dst, const uint32_t *src, int count)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+    blend_row_premul_kernel(dst, src, count);
+}
+
+void blend_color_span(uint32_t *dst, int count, uint32_t color, int premultiplied)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+    (premultiplied ? blend_span_premul_kernel : blend_span_kernel)(dst, count, color);
+}
+
+uint32_t blend_color_pixel(uint32_t dst, uint32_t color, int premultiplied)
+{
+    return premultiplied ? blend_color_premul(dst, color) : blend_color_straight(dst, color);
+}
+
+/* =========================================================================
+ * COMPOSITING
+ * ========================================================================= */
+
+// Hidden and zero-opacity layers contribute nothing
+static inline int layer_is_composited(const Layer *layer)
+{
+    return layer->visible && layer->opacity > 0;
+}
+
+// Coverage is only trusted once the image opted in; otherwise only unallocated tiles are skipped
+static inline TileCoverage flatten_tile_coverage(const Image *img, Layer *layer, int tx, int ty)
+{
+    if (img->tile_culling)
+        return get_tile_coverage(layer, tx, ty);
+    if (!layer_read_ptr(layer, tx * LAYER_TILE_SIZE, ty * LAYER_TILE_SIZE))
+        return TILE_COVERAGE_TRANSPARENT;
+    return TILE_COVERAGE_MIXED;
+}
+
+// Only a NORMAL layer at full opacity replaces what is below its opaque tiles
+static inline int layer_hides_below(const Image *img, Layer *layer, int tx, int ty)
+{
+    return layer->visible && layer->opacity == 255 && layer->blend_mode == BLEND_MODE_NORMAL &&
+           flatten_tile_coverage(img, layer, tx, ty) == TILE_COVERAGE_OPAQUE;
+}
+
+// Scales every channel of a premultiplied color, which scales its alpha and keeps it premultiplied
+static inline uint32_t scale_premultiplied(uint32_t color, unsigned int opacity)
+{
+    return COLOR(DIV255(GET_A(color) * opacity), DIV255(GET_R(color) * opacity),
+                 DIV255(GET_G(color) * opacity), DIV255(GET_B(color) * opacity));
+}
+
+/*
+Blends a run of at most LAYER_TILE_SIZE layer pixels over out with the layer's
+blend mode and opacity. The kernel is picked once per run. Premultiplied pixels
+are scaled (NORMAL) or converted back to straight colors (other modes) in a
+scratch run first, since the mode functions work on straight colors.
+*/
+static void composite_layer_run(uint32_t *out, const Layer *layer, const uint32_t *src, int n)
+{
+    if (layer->blend_mode == BLEND_MODE_NORMAL && layer->opacity == 255)
+    {
+        BlendRowKernel kernel = layer->premultiplied ? blend_row_premul_kernel : blend_row_kernel;
+        kernel(out, src, n);
+        return;
+    }
+
+    uint32_t scratch[LAYER_TILE_SIZE];
+    if (layer->premultiplied)
+    {
+        if (layer->blend_mode == BLEND_MODE_NORMAL)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                scratch[i] = scale_premultiplied(src[i], (unsigned int)layer->opacity);
+            }
+            blend_row_premul_kernel(out, scratch, n);
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            scratch[i] = unpremultiply_color(src[i]);
+        }
+        src = scratch;
+    }
+
+    blend_mode_kernels[layer->blend_mode](out, src, n, (unsigned int)layer->opacity);
+}
+
+/*
+The run is split at tile boundaries, which also keeps every run contiguous in
+tiled layers. Within a tile column, the topmost NORMAL, fully opaque layer
+whose tile is fully opaque replaces the background and hides everything below
+it (opaque pixels are the same whether premultiplied or not), and layers whose
+tile is fully transparent, hidden layers and zero-opacity layers are skipped.
+These shortcuts give exactly what blending would as long as the coverage is up
+to date, which is why cached coverage is only used after enable_tile_culling.
+*/
+void flatten_row(const Image *img, int y, int x, int count, uint32_t *out)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+
+    int ty = y / LAYER_TILE_SIZE;
+    int end = x + count;
+    uint64_t blended = 0, copied = 0, skipped = 0;
+
+    while (x < end)
+    {
+        int tx = x / LAYER_TILE_SIZE;
+        int n = (tx + 1) * LAYER_TILE_SIZE - x;
+        if (n > end - x)
+            n = end - x;
+
+        // Find the topmost layer that fully covers this tile
+        int first = -1;
+        for (int l = img->num_layers - 1; l >= 0; l--)
+        {
+            if (layer_hides_below(img, img->layers[l], tx, ty))
+            {
+                first = l;
+                break;
+            }
+        }
+
+        if (first >= 0)
+        {
+            memcpy(out, layer_read_ptr(img->layers[first], x, y), (size_t)n * sizeof(uint32_t));
+            copied += n;
+            skipped += (uint64_t)first * n;
+            first++;
+        }
+        else
+        {
+            first = 0;
+            for (int i = 0; i < n; i++)
+            {
+                out[i] = BACKGROUND_COLOR; // Start with Black
+            }
+        }
+
+        // Blend the remaining layers bottom-up
+        for (int l = first; l < img->num_layers; l++)
+        {
+            Layer *layer = img->layers[l];
+            if (!layer_is_composited(layer) || flatten_tile_coverage(img, layer, tx, ty) == TILE_COVERAGE_TRANSPARENT)
+            {
+                skipped += n;
+                continue;
+            }
+            composite_layer_run(out, layer, layer_read_ptr(layer, x, y), n);
+            blended += n;
+        }
+
+        out += n;
+        x += n;
+    }
+
+    STATS_ADD(pixels_blended, blended);
+    STATS_ADD(pixels_copied, copied);
+    STATS_ADD(pixels_skipped, skipped);
+}
+
+/* =========================================================================
+ * FORMAT CONVERSION
+ *
+ * Luma is defined as (uint8_t)(0.299 * R + 0.587 * G + 0.114 * B) evaluated in
+ * double precision. The kernels compute it in integers instead: with
+ * N = 299 * R + 587 * G + 114 * B the luma is N / 1000, except that the double
+ * sum sometimes rounds just below an exact integer and truncates one lower.
+ * That only happens when N is a multiple of 1000, and for a given (R, G) at most
+ * one B makes it so, so a 64 Kbit table indexed by (R, G) records every such
+ * case. All kernels match the double formula for all 2^24 colors.
+ * ========================================================================= */
+
+// Reference luma, kept to build the correction table
+static inline uint8_t pixel_luma_reference(unsigned int r, unsigned int g, unsigned int b)
+{
+    return (uint8_t)(0.299 * r + 0.587 * g + 0.114 * b);
+}
+
+// Bit (R << 8 | G) is set when the exact-integer luma of that (R, G) is one too high
+static uint8_t luma_corrections[65536 / 8];
+static pthread_once_t luma_corrections_once = PTHREAD_ONCE_INIT;
+
+static void build_luma_corrections(void)
+{
+    for (unsigned int r = 0; r < 256; r++)
+    {
+        for (unsigned int g = 0; g < 256; g++)
+        {
+            // 114 * B = -(299 * R + 587 * G) mod 1000 only has a solution for an even
+            // left part, B = half * 57^-1 mod 500 (57 * 193 = 1 mod 500)
+            unsigned int partial = 299 * r + 587 * g;
+            if (partial % 2)
+                continue;
+            unsigned int b = ((1000 - partial % 1000) % 1000 / 2 * 193) % 500;
+            if (b > 255)
+                continue;
+
+            unsigned int n = partial + 114 * b;
+            if (pixel_luma_reference(r, g, b) != n / 1000)
+                luma_corrections[(r << 8 | g) / 8] |= (uint8_t)(1 << (g % 8));
+        }
+    }
+}
+
+static inline unsigned int luma_correction(uint32_t color)
+{
+    unsigned int rg = (color >> 8) & 0xFFFF;
+    return (luma_corrections[rg / 8] >> (rg % 8)) & 1;
+}
+
+static inline uint8_t pixel_luma(uint32_t color)
+{
+    unsigned int n = 299 * GET_R(color) + 587 * GET_G(color) + 114 * GET_B(color);
+    unsigned int luma = n / 1000;
+    if (luma * 1000 == n)
+        luma -= luma_correction(color);
+    return (uint8_t)luma;
+}
+
+static void luma_row_scalar(const uint32_t *src, int count, uint8_t *dst)
+{
+    for (int x = 0; x < count; x++)
+    {
+        dst[x] = pixel_luma(src[x]);
+    }
+}
+
+// Fixes up the pixels whose N was an exact multiple of 1000 (bit i of exact_mask = pixel i)
+static inline void correct_luma_lanes(const uint32_t *src, uint8_t *dst, unsigned int exact_mask)
+{
+    while (exact_mask)
+    {
+        int i = __builtin_ctz(exact_mask);
+        dst[i] -= (uint8_t)luma_correction(src[i]);
+        exact_mask &= exact_mask - 1;
+    }
+}
+
+#ifdef IMAGES_X86_SIMD
+
+// N = 299 * R + 587 * G + 114 * B of four pixels, as 32-bit lanes
+__attribute__((target("sse2"))) static inline __m128i luma_sums_sse2(__m128i pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set_epi16(0, 299, 587, 114, 0, 299, 587, 114); // A, R, G, B
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+    lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+// N / 1000 for 16-bit lanes holding N / 8: (n * 33555) >> 22 is exact for n < 59000
+__attribute__((target("sse2"))) static inline __m128i div125_epu16_sse2(__m128i n)
+{
+    return _mm_srli_epi16(_mm_mulhi_epu16(n, _mm_set1_epi16((short)33555)), 6);
+}
+
+__attribute__((target("sse2"))) static void luma_row_sse2(const uint32_t *src, int count, uint8_t *dst)
+{
+    const __m128i round_up = _mm_set1_epi32(999);
+    int x = 0;
+
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i n0 = luma_sums_sse2(_mm_loadu_si128((const __m128i *)(src + x)));
+        __m128i n1 = luma_sums_sse2(_mm_loadu_si128((const __m128i *)(src + x + 4)));
+
+        // floor(N / 1000) and ceil(N / 1000) are equal exactly when N is a multiple of 1000
+        __m128i luma = div125_epu16_sse2(_mm_packs_epi32(_mm_srli_epi32(n0, 3), _mm_srli_epi32(n1, 3)));
+        __m128i ceil = div125_epu16_sse2(_mm_packs_epi32(_mm_srli_epi32(_mm_add_epi32(n0, round_up), 3),
+                                                         _mm_srli_epi32(_mm_add_epi32(n1, round_up), 3)));
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(luma, luma));
+
+        __m128i exact = _mm_cmpeq_epi16(luma, ceil);
+        unsigned int exact_mask = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(exact, exact)) & 0xFF;
+        correct_luma_lanes(src + x, dst + x, exact_mask);
+    }
+
+    luma_row_scalar(src + x, count - x, dst + x);
+}
+
+__attribute__((target("avx2"))) static inline __m256i luma_sums_avx2(__m256i pixels)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weights = _mm256_set_epi16(0, 299, 587, 114, 0, 299, 587, 114, 0, 299, 587, 114, 0, 299, 587, 114);
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), weights);
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), weights);
+    lo = _mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32));
+    hi = _mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32));
+    // unpack works per 128-bit lane, so this is pixels 0-3 | 4-7 in order
+    return _mm256_unpacklo_epi64(_mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)), _mm256_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+__attribute__((target("avx2"))) static inline __m256i div1000_epu32_avx2(__m256i n)
+{
+    return _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(n, 3), _mm256_set1_epi32(33555)), 22);
+}
+
+__attribute__((target("avx2"))) static void luma_row_avx2(const uint32_t *src, int count, uint8_t *dst)
+{
+    const __m256i round_up = _mm256_set1_epi32(999);
+    const __m256i gather_low_bytes = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    int x = 0;
+
+    for (; x + 8 <= count; x += 8)
+    {
+        __m256i n = luma_sums_avx2(_mm256_loadu_si256((const __m256i *)(src + x)));
+        __m256i luma = div1000_epu32_avx2(n);
+        __m256i ceil = div1000_epu32_avx2(_mm256_add_epi32(n, round_up));
+
+        // 32 -> 8 bits per lane leaves pixels 0-3 in dword 0 and pixels 4-7 in dword 4
+        __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(luma, luma), luma);
+        bytes = _mm256_permutevar8x32_epi32(bytes, gather_low_bytes);
+        _mm_storel_epi64((__m128i *)(dst + x), _mm256_castsi256_si128(bytes));
+
+        unsigned int exact_mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(luma, ceil)));
+        correct_luma_lanes(src + x, dst + x, exact_mask);
+    }
+
+    luma_row_sse2(src + x, count - x, dst + x);
+}
+
+#endif // IMAGES_X86_SIMD
+
+/*
+Writes the top n bits (n <= 8) of bits at bit offset bit of dst, MSB-first,
+leaving the surrounding bits untouched. Only touches the bytes it writes to.
+*/
+static inline void put_bits(uint8_t *dst, size_t bit, unsigned int bits, int n)
+{
+    uint8_t *p = dst + bit / 8;
+    int shift = (int)(bit % 8);
+    unsigned int value = (bits & 0xFF) << 8 >> shift;
+    unsigned int mask = (0xFFu << (8 - n) & 0xFF) << 8 >> shift; // the n top bits, shifted like value
+
+    p[0] = (uint8_t)((p[0] & ~(mask >> 8)) | (value >> 8));
+    if (mask & 0xFF)
+        p[1] = (uint8_t)((p[1] & ~mask) | (value & 0xFF));
+}
+
+// PBM convention: 1 = black (luminance < 128), 0 = white. Bits are packed MSB-first,
+// 8 pixels per output byte.
+static void pack_threshold_scalar(const uint8_t *luma, int count, uint8_t *dst, size_t bit_offset)
+{
+    for (int x = 0; x < count; x += 8)
+    {
+        int n = count - x < 8 ? count - x : 8;
+        unsigned int bits = 0;
+        for (int i = 0; i < n; i++)
+        {
+            bits |= (unsigned int)(luma[x + i] < 128) << (7 - i);
+        }
+        put_bits(dst, bit_offset + x, bits, n);
+    }
+}
+
+#ifdef IMAGES_X86_SIMD
+
+__attribute__((target("sse2"))) static void pack_threshold_sse2(const uint8_t *luma, int count, uint8_t *dst, size_t bit_offset)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i all_ones = _mm_set1_epi8(-1);
+    const __m128i bit_values = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    int x = 0;
+
+    for (; x + 16 <= count; x += 16)
+    {
+        // luma < 128 exactly when the byte is non-negative as a signed value
+        __m128i black = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(luma + x)), all_ones);
+        // summing the selected bit values of each 8 pixels assembles their output byte
+        __m128i sums = _mm_sad_epu8(_mm_and_si128(black, bit_values), zero);
+        put_bits(dst, bit_offset + x, (unsigned int)_mm_cvtsi128_si32(sums), 8);
+        put_bits(dst, bit_offset + x + 8, (unsigned int)_mm_extract_epi16(sums, 4), 8);
+    }
+
+    pack_threshold_scalar(luma + x, count - x, dst, bit_offset + x);
+}
+
+#endif // IMAGES_X86_SIMD
+
+typedef void (*LumaRowKernel)(const uint32_t *src, int count, uint8_t *dst);
+typedef void (*PackThresholdKernel)(const uint8_t *luma, int count, uint8_t *dst, size_t bit_offset);
+
+static LumaRowKernel luma_row_kernel = luma_row_scalar;
+static PackThresholdKernel pack_threshold_kernel = pack_threshold_scalar;
+
+static void select_conversion_kernels(SimdLevel level)
+{
+    switch (level)
+    {
+#ifdef IMAGES_X86_SIMD
+    case SIMD_LEVEL_AVX2:
+        luma_row_kernel = luma_row_avx2;
+        pack_threshold_kernel = pack_threshold_sse2;
+        break;
+    case SIMD_LEVEL_SSE2:
+        luma_row_kernel = luma_row_sse2;
+        pack_threshold_kernel = pack_threshold_sse2;
+        break;
+#endif
+    default:
+        luma_row_kernel = luma_row_scalar;
+        pack_threshold_kernel = pack_threshold_scalar;
+        break;
+    }
+}
+
+static void convert_row_rgba32(const uint32_t *src, int count, uint8_t *dst, size_t bit_offset)
+{
+    (void)bit_offset;
+    memcpy(dst, src, (size_t)count * sizeof(uint32_t));
+}
+
+static void convert_row_rgb24(const uint32_t *src, int count, uint8_t *dst, size_t bit_offset)
+{
+    (void)bit_offset;
+    for (int x = 0; x < count; x++)
+    {
+        uint32_t color = src[x];
+        dst[x * 3 + 0] = (uint8_t)GET_R(color);
+        dst[x * 3 + 1] = (uint8_t)GET_G(color);
+        dst[x * 3 + 2] = (uint8_t)GET_B(color);
+    }
+}
+
+static void convert_row_grayscale8(const uint32_t *src, int count, uint8_t *dst, size_t bit_offset)
+{
+    (void)bit_offset;
+    luma_row_kernel(src, count, dst);
+}
+
+static void convert_row_binary1(const uint32_t *src, int count, uint8_t *dst, size_t bit_offset)
+{
+    uint8_t luma[256];
+
+    for (int x = 0; x < count; x += (int)sizeof(luma))
+    {
+        int n = count - x < (int)sizeof(luma) ? count - x : (int)sizeof(luma);
+        luma_row_kernel(src + x, n, luma);
+        pack_threshold_kernel(luma, n, dst, bit_offset + x);
+    }
+}
+
+RowConverter get_row_converter(ArrayDataFormat format)
+{
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+    if (format == ARRAY_DATA_FORMAT_GRAYSCALE8 || format == ARRAY_DATA_FORMAT_BINARY1)
+        pthread_once(&luma_corrections_once, build_luma_corrections);
+
+    switch (format)
+    {
+    case ARRAY_DATA_FORMAT_RGBA32:
+        return convert_row_rgba32;
+    case ARRAY_DATA_FORMAT_RGB24:
+        return convert_row_rgb24;
+    case ARRAY_DATA_FORMAT_GRAYSCALE8:
+        return convert_row_grayscale8;
+    case ARRAY_DATA_FORMAT_BINARY1:
+        return convert_row_binary1;
+    default:
+        return NULL;
+    }
+}
+
+/* =========================================================================
+ * COMPOSITE CACHE
+ * ========================================================================= */
+
+// Above this many dirty rectangles per update, they are merged into their bounding box
+#define CACHE_MAX_DIRTY_RECTS 64
+
+struct CompositeCache
+{
+    uint32_t *pixels; // flattened ARGB, width * height
+    int valid;        // pixels match the layers recorded below
+
+    // Layers that had been drawn on (version != 0) at the last update, bottom-up.
+    // Untouched layers are fully transparent, so they never affect the composite.
+    uint64_t *layer_ids;
+    uint32_t *layer_versions;
+    int num_layers;
+    int capacity;
+};
+
+int enable_image_cache(Image *img)
+{
+    if (!img)
+        return 1;
+    if (img->cache)
+        return 0;
+
+    struct CompositeCache *cache = (struct CompositeCache *)calloc(1, sizeof(struct CompositeCache));
+    if (!cache)
+        goto enable_cache_err_alloc;
+
+    cache->pixels = (uint32_t *)malloc((size_t)img->width * img->height * sizeof(uint32_t));
+    if (!cache->pixels)
+        goto enable_cache_err_alloc;
+
+    img->cache = cache;
+    return 0;
+
+enable_cache_err_alloc:
+    fprintf(stderr, "Error: Unable to allocate memory for composite cache\n");
+    free(cache);
+    return 1;
+}
+
+void disable_image_cache(Image *img)
+{
+    if (!img || !img->cache)
+        return;
+
+    free(img->cache->pixels);
+    free(img->cache->layer_ids);
+    free(img->cache->layer_versions);
+    free(img->cache);
+    img->cache = NULL;
+}
+
+void enable_tile_culling(Image *img)
+{
+    if (img)
+        img->tile_culling = 1;
+}
+
+void disable_tile_culling(Image *img)
+{
+    if (img)
+        img->tile_culling = 0;
+}
+
+typedef struct
+{
+    const Image *img;
+    ImageRect rect;
+} CompositeRectJob;
+
+static void composite_rect_band(void *ctx, int band)
+{
+    CompositeRectJob *job = (CompositeRectJob *)ctx;
+    const Image *img = job->img;
+
+    int y0 = job->rect.y + band * FLATTEN_BAND_ROWS;
+    int y1 = y0 + FLATTEN_BAND_ROWS;
+    if (y1 > job->rect.y + job->rect.h)
+        y1 = job->rect.y + job->rect.h;
+
+    uint64_t start = stats_clock();
+    for (int y = y0; y < y1; y++)
+    {
+        flatten_row(img, y, job->rect.x, job->rect.w, img->cache->pixels + (size_t)y * img->width + job->rect.x);
+    }
+    stats_end_stage(IMAGE_STAGE_FLATTEN, "composite_cache_band", start);
+}
+
+static void composite_rect(const Image *img, ImageRect rect)
+{
+    CompositeRectJob job = {img, rect};
+    parallel_for((rect.h + FLATTEN_BAND_ROWS - 1) / FLATTEN_BAND_ROWS, composite_rect_band, &job);
+}
+
+/*
+Brings the cached composite up to date. When the drawn-on layers are the same
+as last time, only the regions they logged since their cached version are
+recomposited; any other change to the layer stack recomposites the full frame.
+*/
+static int update_image_cache(const Image *img)
+{
+    struct CompositeCache *cache = img->cache;
+
+    if (img->num_layers > cache->capacity)
+    {
+        uint64_t *ids = (uint64_t *)realloc(cache->layer_ids, img->num_layers * sizeof(uint64_t));
+        if (ids)
+            cache->layer_ids = ids;
+        uint32_t *versions = (uint32_t *)realloc(cache->layer_versions, img->num_layers * sizeof(uint32_t));
+        if (versions)
+            cache->layer_versions = versions;
+
+        if (!ids || !versions)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for composite cache\n");
+            cache->valid = 0;
+            return 1;
+        }
+        cache->capacity = img->num_layers;
+    }
+
+    int drawn = 0;
+    int same_stack = cache->valid;
+    for (int i = 0; i < img->num_layers; i++)
+    {
+        Layer *layer = img->layers[i];
+        if (layer->version == 0)
+            continue;
+        if (drawn >= cache->num_layers || cache->layer_ids[drawn] != layer->id)
+            same_stack = 0;
+        drawn++;
+    }
+    if (drawn != cache->num_layers)
+        same_stack = 0;
+
+    ImageRect rects[CACHE_MAX_DIRTY_RECTS];
+    int num_rects = 0;
+    int overflow = 0;
+
+    drawn = 0;
+    for (int i = 0; i < img->num_layers; i++)
+    {
+        Layer *layer = img->layers[i];
+        if (layer->version == 0)
+            continue;
+
+        uint32_t cached_version = cache->layer_versions[drawn];
+        if (same_stack && layer->version != cached_version)
+        {
+            for (int d = 0; d < layer->num_dirty; d++)
+            {
+                // wrap-safe "newer than the cached version"
+                if ((int32_t)(layer->dirty[d].version - cached_version) <= 0)
+                    continue;
+
+                if (num_rects < CACHE_MAX_DIRTY_RECTS)
+                    rects[num_rects++] = layer->dirty[d].rect;
+                else
+                    overflow = 1;
+            }
+        }
+
+        cache->layer_ids[drawn] = layer->id;
+        cache->layer_versions[drawn] = layer->version;
+        drawn++;
+    }
+    cache->num_layers = drawn;
+
+    if (!same_stack)
+    {
+        ImageRect full = {0, 0, img->width, img->height};
+        composite_rect(img, full);
+        cache->valid = 1;
+        return 0;
+    }
+
+    if (overflow)
+    {
+        int x0 = img->width, y0 = img->height, x1 = 0, y1 = 0;
+        for (int r = 0; r < num_rects; r++)
+        {
+            x0 = rects[r].x < x0 ? rects[r].x : x0;
+            y0 = rects[r].y < y0 ? rects[r].y : y0;
+            x1 = rects[r].x + rects[r].w > x1 ? rects[r].x + rects[r].w : x1;
+            y1 = rects[r].y + rects[r].h > y1 ? rects[r].y + rects[r].h : y1;
+        }
+        ImageRect bounds = {x0, y0, x1 - x0, y1 - y0};
+        rects[0] = bounds;
+        num_rects = 1;
+    }
+
+    for (int r = 0; r < num_rects; r++)
+    {
+        composite_rect(img, rects[r]);
+    }
+    return 0;
+}
+
+/* =========================================================================
+ * BAND-PARALLEL EXPORT
+ * ========================================================================= */
+
+typedef struct
+{
+    const Image *img;
+    ImageRect rect;
+    RowConverter convert;
+    uint8_t *dst;
+    size_t bit_stride;
+    int failed;
+} FlattenBandJob;
+
+static void flatten_band(void *ctx, int band)
+{
+    FlattenBandJob *job = (FlattenBandJob *)ctx;
+    const Image *img = job->img;
+
+    int x = job->rect.x, width = job->rect.w;
+    int first = band * FLATTEN_BAND_ROWS;
+    int last = first + FLATTEN_BAND_ROWS;
+    if (last > job->rect.h)
+        last = job->rect.h;
+
+    // With a composite cache the rows are already flattened
+    uint32_t *argb_row = NULL;
+    if (!img->cache)
+    {
+        argb_row = (uint32_t *)malloc((size_t)width * sizeof(uint32_t));
+        if (!argb_row)
+        {
+            job->failed = 1;
+            return;
+        }
+    }
+
+    // With statistics on, the clock is read between the stages of every row
+    uint64_t band_start = stats_clock(), flatten_time = 0, convert_time = 0;
+    for (int r = first; r < last; r++)
+    {
+        size_t bit = (size_t)r * job->bit_stride;
+        const uint32_t *row;
+        uint64_t t0 = band_start ? stats_now() : 0;
+
+        if (img->cache)
+        {
+            row = img->cache->pixels + (size_t)(job->rect.y + r) * img->width + x;
+        }
+        else
+        {
+            flatten_row(img, job->rect.y + r, x, width, argb_row);
+            row = argb_row;
+        }
+        uint64_t t1 = band_start ? stats_now() : 0;
+        job->convert(row, width, job->dst + bit / 8, bit % 8);
+
+        if (band_start)
+        {
+            flatten_time += t1 - t0;
+            convert_time += stats_now() - t1;
+        }
+    }
+
+    if (band_start)
+    {
+        if (!img->cache)
+            stats_add_time(IMAGE_STAGE_FLATTEN, flatten_time);
+        stats_add_time(IMAGE_STAGE_CONVERT, convert_time);
+        STATS_ADD(pixels_converted, (uint64_t)(last - first) * width);
+        stats_trace("flatten_band", band_start, stats_now());
+    }
+
+    free(argb_row);
+}
+
+int flatten_rows(const Image *img, int y0, int rows, ArrayDataFormat format, uint8_t *dst, size_t bit_stride)
+{
+    if (!img)
+        return 1;
+
+    ImageRect rect = {0, y0, img->width, rows};
+    return flatten_rect(img, rect, format, dst, bit_stride);
+}
+
+int flatten_rect(const Image *img, ImageRect rect, ArrayDataFormat format, uint8_t *dst, size_t bit_stride)
+{
+    FlattenBandJob job = {img, rect, get_row_converter(format), dst, bit_stride, 0};
+    if (!img || !dst || !job.convert)
+        return 1;
+
+    if (!blend_row_kernel)
+        set_simd_level(SIMD_LEVEL_AVX2);
+
+    if (img->cache && update_image_cache(img) != 0)
+        return 1;
+
+    int bands = (rect.h + FLATTEN_BAND_ROWS - 1) / FLATTEN_BAND_ROWS;
+    parallel_for(bands, flatten_band, &job);
+
+    if (job.failed)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for row buffer.\n");
+        return 1;
+    }
+    return 0;
+}
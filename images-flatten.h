@@ -0,0 +1,118 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "images.h"
+
+// Rows per band when flattening in parallel. A multiple of 8 keeps every
+// band of back-to-back packed BINARY1 rows on a byte boundary.
+#define FLATTEN_BAND_ROWS 16
+
+/* =========================================================================
+ * FLATTEN ENGINE
+ *
+ * Every exporter (save_image, export_to_array) composites the layer stack
+ * through this module a row at a time, then converts the opaque ARGB row
+ * into the requested output format. Images with a composite cache
+ * (enable_image_cache) are converted from the cached rows instead.
+ * ========================================================================= */
+
+/**
+ * Instruction sets the compositing kernels can run on.
+ * The best level supported by the CPU is picked automatically; all levels
+ * produce bit-identical output.
+ */
+typedef enum
+{
+    SIMD_LEVEL_SCALAR = 0,
+    SIMD_LEVEL_SSE2 = 1,
+    SIMD_LEVEL_AVX2 = 2,
+} SimdLevel;
+
+/**
+ * @brief Returns the kernel level currently used by the flatten engine.
+ */
+SimdLevel get_simd_level(void);
+
+/**
+ * @brief Forces the flatten engine to a specific kernel level.
+ * * Requests above what the CPU supports are clamped to the best available level.
+ * Mostly useful to compare the SIMD kernels against the scalar fallback.
+ * * @param level The requested kernel level.
+ * @return The level actually selected.
+ */
+SimdLevel set_simd_level(SimdLevel level);
+
+/**
+ * @brief Blends a run of foreground pixels over an opaque destination run.
+ * * The result is the same as dst[i] = blend_pixels(dst[i], src[i]) for every
+ * pixel, given that every destination pixel has alpha 255.
+ * * @param dst The destination run (modified in place, always opaque).
+ * @param src The foreground run.
+ * @param count Number of pixels.
+ */
+void blend_row(uint32_t *dst, const uint32_t *src, int count);
+
+/**
+ * @brief Blends a run of premultiplied foreground pixels over an opaque destination run.
+ * * dst[i] = src[i] + dst[i] * (255 - alpha) / 255 per channel; used for
+ * premultiplied layers (see set_layer_premultiplied).
+ * * @param dst The destination run (modified in place, always opaque).
+ * @param src The premultiplied foreground run.
+ * @param count Number of pixels.
+ */
+void blend_row_premultiplied(uint32_t *dst, const uint32_t *src, int count);
+
+/**
+ * @brief Composites a horizontal run of pixels through every layer of an image.
+ * * Starts from BACKGROUND_COLOR and blends the layers bottom-up, exactly like
+ * calling blend_pixels per pixel and per layer for NORMAL layers at full opacity.
+ * Other layers use their blend mode and opacity; hidden layers are skipped.
+ * * @param img The image to flatten.
+ * @param y The row to composite.
+ * @param x The first column of the run.
+ * @param count Number of pixels to composite (x + count <= img->width).
+ * @param out Destination buffer of at least count pixels (opaque ARGB).
+ */
+void flatten_row(const Image *img, int y, int x, int count, uint32_t *out);
+
+/**
+ * Converts count flattened ARGB pixels into an output format.
+ * bit_offset is only used by ARRAY_DATA_FORMAT_BINARY1: it is the index of the
+ * first destination bit (MSB-first), so rows can be packed back to back.
+ */
+typedef void (*RowConverter)(const uint32_t *src, int count, uint8_t *dst, size_t bit_offset);
+
+/**
+ * @brief Returns the row converter for an array data format, or NULL if unknown.
+ */
+RowConverter get_row_converter(ArrayDataFormat format);
+
+/**
+ * @brief Flattens a block of rows and converts them into an output buffer.
+ * * The rows are split into bands of FLATTEN_BAND_ROWS that are composited and
+ * converted in parallel on the thread pool (see set_thread_count).
+ * The output is identical for any thread count.
+ * * @param img The image to flatten.
+ * @param y0 The first row to convert.
+ * @param rows Number of rows to convert.
+ * @param format The output format written to dst.
+ * @param dst The output buffer; row r starts at bit r * bit_stride.
+ * @param bit_stride Distance between the starts of two rows, in bits. Must be a multiple
+ * of 8 except for ARRAY_DATA_FORMAT_BINARY1, whose rows may be packed back to back.
+ * @return 0 on success, 1 on failure (unknown format or memory error).
+ */
+int flatten_rows(const Image *img, int y0, int rows, ArrayDataFormat format, uint8_t *dst, size_t bit_stride);
+
+/**
+ * @brief Like flatten_rows, for a rectangle of the image.
+ * * Row r of the output holds the pixels rect.x to rect.x + rect.w - 1 of image
+ * row rect.y + r. BINARY1 output only replaces the bits of the rectangle, so
+ * the other bits of the bytes it touches keep their value.
+ * * @param img The image to flatten.
+ * @param rect The rectangle to convert; it must lie inside the image.
+ * @param format The output format written to dst.
+ * @param dst The output buffer; row r starts at bit r * bit_stride.
+ * @param bit_stride Distance between the starts of two rows, in bits (see flatten_rows).
+ * @return 0 on success, 1 on failure (unknown format or memory error).
+ */
+int flatten_rect(const Image *img, ImageRect rect, ArrayDataFormat format, uint8_t *dst, size_t bit_stride);
@@ -0,0 +1,240 @@
+#pragma once
+#include "images.h"
+#include "images-stats.h"
+
+/* =========================================================================
+ * LIBRARY INTERNALS
+ *
+ * Helpers shared between the library's translation units.
+ * Not part of the public API.
+ * ========================================================================= */
+
+/**
+ * Pixel memory of a layer. Layers created by share_layer point to the same
+ * storage until one of them is written to (see make_layer_writable).
+ */
+typedef struct LayerStorage
+{
+    uint32_t refcount; // layers using this storage (atomic)
+    uint32_t *data;    // dense pixels, or NULL
+    int width, height; // dimensions of data in pixels (width is the row stride)
+    int buffer_flags;  // PIXEL_BUFFER_* flags data was acquired with
+    int external;      // data belongs to a parent layer or to the caller and is not freed
+    uint32_t **tiles;  // tile table of a tiled layer, or NULL
+    size_t num_tiles;
+} LayerStorage;
+
+// alloc_layer flags
+#define LAYER_ALLOC_TILED 1         // sparse tiled storage (create_tiled_layer)
+#define LAYER_ALLOC_UNINITIALIZED 2 // dense pixels are not cleared; the caller overwrites all of them
+#define LAYER_ALLOC_ALIGNED 4       // dense rows padded and aligned to 64 bytes
+#define LAYER_ALLOC_NO_PIXELS 8     // no pixel buffer; the caller points data into external memory
+
+/**
+ * @brief Allocates a layer with refcount 1; create_layer and create_tiled_layer wrap it.
+ * * @param flags A combination of the LAYER_ALLOC_* flags.
+ */
+Layer *alloc_layer(int width, int height, int flags);
+
+// acquire_pixel_buffer flags
+#define PIXEL_BUFFER_UNINITIALIZED 1 // the pixels are not cleared
+#define PIXEL_BUFFER_ALIGNED 2       // the buffer is 64-byte aligned
+
+/**
+ * @brief Returns a buffer of width * height pixels, recycled from the layer pool when enabled.
+ * * The pixels are cleared to transparent black unless PIXEL_BUFFER_UNINITIALIZED is set.
+ * Release it with recycle_pixel_buffer. Returns NULL on allocation failure.
+ */
+uint32_t *acquire_pixel_buffer(int width, int height, int flags);
+
+/**
+ * @brief Returns a buffer from acquire_pixel_buffer to the layer pool, or frees it.
+ * * width, height and flags must be those it was acquired with. Accepts NULL.
+ */
+void recycle_pixel_buffer(uint32_t *pixels, int width, int height, int flags);
+
+/**
+ * @brief Drops one reference to a storage and frees its pixels when it was the last.
+ */
+void release_layer_storage(LayerStorage *storage);
+
+/**
+ * @brief Prepares a layer for a write through the drawing API.
+ * * Makes the pixels private (copy-on-write) and records the rectangle with
+ * mark_layer_dirty. Primitives call it once, before touching any pixel.
+ * * @return 0 on success, 1 if the layer must not be written (memory error).
+ */
+int begin_layer_write(Layer *layer, int x, int y, int w, int h);
+
+/**
+ * @brief Returns the coverage class of one tile, classifying it first if it is unknown.
+ * * Safe to call from several threads at once for the same layer, as long as
+ * nobody writes to the layer at the same time.
+ * * @param layer The layer.
+ * @param tx Tile column (x / LAYER_TILE_SIZE).
+ * @param ty Tile row (y / LAYER_TILE_SIZE).
+ */
+TileCoverage get_tile_coverage(Layer *layer, int tx, int ty);
+
+/**
+ * @brief Sets every tile of a layer to the same coverage class.
+ * * Used by writers that know the result without scanning
+ * (fill_layer, the file parsers).
+ */
+void set_layer_coverage(Layer *layer, TileCoverage coverage);
+
+/**
+ * @brief Allocates the tile at (tx, ty) of a tiled layer if needed and returns it.
+ * * @return The tile pixels, or NULL on allocation failure.
+ */
+uint32_t *allocate_layer_tile(Layer *layer, int tx, int ty);
+
+/**
+ * @brief Frees every allocated tile of a tiled layer (they read as transparent again).
+ */
+void free_layer_tiles(Layer *layer);
+
+/**
+ * @brief Returns a pointer to pixel (x, y) for reading, or NULL if it lies in an unallocated tile.
+ * * Pixels are contiguous up to the end of the row for dense layers and up to the
+ * end of the tile row for tiled layers, so runs that stop at tile boundaries are
+ * valid for both. Coordinates must be inside the layer.
+ */
+static inline uint32_t *layer_read_ptr(const Layer *layer, int x, int y)
+{
+    if (layer->data)
+        return layer->data + (size_t)y * layer->stride + x;
+
+    uint32_t *tile = layer->tiles[(size_t)(y / LAYER_TILE_SIZE) * layer->tiles_x + x / LAYER_TILE_SIZE];
+    if (!tile)
+        return NULL;
+    return tile + (y % LAYER_TILE_SIZE) * LAYER_TILE_SIZE + x % LAYER_TILE_SIZE;
+}
+
+/**
+ * @brief Returns a pointer to pixel (x, y) for writing, allocating its tile if needed.
+ * * Same contiguity rules as layer_read_ptr. Returns NULL only on allocation failure.
+ */
+static inline uint32_t *layer_write_ptr(Layer *layer, int x, int y)
+{
+    if (layer->data)
+        return layer->data + (size_t)y * layer->stride + x;
+
+    uint32_t *tile = layer->tiles[(size_t)(y / LAYER_TILE_SIZE) * layer->tiles_x + x / LAYER_TILE_SIZE];
+    if (!tile && !(tile = allocate_layer_tile(layer, x / LAYER_TILE_SIZE, y / LAYER_TILE_SIZE)))
+        return NULL;
+    return tile + (y % LAYER_TILE_SIZE) * LAYER_TILE_SIZE + x % LAYER_TILE_SIZE;
+}
+
+/**
+ * @brief Fills the pixels x0 to x1 - 1 of row y with color, clipped to the layer.
+ * * The span core of the filled primitives (images-primitives.c). It does not
+ * record the change: call begin_layer_write for the area first.
+ */
+void fill_layer_span(Layer *layer, int y, int x0, int x1, uint32_t color);
+
+/**
+ * A drawing primitive as a value, so it can be drawn immediately or recorded
+ * in a display list (images-display-list.h) and replayed later.
+ */
+typedef enum
+{
+    DRAW_COMMAND_PIXEL,          // (x0, y0)
+    DRAW_COMMAND_LINE,           // from (x0, y0) to (x1, y1)
+    DRAW_COMMAND_RECT_FILLED,    // corner (x0, y0), size x1 by y1
+    DRAW_COMMAND_RECT_OUTLINE,   // corner (x0, y0), size x1 by y1
+    DRAW_COMMAND_CIRCLE_FILLED,  // center (x0, y0), radius x1
+    DRAW_COMMAND_CIRCLE_OUTLINE, // center (x0, y0), radius x1
+    DRAW_COMMAND_ELLIPSE_FILLED, // center (x0, y0), radii x1 and y1
+    DRAW_COMMAND_ELLIPSE_OUTLINE,
+} DrawCommandType;
+
+typedef struct
+{
+    DrawCommandType type;
+    int x0, y0, x1, y1;
+    uint32_t color;
+} DrawCommand;
+
+/**
+ * @brief Returns a rectangle containing every pixel the command can draw (not clipped to a layer).
+ */
+ImageRect draw_command_bounds(const DrawCommand *cmd);
+
+/**
+ * @brief Records the change a command is about to make and converts its color for the layer.
+ * * Calls begin_layer_write for the command's bounds, then turns cmd->color
+ * into the layer's representation (see layer_pixel_color).
+ * @return 0 if the command must be rasterized, 1 if it is a no-op or on failure.
+ */
+int prepare_draw_command(Layer *layer, DrawCommand *cmd);
+
+/**
+ * @brief Draws a prepared command, clipped to the layer, without recording anything.
+ * * Shapes are translation invariant: drawing a command moved by (-x, -y) on a
+ * layer whose pixels start at (x, y) produces the same pixels, clipped.
+ */
+void rasterize_command(Layer *layer, const DrawCommand *cmd);
+
+/**
+ * @brief Blends color over a run of layer pixels (source-over, destination may be translucent).
+ * * Used by PAINT_MODE_BLEND. color and dst are premultiplied when premultiplied is
+ * non-zero. Implemented with the SIMD kernels of images-flatten.c.
+ */
+void blend_color_span(uint32_t *dst, int count, uint32_t color, int premultiplied);
+
+/**
+ * @brief Blends color over a single layer pixel, with the same result as blend_color_span.
+ */
+uint32_t blend_color_pixel(uint32_t dst, uint32_t color, int premultiplied);
+
+/**
+ * @brief Converts a straight color passed to a drawing primitive into the layer's representation.
+ */
+static inline uint32_t layer_pixel_color(const Layer *layer, uint32_t color)
+{
+    return layer->premultiplied ? premultiply_color(color) : color;
+}
+
+/* =========================================================================
+ * INSTRUMENTATION (images-stats.c)
+ * ========================================================================= */
+
+extern int image_stats_enabled; // non-zero while enable_image_stats is on
+extern ImageStats image_stats;
+
+// Adds n to a counter of image_stats while statistics are enabled
+#define STATS_ADD(field, n)                                                                   \
+    do                                                                                        \
+    {                                                                                         \
+        if (__atomic_load_n(&image_stats_enabled, __ATOMIC_RELAXED))                          \
+            __atomic_add_fetch(&image_stats.field, (uint64_t)(n), __ATOMIC_RELAXED);          \
+    } while (0)
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds, or 0 while statistics are disabled.
+ * * Instrumented code keeps the value and passes it to stats_end_stage or
+ * stats_trace, which do nothing for 0.
+ */
+uint64_t stats_clock(void);
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds, whether statistics are enabled or not.
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief Adds one timed section of the given length to a stage.
+ */
+void stats_add_time(ImageStage stage, uint64_t nanoseconds);
+
+/**
+ * @brief Records a trace event from start to end on the calling thread, if tracing is on.
+ * * name must be a string literal. Does nothing when start is 0.
+ */
+void stats_trace(const char *name, uint64_t start, uint64_t end);
+
+/**
+ * @brief Ends a section started with stats_clock: adds its time to the stage and traces it.
+ */
+void stats_end_stage(ImageStage stage, const char *name, uint64_t start);
@@ -3,167 +3,683 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "images.h"
+#include "images-internal.h"
+#include "images-threads.h"
+
+// Rows decoded per parallel task when expanding a file body into a layer
+#define PARSER_BAND_ROWS 64
+
+/* =========================================================================
+ * FILE MAPPING
+ * ========================================================================= */
+
+/**
+ * A whole file in memory: mmap'ed when possible, read into a buffer otherwise
+ * (e.g. for pipes or special files).
+ */
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    int mapped; // 1 if data must be munmap'ed, 0 if it must be freed
+} MappedFile;
+
+static int map_file(const char *filename, MappedFile *file)
+{
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            // the body is read front to back exactly once
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+            file->data = (const uint8_t *)data;
+            file->size = (size_t)st.st_size;
+            file->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    // Fallback: read everything into a growing buffer
+    size_t capacity = 1 << 16, size = 0;
+    uint8_t *buffer = (uint8_t *)malloc(capacity);
+    ssize_t got;
+    while (buffer && (got = read(fd, buffer + size, capacity - size)) > 0)
+    {
+        size += (size_t)got;
+        if (size == capacity)
+        {
+            uint8_t *grown = (uint8_t *)realloc(buffer, capacity * 2);
+            if (!grown)
+            {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+    close(fd);
+
+    if (!buffer)
+        return 1;
+
+    file->data = buffer;
+    file->size = size;
+    return 0;
+}
+
+static void unmap_file(MappedFile *file)
+{
+    if (file->mapped)
+        munmap((void *)file->data, file->size);
+    else
+        free((void *)file->data);
+    memset(file, 0, sizeof(*file));
+}
+
+/* =========================================================================
+ * HEADER PARSING
+ * ========================================================================= */
 
 /**
- * Helper function: Consumes whitespace and comments from the stream.
- * In PBM/PGM/PPM, a comment starts with '#' and ends at the newline.
- * Comments are treated effectively as whitespace.
+ * Skips whitespace and comments. In PBM/PGM/PPM, a comment starts with '#'
+ * and ends at the newline; comments are treated effectively as whitespace.
+ * Returns NETPBM_HEADER_INCOMPLETE if the buffer ends first.
  */
-static void consume_comments_and_whitespace(FILE *stream)
+static int skip_whitespace_and_comments(const uint8_t *buf, size_t len, size_t *pos)
 {
-    int ch;
-    // Loop continuously until we find a non-whitespace, non-comment character
-    while ((ch = fgetc(stream)) != EOF)
+    while (*pos < len)
     {
+        uint8_t ch = buf[*pos];
 
-        // 1. Skip standard whitespace (spaces, tabs, newlines)
         if (isspace(ch))
         {
+            (*pos)++;
             continue;
         }
 
-        // Handle comments
         if (ch == IMAGE_PORTABLE_COMMENT_CHAR)
         {
             // Consume characters until the end of the line
-            while ((ch = fgetc(stream)) != EOF && ch != '\n')
-                ;
-            continue; // Loop back to check for more whitespace/comments after the newline
+            while (*pos < len && buf[*pos] != '\n')
+                (*pos)++;
+            continue;
         }
 
-        // push back valid data character for further processing
-        ungetc(ch, stream);
-        return;
+        return NETPBM_HEADER_OK;
     }
+    return NETPBM_HEADER_INCOMPLETE;
 }
 
-int scan_skip_comments(FILE *stream, const char *format, ...)
+/**
+ * Reads an unsigned decimal header field, after skipping whitespace and comments.
+ * A number must be followed by at least one more byte to be known complete.
+ */
+static int read_header_number(const uint8_t *buf, size_t len, size_t *pos, unsigned long *value)
 {
-    // First, clean up the stream pointer
-    consume_comments_and_whitespace(stream);
+    if (skip_whitespace_and_comments(buf, len, pos) != NETPBM_HEADER_OK)
+        return NETPBM_HEADER_INCOMPLETE;
 
-    // Initialize variable arguments
-    va_list args;
-    va_start(args, format);
+    if (!isdigit(buf[*pos]))
+        return NETPBM_HEADER_INVALID;
 
-    // Pass the cleaned stream to vfscanf
-    int result = vfscanf(stream, format, args);
+    unsigned long v = 0;
+    while (*pos < len && isdigit(buf[*pos]))
+    {
+        v = v * 10 + (buf[*pos] - '0');
+        if (v > 0x7FFFFFFFUL)
+            return NETPBM_HEADER_INVALID;
+        (*pos)++;
+    }
+    if (*pos == len)
+        return NETPBM_HEADER_INCOMPLETE;
 
-    va_end(args);
-    return result;
+    *value = v;
+    return NETPBM_HEADER_OK;
 }
 
-/**
- * @brief Parses a PGM (Portable Graymap) file from the given file pointer.
- *
- * This function reads the PGM header, including width, height, and max pixel value,
- * then reads the binary pixel data. It converts the grayscale values into ARGB format
- * and stores them in a dynamically allocated array.
- * The function expects the file pointer to be positioned just after the magic number. ("P5")
- *
- * @param fp        Pointer to the opened PGM file (must be in binary mode).
- * @param length    Pointer to a size_t variable where the number of pixels will be stored.
- * @param data      Pointer to a uint32_t pointer where the allocated pixel data will be stored.
- * @param width     Pointer to a size_t variable where the image width will be stored.
- * @param height    Pointer to a size_t variable where the image height will be stored.
- * @return int Returns 0 on success, non-zero on failure.
- * @note The caller is responsible for freeing the allocated pixel data array.
- */
-int parse_pgm_file(FILE *fp, size_t *length, uint32_t **data, size_t *width, size_t *height)
+int parse_netpbm_header(const uint8_t *buf, size_t len, NetpbmHeader *header)
 {
-    size_t w, h, max_val;
-    if (scan_skip_comments(fp, "%zu %zu", &w, &h) != 2)
+    size_t pos = 0;
+    unsigned long width, height, max_val = 1;
+    int status;
+
+    memset(header, 0, sizeof(*header));
+    header->type = IMAGE_FILE_UNKNOWN;
+
+    if (len < 2)
+        return NETPBM_HEADER_INCOMPLETE;
+    if (buf[0] != 'P')
+        return NETPBM_HEADER_INVALID;
+
+    // P1-P3 are the plain (ASCII) forms of P4-P6
+    switch (buf[1])
     {
-        fprintf(stderr, "Error: Invalid PGM header (width/height)\n");
-        return 1;
+    case '1':
+    case '4':
+        header->type = IMAGE_FILE_PBM;
+        break;
+    case '2':
+    case '5':
+        header->type = IMAGE_FILE_PGM;
+        break;
+    case '3':
+    case '6':
+        header->type = IMAGE_FILE_PPM;
+        break;
+    default:
+        return NETPBM_HEADER_INVALID;
     }
-    if (scan_skip_comments(fp, "%zu", &max_val) != 1)
+    header->plain = buf[1] <= '3';
+    pos = 2;
+
+    if ((status = read_header_number(buf, len, &pos, &width)) != NETPBM_HEADER_OK)
+        return status;
+    if ((status = read_header_number(buf, len, &pos, &height)) != NETPBM_HEADER_OK)
+        return status;
+
+    // NOTE: PBM does NOT have a "Max Value" field like PGM/PPM.
+    if (header->type != IMAGE_FILE_PBM &&
+        (status = read_header_number(buf, len, &pos, &max_val)) != NETPBM_HEADER_OK)
+        return status;
+
+    if (width == 0 || height == 0 || max_val == 0 || max_val > 65535)
+        return NETPBM_HEADER_INVALID;
+
+    // Exactly one whitespace character separates the header from the body
+    if (!isspace(buf[pos]))
+        return NETPBM_HEADER_INVALID;
+    pos++;
+
+    header->width = (int)width;
+    header->height = (int)height;
+    header->max_val = (unsigned int)max_val;
+    header->body_offset = pos;
+
+    size_t sample_bytes = max_val > 255 ? 2 : 1;
+    switch (header->type)
     {
-        fprintf(stderr, "Error: Invalid PGM header (max value)\n");
-        return 1;
+    case IMAGE_FILE_PBM:
+        header->row_bytes = (width + 7) / 8;
+        break;
+    case IMAGE_FILE_PGM:
+        header->row_bytes = width * sample_bytes;
+        break;
+    default:
+        header->row_bytes = width * 3 * sample_bytes;
+        break;
     }
-    size_t img_size = w * h;
-    *length = img_size;
-    *width = w;
-    *height = h;
+    if (header->plain)
+        header->row_bytes = 0;
+    return NETPBM_HEADER_OK;
+}
 
-    unsigned char *pgm_data = (unsigned char *)malloc(img_size);
-    *data = (uint32_t *)malloc(img_size * sizeof(uint32_t));
+/* =========================================================================
+ * BODY DECODING
+ * ========================================================================= */
 
-    consume_comments_and_whitespace(fp);
-    // Read the binary pixel data
-    fread(pgm_data, 1, img_size, fp);
-    for (size_t i = 0; i < img_size; i++)
+static void decode_pgm_row(const uint8_t *src, uint32_t *dst, int width)
+{
+    for (int x = 0; x < width; x++)
     {
-        // printf("PGM Pixel %zu: %d\n", i, pgm_data[i]);
-        uint8_t gray = pgm_data[i];
-        (*data)[i] = COLOR(255, gray, gray, gray); // Convert grayscale to ARGB
+        uint32_t gray = src[x];
+        dst[x] = 0xFF000000u | (gray << 16) | (gray << 8) | gray; // Convert grayscale to ARGB
     }
-    free(pgm_data);
-    return 0;
 }
 
-/**
- * @brief Parses a PPM (Portable Pixmap) file from the given file pointer.
- *
- * This function reads the PPM header, including width, height, and max pixel value,
- * then reads the binary pixel data. It converts the RGB values into ARGB format
- * and stores them in a dynamically allocated array.
- * The function expects the file pointer to be positioned just after the magic number. ("P6")
- *
- * @param fp        Pointer to the opened PPM file (must be in binary mode).
- * @param length    Pointer to a size_t variable where the number of pixels will be stored.
- * @param data      Pointer to a uint32_t pointer where the allocated pixel data will be stored.
- * @param width     Pointer to a size_t variable where the image width will be stored.
- * @param height    Pointer to a size_t variable where the image height will be stored.
- * @return int Returns 0 on success, non-zero on failure.
- * @note The caller is responsible for freeing the allocated pixel data array.
- */
-int parse_ppm_file(FILE *fp, size_t *length, uint32_t **data, size_t *width, size_t *height)
+static void decode_ppm_row(const uint8_t *src, uint32_t *dst, int width)
 {
-    size_t w, h, max_val;
-    if (scan_skip_comments(fp, "%zu %zu", &w, &h) != 2)
+    for (int x = 0; x < width; x++, src += 3)
     {
-        fprintf(stderr, "Error: Invalid PPM header (width/height)\n");
-        return 1;
+        dst[x] = 0xFF000000u | ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2]; // Convert RGB to ARGB
+    }
+}
+
+// The 8 ARGB pixels of every possible PBM byte, leftmost (MSB) pixel first
+static uint32_t pbm_byte_pixels[256][8];
+static pthread_once_t pbm_byte_pixels_once = PTHREAD_ONCE_INIT;
+
+// PBM convention: a set bit is black, a clear bit is white. Bits are packed MSB-first.
+static void build_pbm_byte_pixels(void)
+{
+    for (int byte = 0; byte < 256; byte++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            int black = (byte >> (7 - bit)) & 1;
+            pbm_byte_pixels[byte][bit] = black ? COLOR(255u, 0, 0, 0) : COLOR(255u, 255, 255, 255);
+        }
+    }
+}
+
+// Expands a row a whole byte (8 pixels) at a time from the lookup table
+static void decode_pbm_row(const uint8_t *src, uint32_t *dst, int width)
+{
+    pthread_once(&pbm_byte_pixels_once, build_pbm_byte_pixels);
+
+    int full_bytes = width / 8;
+    for (int i = 0; i < full_bytes; i++)
+    {
+        memcpy(dst + i * 8, pbm_byte_pixels[src[i]], sizeof(pbm_byte_pixels[0]));
     }
-    if (scan_skip_comments(fp, "%zu", &max_val) != 1)
+    for (int x = full_bytes * 8; x < width; x++)
     {
-        fprintf(stderr, "Error: Invalid PPM header (max value)\n");
+        dst[x] = pbm_byte_pixels[src[full_bytes]][x % 8];
+    }
+}
+
+/*
+Samples of files whose max value is not 255 are rescaled to 8 bits through a
+lookup table indexed by the raw sample (65536 entries for 2-byte samples).
+Samples above the max value are invalid but can appear in binary bodies; they
+saturate to 255.
+*/
+static uint8_t *create_sample_lut(unsigned int max_val)
+{
+    size_t size = max_val > 255 ? 65536 : 256;
+    uint8_t *lut = (uint8_t *)malloc(size);
+    if (!lut)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for sample table\n");
+        return NULL;
+    }
+
+    for (size_t v = 0; v < size; v++)
+    {
+        lut[v] = v >= max_val ? 255 : (uint8_t)((v * 255 + max_val / 2) / max_val);
+    }
+    return lut;
+}
+
+// The files that need create_sample_lut: PGM and PPM with a max value other than 255
+static int needs_sample_lut(const NetpbmHeader *header)
+{
+    return header->type != IMAGE_FILE_PBM && header->max_val != 255;
+}
+
+static void decode_pgm_row_scaled(const uint8_t *src, uint32_t *dst, int width, const uint8_t *lut)
+{
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t gray = lut[src[x]];
+        dst[x] = 0xFF000000u | (gray << 16) | (gray << 8) | gray;
+    }
+}
+
+static void decode_ppm_row_scaled(const uint8_t *src, uint32_t *dst, int width, const uint8_t *lut)
+{
+    for (int x = 0; x < width; x++, src += 3)
+    {
+        dst[x] = 0xFF000000u | ((uint32_t)lut[src[0]] << 16) | ((uint32_t)lut[src[1]] << 8) | lut[src[2]];
+    }
+}
+
+// 2-byte samples are big-endian
+static void decode_pgm16_row(const uint8_t *src, uint32_t *dst, int width, const uint8_t *lut)
+{
+    for (int x = 0; x < width; x++, src += 2)
+    {
+        uint32_t gray = lut[src[0] << 8 | src[1]];
+        dst[x] = 0xFF000000u | (gray << 16) | (gray << 8) | gray;
+    }
+}
+
+static void decode_ppm16_row(const uint8_t *src, uint32_t *dst, int width, const uint8_t *lut)
+{
+    for (int x = 0; x < width; x++, src += 6)
+    {
+        dst[x] = 0xFF000000u |
+                 ((uint32_t)lut[src[0] << 8 | src[1]] << 16) |
+                 ((uint32_t)lut[src[2] << 8 | src[3]] << 8) |
+                 lut[src[4] << 8 | src[5]];
+    }
+}
+
+// Decodes one row of a binary body; lut comes from create_sample_lut when needs_sample_lut
+static void decode_row(const NetpbmHeader *header, const uint8_t *lut, const uint8_t *src, uint32_t *dst)
+{
+    switch (header->type)
+    {
+    case IMAGE_FILE_PBM:
+        decode_pbm_row(src, dst, header->width);
+        break;
+    case IMAGE_FILE_PGM:
+        if (header->max_val > 255)
+            decode_pgm16_row(src, dst, header->width, lut);
+        else if (lut)
+            decode_pgm_row_scaled(src, dst, header->width, lut);
+        else
+            decode_pgm_row(src, dst, header->width);
+        break;
+    default:
+        if (header->max_val > 255)
+            decode_ppm16_row(src, dst, header->width, lut);
+        else if (lut)
+            decode_ppm_row_scaled(src, dst, header->width, lut);
+        else
+            decode_ppm_row(src, dst, header->width);
+        break;
+    }
+}
+
+/*
+Plain (ASCII) bodies are a stream of decimal samples separated by whitespace,
+so they are tokenized sequentially by hand: one pass over the bytes, no
+scanf. PBM samples are single digits that may also be written without
+separators ("0110"). Comments are skipped wherever whitespace is allowed.
+The cursor walks a file in memory, or refills its buffer from fp when set.
+*/
+typedef struct
+{
+    const uint8_t *data;
+    size_t pos, len;
+    FILE *fp;
+    uint8_t *buffer;
+    size_t capacity;
+} TextCursor;
+
+static inline int cursor_next(TextCursor *cursor)
+{
+    if (cursor->pos == cursor->len)
+    {
+        if (!cursor->fp || (cursor->len = fread(cursor->buffer, 1, cursor->capacity, cursor->fp)) == 0)
+        {
+            cursor->pos = cursor->len = 0;
+            return EOF;
+        }
+        cursor->data = cursor->buffer;
+        cursor->pos = 0;
+    }
+    return cursor->data[cursor->pos++];
+}
+
+static inline int is_text_space(int ch)
+{
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t' || ch == '\v' || ch == '\f';
+}
+
+// Returns the first character that is neither whitespace nor part of a comment, or EOF
+static int skip_text_separators(TextCursor *cursor, int ch)
+{
+    for (;;)
+    {
+        while (is_text_space(ch))
+            ch = cursor_next(cursor);
+        if (ch != IMAGE_PORTABLE_COMMENT_CHAR)
+            return ch;
+        while (ch != EOF && ch != '\n')
+            ch = cursor_next(cursor);
+    }
+}
+
+// Reads the next sample, which must not exceed max_val. Returns 0 on success, 1 on error.
+static int read_text_sample(TextCursor *cursor, int single_digit, unsigned int max_val, unsigned int *value)
+{
+    int ch = skip_text_separators(cursor, cursor_next(cursor));
+    if (ch < '0' || ch > '9')
         return 1;
+
+    unsigned int v = (unsigned int)(ch - '0');
+    if (!single_digit)
+    {
+        while ((ch = cursor_next(cursor)) >= '0' && ch <= '9')
+        {
+            v = v * 10 + (unsigned int)(ch - '0');
+            if (v > max_val)
+                return 1;
+        }
+        // A comment ends the sample; the separators after it are skipped by the next call
+        if (ch == IMAGE_PORTABLE_COMMENT_CHAR)
+        {
+            while (ch != EOF && ch != '\n')
+                ch = cursor_next(cursor);
+        }
+        else if (ch != EOF && !is_text_space(ch))
+            return 1;
     }
-    size_t img_size = w * h;
-    *length = img_size;
-    *width = w;
-    *height = h;
 
-    unsigned char *ppm_data = (unsigned char *)malloc(img_size * 3);
-    *data = (uint32_t *)malloc(img_size * sizeof(uint32_t));
+    if (v > max_val)
+        return 1;
+    *value = v;
+    return 0;
+}
+
+// Decodes rows of a plain body; row r goes to dst + r * stride. Returns 0 on success, 1 on error.
+static int decode_text_rows(const NetpbmHeader *header, const uint8_t *lut, TextCursor *cursor,
+                            uint32_t *dst, size_t stride, int rows)
+{
+    int pbm = header->type == IMAGE_FILE_PBM;
+    int channels = header->type == IMAGE_FILE_PPM ? 3 : 1;
 
-    consume_comments_and_whitespace(fp);
-    // Read the binary pixel data
-    fread(ppm_data, 1, img_size * 3, fp);
-    for (size_t i = 0; i < img_size; i++)
+    for (int r = 0; r < rows; r++, dst += stride)
     {
-        uint8_t r = ppm_data[i * 3 + 0];
-        uint8_t g = ppm_data[i * 3 + 1];
-        uint8_t b = ppm_data[i * 3 + 2];
-        (*data)[i] = COLOR(255, r, g, b); // Convert RGB to ARGB
+        for (int x = 0; x < header->width; x++)
+        {
+            unsigned int sample[3];
+            for (int c = 0; c < channels; c++)
+            {
+                if (read_text_sample(cursor, pbm, header->max_val, &sample[c]) != 0)
+                    return 1;
+                if (lut)
+                    sample[c] = lut[sample[c]];
+            }
+
+            if (pbm)
+                dst[x] = sample[0] ? COLOR(255u, 0, 0, 0) : COLOR(255u, 255, 255, 255);
+            else if (channels == 1)
+                dst[x] = COLOR(255u, sample[0], sample[0], sample[0]);
+            else
+                dst[x] = COLOR(255u, sample[0], sample[1], sample[2]);
+        }
     }
-    free(ppm_data);
     return 0;
 }
 
+/*
+Shrink-on-load: every output pixel is the average of a shrink x shrink box of
+file pixels (smaller at the right and bottom edges when the size is not a
+multiple of shrink). Source rows are decoded one at a time into a scratch row
+and summed into per-box accumulators, so only one full-resolution row per
+thread exists at any time. A box sums at most 8 * 8 * 255 < 65536 per
+channel, so red and blue share one 32-bit accumulator in two 16-bit lanes.
+*/
+typedef struct
+{
+    int width;         // file width
+    int shrink;        // 1, 2, 4 or 8
+    uint32_t *sums_rb; // per output pixel: red sum << 16 | blue sum
+    uint32_t *sums_g;  // per output pixel: green sum
+} ShrinkRow;
+
+static int init_shrink_row(ShrinkRow *row, int width, int shrink)
+{
+    int out_width = (width + shrink - 1) / shrink;
+    row->width = width;
+    row->shrink = shrink;
+    row->sums_rb = (uint32_t *)calloc((size_t)out_width, sizeof(uint32_t));
+    row->sums_g = (uint32_t *)calloc((size_t)out_width, sizeof(uint32_t));
+    return !row->sums_rb || !row->sums_g;
+}
+
+static void free_shrink_row(ShrinkRow *row)
+{
+    free(row->sums_rb);
+    free(row->sums_g);
+}
+
+// Constant shrink lets the compiler unroll the box loop of each instantiation
+static inline __attribute__((always_inline)) void accumulate_shrink_boxes(ShrinkRow *row, const uint32_t *src, int shrink)
+{
+    int full = row->width / shrink;
+    for (int x = 0; x < full; x++, src += shrink)
+    {
+        uint32_t rb = 0, g = 0;
+        for (int i = 0; i < shrink; i++)
+        {
+            rb += src[i] & 0x00FF00FFu;
+            g += (src[i] >> 8) & 0xFFu;
+        }
+        row->sums_rb[x] += rb;
+        row->sums_g[x] += g;
+    }
+    for (int i = 0; i < row->width - full * shrink; i++)
+    {
+        row->sums_rb[full] += src[i] & 0x00FF00FFu;
+        row->sums_g[full] += (src[i] >> 8) & 0xFFu;
+    }
+}
+
+static void accumulate_shrink_row(ShrinkRow *row, const uint32_t *src)
+{
+    switch (row->shrink)
+    {
+    case 2:
+        accumulate_shrink_boxes(row, src, 2);
+        break;
+    case 4:
+        accumulate_shrink_boxes(row, src, 4);
+        break;
+    default:
+        accumulate_shrink_boxes(row, src, 8);
+        break;
+    }
+}
+
+// Writes the averages of the boxes accumulated from `rows` file rows and clears the sums
+static void resolve_shrink_row(ShrinkRow *row, int rows, uint32_t *dst)
+{
+    int out_width = (row->width + row->shrink - 1) / row->shrink;
+    int x = 0;
+
+    // Full boxes hold shrink^2 pixels, a power of two: divide with a shift
+    if (rows == row->shrink)
+    {
+        int shift = row->shrink == 2 ? 2 : row->shrink == 4 ? 4 : 6;
+        uint32_t round = 1u << (shift - 1);
+        for (; x < row->width / row->shrink; x++)
+        {
+            uint32_t rb = row->sums_rb[x] + (round << 16 | round), g = row->sums_g[x] + round;
+            dst[x] = COLOR(255u, rb >> (16 + shift), g >> shift, (rb & 0xFFFFu) >> shift);
+            row->sums_rb[x] = row->sums_g[x] = 0;
+        }
+    }
+
+    for (; x < out_width; x++)
+    {
+        int columns = row->width - x * row->shrink < row->shrink ? row->width - x * row->shrink : row->shrink;
+        uint32_t count = (uint32_t)(columns * rows);
+        uint32_t rb = row->sums_rb[x], g = row->sums_g[x];
+        dst[x] = COLOR(255u, ((rb >> 16) + count / 2) / count, (g + count / 2) / count, ((rb & 0xFFFFu) + count / 2) / count);
+        row->sums_rb[x] = row->sums_g[x] = 0;
+    }
+}
+
+typedef struct
+{
+    const NetpbmHeader *header;
+    const uint8_t *lut;
+    const uint8_t *body;
+    Layer *layer;
+    int shrink;
+    int failed;
+} DecodeBodyJob;
+
+static void decode_body_band(void *ctx, int band)
+{
+    DecodeBodyJob *job = (DecodeBodyJob *)ctx;
+    const NetpbmHeader *header = job->header;
+
+    int y0 = band * PARSER_BAND_ROWS;
+    int y1 = y0 + PARSER_BAND_ROWS < header->height ? y0 + PARSER_BAND_ROWS : header->height;
+
+    if (job->shrink == 1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const uint8_t *src = job->body + (size_t)y * header->row_bytes;
+            decode_row(header, job->lut, src, job->layer->data + (size_t)y * job->layer->stride);
+        }
+        return;
+    }
+
+    // PARSER_BAND_ROWS is a multiple of every shrink factor, so bands hold whole output rows
+    ShrinkRow row;
+    uint32_t *scratch = (uint32_t *)malloc((size_t)header->width * sizeof(uint32_t));
+    if (init_shrink_row(&row, header->width, job->shrink) != 0 || !scratch)
+    {
+        job->failed = 1;
+        free(scratch);
+        free_shrink_row(&row);
+        return;
+    }
+
+    for (int y = y0; y < y1; y += job->shrink)
+    {
+        int rows = y1 - y < job->shrink ? y1 - y : job->shrink;
+        for (int i = 0; i < rows; i++)
+        {
+            decode_row(header, job->lut, job->body + (size_t)(y + i) * header->row_bytes, scratch);
+            accumulate_shrink_row(&row, scratch);
+        }
+        resolve_shrink_row(&row, rows, job->layer->data + (size_t)(y / job->shrink) * job->layer->stride);
+    }
+
+    free(scratch);
+    free_shrink_row(&row);
+}
+
+// Decodes a plain body into a layer shrunk by shrink. Returns 0 on success, 1 on error.
+static int decode_text_rows_shrunk(const NetpbmHeader *header, const uint8_t *lut, TextCursor *cursor,
+                                   Layer *layer, int shrink)
+{
+    ShrinkRow row;
+    uint32_t *scratch = (uint32_t *)malloc((size_t)header->width * sizeof(uint32_t));
+    int result = init_shrink_row(&row, header->width, shrink) != 0 || !scratch;
+
+    for (int y = 0; !result && y < header->height; y += shrink)
+    {
+        int rows = header->height - y < shrink ? header->height - y : shrink;
+        for (int i = 0; !result && i < rows; i++)
+        {
+            result = decode_text_rows(header, lut, cursor, scratch, 0, 1);
+            accumulate_shrink_row(&row, scratch);
+        }
+        resolve_shrink_row(&row, rows, layer->data + (size_t)(y / shrink) * layer->stride);
+    }
+
+    free(scratch);
+    free_shrink_row(&row);
+    return result;
+}
+
 /**
  * @brief Parses an image file (Netpbm format) and creates a new Layer from its data.
  *
  * This function detects the file type (PBM, PGM, or PPM) based on the file's
- * magic number. It allocates a new Layer, populates it with the pixel data,
- * and sets the output file type.
+ * magic number, in binary (P4-P6) or plain ASCII (P1-P3) form. PBM pixels become
+ * opaque black (bit set) or opaque white; PGM and PPM samples are rescaled from
+ * the file's max value (up to 65535, i.e. 16-bit samples) to 8 bits.
+ * The file is memory-mapped, its header is parsed straight from
+ * memory and the body is expanded directly into the pixels of the new Layer:
+ * one allocation, one pass over the data.
  *
  * @param[in]  filename  The path to the file to be opened and parsed.
  * @param[out] out_type  Pointer to an ImageFileType enum. On success, this will
@@ -180,13 +696,17 @@ int parse_ppm_file(FILE *fp, size_t *length, uint32_t **data, size_t *width, siz
  * `layer_release()` (or `layer_decref`) on the returned pointer immediately
  * after adding it. This ensures the reference count returns to 1 (owned
  * solely by the Image) and prevents memory leaks when the Image is eventually destroyed.
- *
- * @warning PBM (Magic number P4) parsing is currently not implemented.
  */
 Layer *parse_image_file(const char *filename, ImageFileType *out_type)
+{
+    return parse_image_file_scaled(filename, out_type, 1);
+}
+
+Layer *parse_image_file_scaled(const char *filename, ImageFileType *out_type, int shrink)
 {
     Layer *layer = NULL;
-    if (!filename || !out_type)
+    uint8_t *lut = NULL;
+    if (!filename || !out_type || (shrink != 1 && shrink != 2 && shrink != 4 && shrink != 8))
     {
         fprintf(stderr, "Error: Invalid arguments to parse_image_file\n");
         return NULL;
@@ -194,71 +714,287 @@ Layer *parse_image_file(const char *filename, ImageFileType *out_type)
 
     *out_type = IMAGE_FILE_UNKNOWN;
 
-    FILE *f = fopen(filename, "rb");
-    if (!f)
+    uint64_t start = stats_clock();
+    MappedFile file;
+    if (map_file(filename, &file) != 0)
     {
         fprintf(stderr, "Error: Could not open file %s for reading\n", filename);
         return NULL;
     }
 
-    int magic_number;
-    scan_skip_comments(f, "P%d", &magic_number);
+    NetpbmHeader header;
+    if (parse_netpbm_header(file.data, file.size, &header) != NETPBM_HEADER_OK)
+    {
+        fprintf(stderr, "Error: Invalid Netpbm header in %s\n", filename);
+        goto parse_image_done;
+    }
+    *out_type = header.type;
 
-    size_t length;
-    uint32_t *data;
-    size_t width, height;
+    if (needs_sample_lut(&header) && !(lut = create_sample_lut(header.max_val)))
+        goto parse_image_done;
 
-    switch (magic_number)
+    if (!header.plain && (file.size - header.body_offset) / header.height < header.row_bytes)
     {
-    case IMAGE_FILE_PBM:
-        *out_type = IMAGE_FILE_PBM;
-        fprintf(stderr, "Error: PBM parsing not implemented yet\n");
-        fclose(f);
-        break;
+        fprintf(stderr, "Error: File %s is truncated\n", filename);
+        goto parse_image_done;
+    }
 
-    case IMAGE_FILE_PGM:
-        *out_type = IMAGE_FILE_PGM;
-        if (parse_pgm_file(f, &length, &data, &width, &height) != 0)
+    // Every pixel is written by the decoder, so skip clearing the buffer
+    layer = alloc_layer((header.width + shrink - 1) / shrink, (header.height + shrink - 1) / shrink, LAYER_ALLOC_UNINITIALIZED);
+    if (!layer)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for layer data\n");
+        goto parse_image_done;
+    }
+
+    if (header.plain)
+    {
+        // Row boundaries are unknown until every sample before them is read: decode sequentially
+        TextCursor cursor = {file.data, header.body_offset, file.size, NULL, NULL, 0};
+        int result = shrink == 1 ? decode_text_rows(&header, lut, &cursor, layer->data, layer->stride, header.height)
+                                 : decode_text_rows_shrunk(&header, lut, &cursor, layer, shrink);
+        if (result != 0)
         {
-            fprintf(stderr, "Error: Failed to parse PGM file data\n");
-            fclose(f);
-            return NULL;
+            fprintf(stderr, "Error: Invalid or truncated sample data in %s\n", filename);
+            release_layer(layer);
+            layer = NULL;
+            goto parse_image_done;
         }
-        layer = create_layer(width, height);
-        if (!layer)
+    }
+    else
+    {
+        DecodeBodyJob job = {&header, lut, file.data + header.body_offset, layer, shrink, 0};
+        parallel_for((header.height + PARSER_BAND_ROWS - 1) / PARSER_BAND_ROWS, decode_body_band, &job);
+        if (job.failed)
         {
             fprintf(stderr, "Error: Unable to allocate memory for layer data\n");
-            fclose(f);
-            return NULL;
+            release_layer(layer);
+            layer = NULL;
+            goto parse_image_done;
         }
+    }
 
-        memcpy(layer->data, data, length * sizeof(uint32_t));
-        free(data);
-        break;
+    mark_layer_dirty(layer, 0, 0, layer->width, layer->height);
+    set_layer_coverage(layer, TILE_COVERAGE_OPAQUE); // Netpbm pixels are always opaque
+    STATS_ADD(bytes_read, file.size);
+    STATS_ADD(pixels_decoded, (uint64_t)header.width * header.height);
 
-    case IMAGE_FILE_PPM:
-        *out_type = IMAGE_FILE_PPM;
-        if (parse_ppm_file(f, &length, &data, &width, &height) != 0)
+parse_image_done:
+    free(lut);
+    unmap_file(&file);
+    stats_end_stage(IMAGE_STAGE_PARSE, "parse_image_file", start);
+    return layer;
+}
+
+Bitmap *parse_bitmap_file(const char *filename)
+{
+    Bitmap *bitmap = NULL;
+    if (!filename)
+    {
+        fprintf(stderr, "Error: Invalid arguments to parse_bitmap_file\n");
+        return NULL;
+    }
+
+    uint64_t start = stats_clock();
+    MappedFile file;
+    if (map_file(filename, &file) != 0)
+    {
+        fprintf(stderr, "Error: Could not open file %s for reading\n", filename);
+        return NULL;
+    }
+
+    NetpbmHeader header;
+    if (parse_netpbm_header(file.data, file.size, &header) != NETPBM_HEADER_OK || header.type != IMAGE_FILE_PBM || header.plain)
+    {
+        fprintf(stderr, "Error: %s is not a binary PBM (P4) file\n", filename);
+        goto parse_bitmap_done;
+    }
+
+    if ((file.size - header.body_offset) / header.height < header.row_bytes)
+    {
+        fprintf(stderr, "Error: File %s is truncated\n", filename);
+        goto parse_bitmap_done;
+    }
+
+    bitmap = create_bitmap(header.width, header.height);
+    if (!bitmap)
+        goto parse_bitmap_done;
+
+    // The P4 body has the exact Bitmap layout
+    memcpy(bitmap->bits, file.data + header.body_offset, bitmap->stride * bitmap->height);
+    STATS_ADD(bytes_read, file.size);
+    STATS_ADD(pixels_decoded, (uint64_t)bitmap->width * bitmap->height);
+
+parse_bitmap_done:
+    unmap_file(&file);
+    stats_end_stage(IMAGE_STAGE_PARSE, "parse_bitmap_file", start);
+    return bitmap;
+}
+
+/* =========================================================================
+ * STREAMING READER
+ * ========================================================================= */
+
+// Bytes read at a time while looking for the end of the header
+#define READER_HEADER_CHUNK 4096
+// Headers longer than this (i.e. huge comments) are rejected
+#define READER_HEADER_MAX (1 << 20)
+
+struct ImageReader
+{
+    FILE *fp;
+    NetpbmHeader header;
+    int next_row;
+
+    // Body bytes read together with the header, consumed before reading more from fp
+    uint8_t *pending;
+    size_t pending_pos, pending_len;
+
+    uint8_t *raw_row; // one encoded row
+    uint8_t *lut;     // see create_sample_lut, NULL if not needed
+
+    // Plain bodies are tokenized from the pending buffer, refilled from fp
+    TextCursor text;
+};
+
+// Reads exactly n body bytes, draining the bytes left over from the header first
+static int read_body_bytes(ImageReader *reader, uint8_t *dst, size_t n)
+{
+    size_t available = reader->pending_len - reader->pending_pos;
+    if (available > 0)
+    {
+        size_t take = available < n ? available : n;
+        memcpy(dst, reader->pending + reader->pending_pos, take);
+        reader->pending_pos += take;
+        dst += take;
+        n -= take;
+    }
+    return fread(dst, 1, n, reader->fp) == n ? 0 : 1;
+}
+
+ImageReader *open_image_reader(const char *filename)
+{
+    if (!filename)
+        return NULL;
+
+    ImageReader *reader = (ImageReader *)calloc(1, sizeof(ImageReader));
+    if (!reader)
+        return NULL;
+
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp)
+    {
+        fprintf(stderr, "Error: Could not open file %s for reading\n", filename);
+        goto open_reader_err;
+    }
+
+    // Grow the header buffer until the shared header parser has everything it needs
+    size_t capacity = 0;
+    int status = NETPBM_HEADER_INCOMPLETE;
+    while (status == NETPBM_HEADER_INCOMPLETE && capacity < READER_HEADER_MAX)
+    {
+        uint8_t *grown = (uint8_t *)realloc(reader->pending, capacity + READER_HEADER_CHUNK);
+        if (!grown)
+            goto open_reader_err;
+        reader->pending = grown;
+        capacity += READER_HEADER_CHUNK;
+
+        size_t got = fread(reader->pending + reader->pending_len, 1, capacity - reader->pending_len, reader->fp);
+        reader->pending_len += got;
+        status = parse_netpbm_header(reader->pending, reader->pending_len, &reader->header);
+        if (got == 0)
+            break;
+    }
+
+    if (status != NETPBM_HEADER_OK)
+    {
+        fprintf(stderr, "Error: Invalid Netpbm header in %s\n", filename);
+        goto open_reader_err;
+    }
+    if (needs_sample_lut(&reader->header) && !(reader->lut = create_sample_lut(reader->header.max_val)))
+        goto open_reader_err;
+    reader->pending_pos = reader->header.body_offset;
+
+    if (reader->header.plain)
+    {
+        TextCursor text = {reader->pending, reader->pending_pos, reader->pending_len, reader->fp, reader->pending, capacity};
+        reader->text = text;
+    }
+    else
+    {
+        reader->raw_row = (uint8_t *)malloc(reader->header.row_bytes);
+        if (!reader->raw_row)
+            goto open_reader_err;
+    }
+
+    return reader;
+
+open_reader_err:
+    close_image_reader(reader);
+    return NULL;
+}
+
+void get_image_reader_info(const ImageReader *reader, int *width, int *height, ImageFileType *type)
+{
+    if (!reader)
+        return;
+    if (width)
+        *width = reader->header.width;
+    if (height)
+        *height = reader->header.height;
+    if (type)
+        *type = reader->header.type;
+}
+
+int read_image_rows(ImageReader *reader, uint32_t *dst, size_t stride, int rows)
+{
+    if (!reader || !dst || stride < (size_t)reader->header.width)
+        return -1;
+
+    int remaining = reader->header.height - reader->next_row;
+    if (rows > remaining)
+        rows = remaining;
+    if (rows <= 0)
+        return 0;
+
+    uint64_t start = stats_clock();
+    if (reader->header.plain)
+    {
+        if (decode_text_rows(&reader->header, reader->lut, &reader->text, dst, stride, rows) != 0)
         {
-            fprintf(stderr, "Error: Failed to parse PPM file data\n");
-            fclose(f);
-            return NULL;
+            fprintf(stderr, "Error: Invalid or truncated sample data after row %d\n", reader->next_row);
+            return -1;
         }
-        layer = create_layer(width, height);
-        if (!layer)
+        reader->next_row += rows;
+        STATS_ADD(pixels_decoded, (uint64_t)rows * reader->header.width);
+        stats_end_stage(IMAGE_STAGE_PARSE, "read_image_rows", start);
+        return rows;
+    }
+
+    for (int r = 0; r < rows; r++)
+    {
+        if (read_body_bytes(reader, reader->raw_row, reader->header.row_bytes) != 0)
         {
-            fprintf(stderr, "Error: Unable to allocate memory for layer data\n");
-            fclose(f);
-            return NULL;
+            fprintf(stderr, "Error: Unexpected end of file at row %d\n", reader->next_row);
+            return -1;
         }
-
-        memcpy(layer->data, data, length * sizeof(uint32_t));
-        free(data);
-        break;
-
-    default:
-        break;
+        decode_row(&reader->header, reader->lut, reader->raw_row, dst + (size_t)r * stride);
+        reader->next_row++;
     }
-    fclose(f);
-    return layer;
-}
\ No newline at end of file
+    STATS_ADD(bytes_read, (uint64_t)rows * reader->header.row_bytes);
+    STATS_ADD(pixels_decoded, (uint64_t)rows * reader->header.width);
+    stats_end_stage(IMAGE_STAGE_PARSE, "read_image_rows", start);
+    return rows;
+}
+
+void close_image_reader(ImageReader *reader)
+{
+    if (!reader)
+        return;
+    if (reader->fp)
+        fclose(reader->fp);
+    free(reader->pending);
+    free(reader->raw_row);
+    free(reader->lut);
+    free(reader);
+}
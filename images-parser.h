@@ -1,8 +1,121 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "images.h"
 
 #define IMAGE_PORTABLE_COMMENT_CHAR '#'
 
-Layer *parse_image_file(const char *filename, ImageFileType *out_type);
\ No newline at end of file
+// parse_netpbm_header results
+#define NETPBM_HEADER_OK 0
+#define NETPBM_HEADER_INVALID 1
+#define NETPBM_HEADER_INCOMPLETE 2 // the buffer ends before the header does
+
+/**
+ * The header of a Netpbm file, as found before the pixel data.
+ */
+typedef struct
+{
+    ImageFileType type;
+    int width, height;
+    unsigned int max_val; // 1 for PBM; samples are 2 bytes (big-endian) above 255
+    int plain;            // 1 for the ASCII forms (P1, P2, P3)
+    size_t body_offset;   // offset of the first body byte from the start of the file
+    size_t row_bytes;     // bytes per row in a binary body, 0 for plain bodies
+} NetpbmHeader;
+
+/**
+ * @brief Parses a Netpbm header from memory.
+ *
+ * Handles comments and arbitrary whitespace between fields, and the single
+ * whitespace character that separates the header from the body.
+ *
+ * @param[in]  buf     The start of the file.
+ * @param[in]  len     Number of bytes available in buf.
+ * @param[out] header  Filled in on success.
+ * @return NETPBM_HEADER_OK, NETPBM_HEADER_INVALID, or NETPBM_HEADER_INCOMPLETE
+ * when more bytes are needed to finish the header.
+ */
+int parse_netpbm_header(const uint8_t *buf, size_t len, NetpbmHeader *header);
+
+Layer *parse_image_file(const char *filename, ImageFileType *out_type);
+
+/**
+ * @brief Parses an image file like parse_image_file, shrinking it while it is decoded.
+ *
+ * Every pixel of the new layer is the average of a shrink x shrink box of
+ * file pixels; the layer is ceil(width / shrink) x ceil(height / shrink), and
+ * boxes that overhang the right or bottom edge average the pixels they cover.
+ * The full-resolution image is never stored: rows are decoded one at a time
+ * and summed, so the layer takes 1/shrink^2 of the memory. Handy
+ * for previews and thumbnails, possibly refined with resample_layer.
+ *
+ * @param[in]  filename  The path to the file.
+ * @param[out] out_type  Updated with the detected type.
+ * @param      shrink    Reduction factor: 1 (same as parse_image_file), 2, 4 or 8.
+ * @return The new layer with refcount 1, or NULL on failure or an unsupported factor.
+ */
+Layer *parse_image_file_scaled(const char *filename, ImageFileType *out_type, int shrink);
+
+/**
+ * @brief Reads a binary PBM (P4) file into a 1-bit-per-pixel Bitmap.
+ *
+ * The packed rows are copied as they are, without expanding them to ARGB
+ * pixels; save_bitmap writes them back the same way.
+ *
+ * @param filename The path to the file.
+ * @return The new bitmap (free it with free_bitmap), or NULL if the file
+ * could not be read or is not a P4 file.
+ */
+Bitmap *parse_bitmap_file(const char *filename);
+
+/* =========================================================================
+ * STREAMING READER
+ *
+ * Decodes a Netpbm file incrementally, a few rows at a time, into buffers
+ * owned by the caller. Memory use is bounded by the rows requested per call,
+ * so files larger than RAM can be processed band by band.
+ * ========================================================================= */
+
+typedef struct ImageReader ImageReader;
+
+/**
+ * @brief Opens a Netpbm file for incremental reading and parses its header.
+ *
+ * Supports PBM, PGM and PPM files in their binary (P4-P6) and plain ASCII
+ * (P1-P3) forms, with any max value up to 65535.
+ *
+ * @param filename The path to the file.
+ * @return A reader positioned on the first row, or NULL on failure.
+ */
+ImageReader *open_image_reader(const char *filename);
+
+/**
+ * @brief Returns the dimensions and type of the file being read.
+ *
+ * @param[in]  reader  An open reader.
+ * @param[out] width   Image width in pixels (may be NULL).
+ * @param[out] height  Image height in pixels (may be NULL).
+ * @param[out] type    The detected file type (may be NULL).
+ */
+void get_image_reader_info(const ImageReader *reader, int *width, int *height, ImageFileType *type);
+
+/**
+ * @brief Decodes the next rows of the file as opaque ARGB pixels.
+ *
+ * PBM pixels become opaque black (bit set) or opaque white; PGM and PPM
+ * samples are rescaled from the file's max value to 8 bits.
+ *
+ * @param reader  An open reader.
+ * @param dst     Destination for the rows; row r starts at dst + r * stride.
+ * @param stride  Distance between rows in pixels (at least the image width).
+ * @param rows    Maximum number of rows to decode.
+ * @return The number of rows decoded (0 once every row has been read), or -1
+ * on a read error or truncated file.
+ */
+int read_image_rows(ImageReader *reader, uint32_t *dst, size_t stride, int rows);
+
+/**
+ * @brief Closes the file and frees the reader.
+ */
+void close_image_reader(ImageReader *reader);
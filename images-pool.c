@@ -0,0 +1,259 @@
+#include "images-pool.h"
+#include "images-internal.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGES_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Number of distinct buffer sizes the pool keeps; buffers of other sizes are not pooled
+#define LAYER_POOL_MAX_SHAPES 32
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+// Larger buffers are cleared with non-temporal stores, which do not evict the caches
+#define STREAM_CLEAR_MIN_BYTES ((size_t)1 << 20)
+#define CACHE_LINE_SIZE ((size_t)64)
+
+// An idle buffer; the link to the next idle buffer of the same shape is stored in its pixels
+typedef struct PooledBuffer
+{
+    struct PooledBuffer *next;
+} PooledBuffer;
+
+typedef struct
+{
+    int width, height;
+    int aligned; // PIXEL_BUFFER_ALIGNED buffers are kept apart from the others
+    PooledBuffer *head;
+} PoolShape;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_enabled = 0; // read without the lock as a fast path
+static int pool_flags = 0;
+static PoolShape pool_shapes[LAYER_POOL_MAX_SHAPES];
+static int pool_num_shapes = 0;
+static LayerPoolStats pool_stats;
+
+static size_t buffer_bytes(int width, int height)
+{
+    return (size_t)width * height * sizeof(uint32_t);
+}
+
+static uint32_t *allocate_buffer(size_t bytes, int buffer_flags, int pool_flags)
+{
+    STATS_ADD(buffers_allocated, 1);
+    STATS_ADD(bytes_allocated, bytes);
+
+    int uninitialized = buffer_flags & PIXEL_BUFFER_UNINITIALIZED;
+    if ((pool_flags & LAYER_POOL_HUGE_PAGES) && bytes >= HUGE_PAGE_SIZE)
+    {
+        size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *pixels = aligned_alloc(HUGE_PAGE_SIZE, rounded);
+        if (pixels)
+        {
+#ifdef MADV_HUGEPAGE
+            madvise(pixels, rounded, MADV_HUGEPAGE);
+#endif
+            if (!uninitialized)
+                memset(pixels, 0, bytes);
+            return (uint32_t *)pixels;
+        }
+    }
+
+    if (buffer_flags & PIXEL_BUFFER_ALIGNED)
+    {
+        void *pixels = aligned_alloc(CACHE_LINE_SIZE, (bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+        if (pixels && !uninitialized)
+            memset(pixels, 0, bytes);
+        return (uint32_t *)pixels;
+    }
+
+    // calloc gets fresh pages already zeroed from the kernel
+    return (uint32_t *)(uninitialized ? malloc(bytes) : calloc(bytes, 1));
+}
+
+#ifdef IMAGES_X86_SIMD
+__attribute__((target("sse2"))) static void stream_clear(uint8_t *dst, size_t bytes)
+{
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > bytes)
+        head = bytes;
+    memset(dst, 0, head);
+    dst += head;
+    bytes -= head;
+
+    const __m128i zero = _mm_setzero_si128();
+    for (; bytes >= 64; dst += 64, bytes -= 64)
+    {
+        _mm_stream_si128((__m128i *)dst, zero);
+        _mm_stream_si128((__m128i *)(dst + 16), zero);
+        _mm_stream_si128((__m128i *)(dst + 32), zero);
+        _mm_stream_si128((__m128i *)(dst + 48), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, bytes);
+}
+#endif
+
+// Clears a recycled buffer; large ones bypass the caches since they are rarely read right away
+static void clear_buffer(uint32_t *pixels, size_t bytes)
+{
+#ifdef IMAGES_X86_SIMD
+    if (bytes >= STREAM_CLEAR_MIN_BYTES)
+    {
+        stream_clear((uint8_t *)pixels, bytes);
+        return;
+    }
+#endif
+    memset(pixels, 0, bytes);
+}
+
+static PoolShape *find_shape(int width, int height, int aligned)
+{
+    for (int i = 0; i < pool_num_shapes; i++)
+    {
+        if (pool_shapes[i].width == width && pool_shapes[i].height == height && pool_shapes[i].aligned == aligned)
+            return &pool_shapes[i];
+    }
+    return NULL;
+}
+
+// Frees idle buffers until the pool holds at most max_bytes. Called with pool_lock held.
+static void shrink_pool(size_t max_bytes)
+{
+    for (int i = 0; i < pool_num_shapes && pool_stats.cached_bytes > max_bytes; i++)
+    {
+        PoolShape *shape = &pool_shapes[i];
+        size_t bytes = buffer_bytes(shape->width, shape->height);
+        while (shape->head && pool_stats.cached_bytes > max_bytes)
+        {
+            PooledBuffer *buffer = shape->head;
+            shape->head = buffer->next;
+            free(buffer);
+            pool_stats.cached_buffers--;
+            pool_stats.cached_bytes -= bytes;
+        }
+    }
+}
+
+uint32_t *acquire_pixel_buffer(int width, int height, int flags)
+{
+    size_t bytes = buffer_bytes(width, height);
+    if (bytes < sizeof(PooledBuffer) || !__atomic_load_n(&pool_enabled, __ATOMIC_ACQUIRE))
+        return allocate_buffer(bytes, flags, 0);
+
+    pthread_mutex_lock(&pool_lock);
+    PoolShape *shape = find_shape(width, height, flags & PIXEL_BUFFER_ALIGNED);
+    PooledBuffer *buffer = shape ? shape->head : NULL;
+    if (buffer)
+    {
+        shape->head = buffer->next;
+        pool_stats.hits++;
+        pool_stats.cached_buffers--;
+        pool_stats.cached_bytes -= bytes;
+    }
+    else
+    {
+        pool_stats.misses++;
+    }
+    int current_pool_flags = pool_flags;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!buffer)
+        return allocate_buffer(bytes, flags, current_pool_flags);
+
+    if (!(flags & PIXEL_BUFFER_UNINITIALIZED))
+        clear_buffer((uint32_t *)buffer, bytes);
+    return (uint32_t *)buffer;
+}
+
+void recycle_pixel_buffer(uint32_t *pixels, int width, int height, int flags)
+{
+    if (!pixels)
+        return;
+
+    size_t bytes = buffer_bytes(width, height);
+    if (bytes < sizeof(PooledBuffer) || !__atomic_load_n(&pool_enabled, __ATOMIC_ACQUIRE))
+    {
+        free(pixels);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    int aligned = flags & PIXEL_BUFFER_ALIGNED;
+    PoolShape *shape = find_shape(width, height, aligned);
+    for (int i = 0; !shape && i < pool_num_shapes; i++)
+    {
+        // reuse the slot of a size that has no idle buffer left
+        if (!pool_shapes[i].head)
+            shape = &pool_shapes[i];
+    }
+    if (!shape && pool_num_shapes < LAYER_POOL_MAX_SHAPES)
+        shape = &pool_shapes[pool_num_shapes++];
+    if (shape && !shape->head)
+    {
+        shape->width = width;
+        shape->height = height;
+        shape->aligned = aligned;
+    }
+
+    if (!pool_enabled || !shape || pool_stats.cached_bytes + bytes > pool_stats.max_bytes)
+    {
+        pool_stats.evictions++;
+        pthread_mutex_unlock(&pool_lock);
+        free(pixels);
+        return;
+    }
+
+    PooledBuffer *buffer = (PooledBuffer *)pixels;
+    buffer->next = shape->head;
+    shape->head = buffer;
+    pool_stats.recycled++;
+    pool_stats.cached_buffers++;
+    pool_stats.cached_bytes += bytes;
+    if (pool_stats.cached_bytes > pool_stats.peak_cached_bytes)
+        pool_stats.peak_cached_bytes = pool_stats.cached_bytes;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void enable_layer_pool(size_t max_bytes, int flags)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_flags = flags;
+    pool_stats.max_bytes = max_bytes;
+    shrink_pool(max_bytes);
+    __atomic_store_n(&pool_enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void trim_layer_pool(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    shrink_pool(0);
+    pool_num_shapes = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void disable_layer_pool(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    __atomic_store_n(&pool_enabled, 0, __ATOMIC_RELEASE);
+    shrink_pool(0);
+    pool_num_shapes = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void get_layer_pool_stats(LayerPoolStats *stats)
+{
+    if (!stats)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_lock);
+}
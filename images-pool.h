@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+
+/* =========================================================================
+ * LAYER POOL
+ *
+ * An opt-in cache of pixel buffers. While enabled, the pixel buffers of
+ * released layers (and tiles) are kept, keyed by their dimensions, and handed
+ * to the next layer of the same size instead of going back to the allocator.
+ * Render loops that create and release same-sized layers every frame then
+ * stop paying for page faults, and their memory use stays flat.
+ * ========================================================================= */
+
+// enable_layer_pool flags
+#define LAYER_POOL_HUGE_PAGES 1 // allocate buffers of 2 MB or more 2 MB-aligned and advise huge pages
+
+/**
+ * Counters of the layer pool, since it was first enabled.
+ */
+typedef struct
+{
+    size_t hits;              // buffers handed out from the pool
+    size_t misses;            // buffers allocated because the pool had none of that size
+    size_t recycled;          // buffers returned to the pool
+    size_t evictions;         // buffers freed on release because the pool was full
+    size_t cached_buffers;    // buffers currently held by the pool
+    size_t cached_bytes;      // bytes currently held by the pool
+    size_t peak_cached_bytes; // highest cached_bytes so far
+    size_t max_bytes;         // the limit passed to enable_layer_pool
+} LayerPoolStats;
+
+/**
+ * @brief Starts recycling layer pixel buffers.
+ * * Calling it again while enabled changes the limit and flags; buffers over
+ * the new limit are freed.
+ * * @param max_bytes The most memory the pool may hold in idle buffers.
+ * @param flags A combination of the LAYER_POOL_* flags.
+ */
+void enable_layer_pool(size_t max_bytes, int flags);
+
+/**
+ * @brief Stops recycling buffers and frees every buffer held by the pool.
+ * * Layers that are still alive keep their pixels; they are simply freed
+ * normally when released.
+ */
+void disable_layer_pool(void);
+
+/**
+ * @brief Frees every buffer held by the pool, but keeps it enabled.
+ */
+void trim_layer_pool(void);
+
+/**
+ * @brief Copies the current pool counters.
+ * * @param[out] stats Filled in with the counters.
+ */
+void get_layer_pool_stats(LayerPoolStats *stats);
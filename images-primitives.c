@@ -1,274 +1,1013 @@
 #include "images-primitives.h"
+#include "images-internal.h"
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void draw_pixel_safe(Layer *layer, int x, int y, uint32_t color)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGES_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* =========================================================================
+ * SPAN FILL
+ *
+ * The filled primitives are reduced to horizontal spans. Each span is clipped
+ * once and stored with vector stores, and every pixel is written exactly once.
+ * ========================================================================= */
+
+#ifdef IMAGES_X86_SIMD
+__attribute__((target("sse2"))) static void fill_pixels(uint32_t *dst, size_t count, uint32_t color)
+{
+    // Single pixels up to a 16-byte boundary, so the loop only does aligned stores
+    for (; count > 0 && ((uintptr_t)dst & 15); count--)
+        *dst++ = color;
+
+    const __m128i value = _mm_set1_epi32((int)color);
+    for (; count >= 16; dst += 16, count -= 16)
+    {
+        _mm_store_si128((__m128i *)dst, value);
+        _mm_store_si128((__m128i *)(dst + 4), value);
+        _mm_store_si128((__m128i *)(dst + 8), value);
+        _mm_store_si128((__m128i *)(dst + 12), value);
+    }
+    for (; count >= 4; dst += 4, count -= 4)
+        _mm_store_si128((__m128i *)dst, value);
+
+    while (count--)
+        *dst++ = color;
+}
+#else
+static void fill_pixels(uint32_t *dst, size_t count, uint32_t color)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        dst[i] = color;
+    }
+}
+#endif
+
+// Writes count pixels in the layer's paint mode; blended colors are never opaque or transparent
+static inline void paint_pixels(const Layer *layer, uint32_t *dst, int count, uint32_t color)
+{
+    if (layer->paint_mode == PAINT_MODE_BLEND && GET_A(color) != 255)
+        blend_color_span(dst, count, color, layer->premultiplied);
+    else
+        fill_pixels(dst, (size_t)count, color);
+}
+
+void fill_layer_span(Layer *layer, int y, int x0, int x1, uint32_t color)
+{
+    if (y < 0 || y >= layer->height)
+        return;
+    if (x0 < 0)
+        x0 = 0;
+    if (x1 > layer->width)
+        x1 = layer->width;
+
+    if (layer->data)
+    {
+        if (x1 > x0)
+            paint_pixels(layer, layer->data + (size_t)y * layer->stride + x0, x1 - x0, color);
+        return;
+    }
+
+    // Tiled layers are filled one tile row at a time
+    while (x0 < x1)
+    {
+        int run_end = (x0 / LAYER_TILE_SIZE + 1) * LAYER_TILE_SIZE;
+        if (run_end > x1)
+            run_end = x1;
+
+        uint32_t *run = layer_write_ptr(layer, x0, y);
+        if (run)
+            paint_pixels(layer, run, run_end - x0, color);
+        x0 = run_end;
+    }
+}
+
+// Fills rows yc - dy and yc + dy (once when dy is 0) from xc - half to xc + half
+static void fill_symmetric_span(Layer *layer, int xc, int yc, long long dy, long long half, uint32_t color)
+{
+    long long x0 = xc - half, x1 = xc + half + 1;
+    if (x0 < 0)
+        x0 = 0;
+    if (x1 > layer->width)
+        x1 = layer->width;
+    if (x0 >= x1)
+        return;
+
+    if (yc + dy < layer->height)
+        fill_layer_span(layer, (int)(yc + dy), (int)x0, (int)x1, color);
+    if (dy != 0 && yc - dy >= 0)
+        fill_layer_span(layer, (int)(yc - dy), (int)x0, (int)x1, color);
+}
+
+/*
+Internal drawing helpers do not record changes; every public primitive calls
+begin_layer_write once with its bounding box instead of once per pixel. That also
+gives the layer private pixels if they are shared copy-on-write.
+In PAINT_MODE_BLEND a pixel plotted twice would be blended twice, so the
+outline primitives plot every pixel of a shape exactly once.
+*/
+static inline void plot_pixel(Layer *layer, int x, int y, uint32_t color)
 {
     if (x >= 0 && x < layer->width && y >= 0 && y < layer->height)
     {
-        layer->data[y * layer->width + x] = color;
+        uint32_t *pixel = layer_write_ptr(layer, x, y);
+        if (pixel)
+            *pixel = layer->paint_mode == PAINT_MODE_BLEND ? blend_color_pixel(*pixel, color, layer->premultiplied) : color;
     }
 }
 
-void fill_layer(Layer *layer, uint32_t color)
+// Plots (xc +- dx, yc +- dy), skipping the mirror images that coincide when dx or dy is 0
+static void plot_quadrants(Layer *layer, int xc, int yc, int dx, int dy, uint32_t color)
 {
-    size_t total_pixels = (size_t)layer->width * (size_t)layer->height;
-    for (size_t i = 0; i < total_pixels; i++)
+    plot_pixel(layer, xc + dx, yc + dy, color);
+    if (dx != 0)
+        plot_pixel(layer, xc - dx, yc + dy, color);
+    if (dy != 0)
     {
-        layer->data[i] = color;
+        plot_pixel(layer, xc + dx, yc - dy, color);
+        if (dx != 0)
+            plot_pixel(layer, xc - dx, yc - dy, color);
     }
 }
 
-void draw_rect_filled(Layer *layer, int x, int y, int w, int h, uint32_t color)
+void set_layer_paint_mode(Layer *layer, PaintMode mode)
+{
+    if (layer)
+        layer->paint_mode = mode;
+}
+
+/* =========================================================================
+ * RASTERIZERS
+ *
+ * A rasterizer draws one shape with a color already in the layer's
+ * representation, clipped to the layer, and records nothing. Public primitives
+ * describe their shape as a DrawCommand and go through draw_command; display
+ * lists (images-display-list.h) replay the same commands tile by tile.
+ * ========================================================================= */
+
+/*
+The line and outline walks are incremental, but the state of each walk at any
+step also has a closed form. The walks use it to start at the first step that
+can land on the layer and to stop after the last one, so a display list tile
+(a layer covering one tile) only pays for the steps that reach it. Closed forms
+that need a square root are estimated in floating point and then corrected
+with exact integer tests, so the pixels are those of a walk from the start.
+*/
+
+// Range of |v| over v in [lo, hi]
+static void abs_range(long long lo, long long hi, long long *min, long long *max)
+{
+    if (lo > 0)
+    {
+        *min = lo;
+        *max = hi;
+    }
+    else if (hi < 0)
+    {
+        *min = -hi;
+        *max = -lo;
+    }
+    else
+    {
+        *min = 0;
+        *max = -lo > hi ? -lo : hi;
+    }
+}
+
+// (a * b + c) / d with the remainder in *rem, for a, b < 2^33 and a * b + c < 2^66
+static long long mul_div(long long a, long long b, long long c, long long d, long long *rem)
+{
+    // b = high * 2^16 + low, so no partial product exceeds 2^50
+    long long high = a * (b >> 16);
+    long long q = high / d;
+    long long r = ((high % d) << 16) + a * (b & 0xFFFF) + c;
+    *rem = r % d;
+    return (q << 16) + r / d;
+}
+
+static void rasterize_line(Layer *layer, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    // Bresenham takes one step along the major axis per pixel; after k steps it
+    // has taken (2 * minor * k + major) / (2 * major) steps along the minor axis
+    long long dx = llabs((long long)x1 - x0);
+    long long dy = llabs((long long)y1 - y0);
+    int steep = dy > dx;
+    long long major = steep ? dy : dx, minor = steep ? dx : dy;
+    long long m = steep ? y0 : x0, n = steep ? x0 : y0;
+    int m_step = (steep ? y0 < y1 : x0 < x1) ? 1 : -1;
+    int n_step = (steep ? x0 < x1 : y0 < y1) ? 1 : -1;
+
+    if (major == 0)
+    {
+        plot_pixel(layer, x0, y0, color);
+        return;
+    }
+
+    // steps whose major coordinate is on the layer
+    long long size = steep ? layer->height : layer->width;
+    long long first = m_step > 0 ? -m : m - (size - 1);
+    long long last = m_step > 0 ? size - 1 - m : m;
+    if (first < 0)
+        first = 0;
+    if (last > major)
+        last = major;
+    if (first > last)
+        return;
+
+    long long rem;
+    m += m_step * first;
+    n += n_step * mul_div(2 * minor, first, major, 2 * major, &rem);
+    for (long long k = first; k <= last; k++)
+    {
+        plot_pixel(layer, (int)(steep ? n : m), (int)(steep ? m : n), color);
+
+        m += m_step;
+        rem += 2 * minor;
+        if (rem >= 2 * major)
+        {
+            rem -= 2 * major;
+            n += n_step;
+        }
+    }
+}
+
+static void rasterize_rect_filled(Layer *layer, int x, int y, int w, int h, uint32_t color)
 {
-    // 1. Calculate clipping bounds
-    int x_start = (x < 0) ? 0 : x;
     int y_start = (y < 0) ? 0 : y;
-    int x_end = (x + w > layer->width) ? layer->width : x + w;
     int y_end = (y + h > layer->height) ? layer->height : y + h;
 
-    // 2. Iterate and fill
+    // One span per row; fill_layer_span clips the columns
     for (int cy = y_start; cy < y_end; cy++)
     {
-        // Optimization: Calculate row offset once per row
-        int row_offset = cy * layer->width;
-        for (int cx = x_start; cx < x_end; cx++)
-        {
-            layer->data[row_offset + cx] = color;
-        }
+        fill_layer_span(layer, cy, x, x + w, color);
     }
 }
 
-void draw_rect_outline(Layer *layer, int x, int y, int w, int h, uint32_t color)
+static void rasterize_rect_outline(Layer *layer, int x, int y, int w, int h, uint32_t color)
 {
-    // Top and Bottom
-    for (int px = x; px < x + w; px++)
+    // Top and Bottom (the same row when h is 1), over the columns on the layer
+    long long px_first = x < 0 ? 0 : x;
+    long long px_end = (long long)x + w < layer->width ? (long long)x + w : layer->width;
+    for (long long px = px_first; px < px_end; px++)
     {
-        draw_pixel_safe(layer, px, y, color);         // Top
-        draw_pixel_safe(layer, px, y + h - 1, color); // Bottom
+        plot_pixel(layer, (int)px, y, color); // Top
+        if (h != 1)
+            plot_pixel(layer, (int)px, y + h - 1, color); // Bottom
     }
-    // Left and Right (skip corners to avoid double drawing)
-    for (int py = y + 1; py < y + h - 1; py++)
+    // Left and Right (skip corners to avoid double drawing), over the rows on the layer
+    long long py_first = (long long)y + 1 < 0 ? 0 : (long long)y + 1;
+    long long py_end = (long long)y + h - 1 < layer->height ? (long long)y + h - 1 : layer->height;
+    for (long long py = py_first; py < py_end; py++)
     {
-        draw_pixel_safe(layer, x, py, color);         // Left
-        draw_pixel_safe(layer, x + w - 1, py, color); // Right
+        plot_pixel(layer, x, (int)py, color); // Left
+        if (w != 1)
+            plot_pixel(layer, x + w - 1, (int)py, color); // Right
     }
 }
-void draw_line(Layer *layer, int x0, int y0, int x1, int y1, uint32_t color)
+
+// Decision variable of the circle walk at (x, y)
+static inline long long circle_decision(long long r, long long x, long long y)
+{
+    return 2 * (x * x + (y * y - r * r)) + 8 * x - 6 * y + 4 * r + 3;
+}
+
+// Row of the circle walk at column x, which is below the walk's last column if it ends before x
+static long long circle_walk_row(long long r, long long x)
 {
-    int dx = abs(x1 - x0);
-    int sx = x0 < x1 ? 1 : -1;
-    int dy = -abs(y1 - y0);
-    int sy = y0 < y1 ? 1 : -1;
-    int err = dx + dy;
+    if (x == 0)
+        return r;
 
-    while (1)
+    // Off the diagonal, the row at column c is the highest whose decision is at most 4 * c + 6
+    long long c = x - 1, y = r;
+    if (c > 0)
     {
-        draw_pixel_safe(layer, x0, y0, color);
+        double e = (double)r * r - (double)c * c;
+        y = e > 0 ? (long long)sqrt(e) : 0;
+        while (circle_decision(r, c, y + 1) <= 4 * c + 6)
+            y++;
+        while (y > 0 && circle_decision(r, c, y) > 4 * c + 6)
+            y--;
+    }
 
-        if (x0 == x1 && y0 == y1)
-            break;
+    // then one step of the walk itself
+    return circle_decision(r, c, y) > 0 ? y - 1 : y;
+}
+
+// Walks columns first to last of the circle's first octant, plotting (x, y) or, with swap, (y, x) in every octant pair
+static void walk_circle_octants(Layer *layer, int xc, int yc, long long r, long long first, long long last, int swap,
+                                uint32_t color)
+{
+    long long x = first;
+    long long y = circle_walk_row(r, x);
+    long long d = circle_decision(r, x, y);
+
+    for (; y >= x && x <= last; x++)
+    {
+        // on the diagonal (x == y) the two halves are the same pixels
+        if (!swap)
+            plot_quadrants(layer, xc, yc, (int)x, (int)y, color);
+        else if (x != y)
+            plot_quadrants(layer, xc, yc, (int)y, (int)x, color);
 
-        int e2 = 2 * err;
-        if (e2 >= dy)
+        if (d > 0)
         {
-            err += dy;
-            x0 += sx;
+            y--;
+            d = d + 4 * (x + 1 - y) + 10;
         }
-        if (e2 <= dx)
+        else
         {
-            err += dx;
-            y0 += sy;
+            d = d + 4 * (x + 1) + 6;
         }
     }
 }
 
-void draw_circle_outline(Layer *layer, int xc, int yc, int r, uint32_t color)
+static void rasterize_circle_outline(Layer *layer, int xc, int yc, int r, uint32_t color)
 {
-    int x = 0;
-    int y = r;
-    int d = 3 - 2 * r;
+    if (r < 0)
+        return;
 
-    while (y >= x)
+    // Pixels (xc +- x, yc +- y) need x on the layer's columns, (xc +- y, yc +- x) on its rows
+    long long first, last;
+    abs_range(-(long long)xc, (long long)layer->width - 1 - xc, &first, &last);
+    walk_circle_octants(layer, xc, yc, r, first, last, 0, color);
+    abs_range(-(long long)yc, (long long)layer->height - 1 - yc, &first, &last);
+    walk_circle_octants(layer, xc, yc, r, first, last, 1, color);
+}
+
+// Last column of the circle walk, where it crosses the diagonal
+static long long circle_last_column(long long r)
+{
+    long long x = (long long)((double)r * sqrt(0.5));
+    while (circle_walk_row(r, x + 1) >= x + 1)
+        x++;
+    while (x > 0 && circle_walk_row(r, x) < x)
+        x--;
+    return x;
+}
+
+// Widest column the circle walk reaches on row dy, for 0 <= dy <= r
+static long long circle_half_width(long long r, long long x_last, long long dy)
+{
+    // Rows up to the last column are widest where the mirrored octant reaches them
+    if (dy <= x_last)
+        return circle_walk_row(r, dy);
+
+    // Above it, search the last column whose row is still dy. The walk stays within
+    // a row of the true circle, which brackets the search
+    double e_lo = (double)(r - dy - 1) * (double)(r + dy + 1);
+    double e_hi = (double)(r - dy + 1) * (double)(r + dy - 1);
+    long long lo = e_lo > 0 ? (long long)sqrt(e_lo) - 1 : 0;
+    long long hi = (long long)sqrt(e_hi) + 2;
+    if (lo < 0 || lo > x_last || circle_walk_row(r, lo) < dy)
+        lo = 0;
+    if (hi > x_last || hi <= lo || circle_walk_row(r, hi) >= dy)
+        hi = x_last + 1;
+    while (hi - lo > 1)
     {
-        // Draw all 8 octants
-        draw_pixel_safe(layer, xc + x, yc + y, color);
-        draw_pixel_safe(layer, xc - x, yc + y, color);
-        draw_pixel_safe(layer, xc + x, yc - y, color);
-        draw_pixel_safe(layer, xc - x, yc - y, color);
-        draw_pixel_safe(layer, xc + y, yc + x, color);
-        draw_pixel_safe(layer, xc - y, yc + x, color);
-        draw_pixel_safe(layer, xc + y, yc - x, color);
-        draw_pixel_safe(layer, xc - y, yc - x, color);
+        long long mid = lo + (hi - lo) / 2;
+        if (circle_walk_row(r, mid) >= dy)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void rasterize_circle_filled(Layer *layer, int xc, int yc, int r, uint32_t color)
+{
+    if (r < 0)
+        return;
 
+    // One span per row on the layer, as wide as the midpoint walk reaches on it
+    long long first, last;
+    abs_range(-(long long)yc, (long long)layer->height - 1 - yc, &first, &last);
+    if (last > r)
+        last = r;
+
+    long long x_last = circle_last_column(r);
+    for (long long dy = first; dy <= last; dy++)
+    {
+        fill_symmetric_span(layer, xc, yc, dy, circle_half_width(r, x_last, dy), color);
+    }
+}
+
+/*
+The ellipse walk has two regions: region 1 takes one step per column while the
+slope is below 1, region 2 one step per row after that. Both decision
+variables are quadratic in (x, y), offset by the rounding of their initial
+values, which the walk records.
+*/
+typedef struct
+{
+    long long rx2, ry2, ry;
+    long long p1;           // region 1 decision at (0, ry)
+    long long x_end, y_end; // first step of region 2
+    long long p2;           // region 2 decision at (x_end, y_end)
+} EllipseWalk;
+
+static inline long long ellipse_decision1(const EllipseWalk *walk, long long x, long long y)
+{
+    return walk->p1 + walk->ry2 * (x * (x + 2)) - walk->rx2 * ((walk->ry - y) * (walk->ry + y - 1));
+}
+
+static inline long long ellipse_decision2(const EllipseWalk *walk, long long x, long long y)
+{
+    return walk->p2 + walk->ry2 * (x * (x + 1) - walk->x_end * (walk->x_end + 1)) +
+           walk->rx2 * ((y - 1) * (y - 1) - (walk->y_end - 1) * (walk->y_end - 1));
+}
+
+// Region 1 row at column x: the highest whose decision at column x - 1 is negative.
+// Past region 1 this is at most the walk's row.
+static long long ellipse_region1_row(const EllipseWalk *walk, long long x)
+{
+    if (x == 0)
+        return walk->ry;
+
+    // decision(c, y) = decision(c, 0) + rx2 * (y^2 - y)
+    long long c = x - 1;
+    double t = -(double)ellipse_decision1(walk, c, 0) / (double)walk->rx2;
+    long long y = t > -0.25 ? (long long)(0.5 + sqrt(0.25 + t)) : -1;
+    while (ellipse_decision1(walk, c, y + 1) < 0)
+        y++;
+    while (y >= 0 && ellipse_decision1(walk, c, y) >= 0)
+        y--;
+    return y;
+}
+
+// Region 2 column at row y <= y_end: the lowest from x_end on whose decision at row y + 1 is positive
+static long long ellipse_region2_column(const EllipseWalk *walk, long long y)
+{
+    if (y >= walk->y_end)
+        return walk->x_end;
+
+    // decision(x, r) = decision(0, r) + ry2 * (x^2 + x)
+    double t = -(double)ellipse_decision2(walk, 0, y + 1) / (double)walk->ry2;
+    long long x = t > -0.25 ? (long long)(sqrt(0.25 + t) - 0.5) : 0;
+    if (x < walk->x_end)
+        x = walk->x_end;
+    while (x > walk->x_end && ellipse_decision2(walk, x - 1, y + 1) > 0)
+        x--;
+    while (ellipse_decision2(walk, x, y + 1) <= 0)
         x++;
-        if (d > 0)
-        {
+    return x;
+}
+
+static void init_ellipse_walk(EllipseWalk *walk, int rx, int ry)
+{
+    walk->rx2 = (long long)rx * rx;
+    walk->ry2 = (long long)ry * ry;
+    walk->ry = ry;
+    walk->p1 = (long long)(walk->ry2 - (walk->rx2 * ry) + (0.25 * walk->rx2));
+
+    // Region 1 runs while ry2 * x < rx2 * y, which turns false once for good: search that column
+    long long lo = 0, hi = llabs((long long)rx) + 1;
+    while (lo < hi)
+    {
+        long long mid = lo + (hi - lo) / 2;
+        if (walk->ry2 * mid >= walk->rx2 * ellipse_region1_row(walk, mid))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    // The row after the last step of region 1
+    long long x = lo, y = ry;
+    if (x > 0)
+    {
+        y = ellipse_region1_row(walk, x - 1);
+        if (ellipse_decision1(walk, x - 1, y) >= 0)
             y--;
-            d = d + 4 * (x - y) + 10;
+    }
+
+    walk->x_end = x;
+    walk->y_end = y;
+    walk->p2 = (long long)(walk->ry2 * (x + 0.5) * (x + 0.5) + walk->rx2 * (y - 1) * (y - 1) - walk->rx2 * walk->ry2);
+}
+
+static void rasterize_ellipse_outline(Layer *layer, int xc, int yc, int rx, int ry, uint32_t color)
+{
+    if (ry < 0)
+        return;
+
+    EllipseWalk walk;
+    init_ellipse_walk(&walk, rx, ry);
+    long long first, last;
+
+    /* --- Region 1: Slope dx/dy < 1 (Top and Bottom flat parts), over the columns on the layer --- */
+    abs_range(-(long long)xc, (long long)layer->width - 1 - xc, &first, &last);
+    if (last > walk.x_end - 1)
+        last = walk.x_end - 1;
+    if (first <= last)
+    {
+        long long x = first;
+        long long y = ellipse_region1_row(&walk, x);
+        long long p = ellipse_decision1(&walk, x, y);
+        for (; x <= last; x++)
+        {
+            // Draw 4 quadrants
+            plot_quadrants(layer, xc, yc, (int)x, (int)y, color);
+
+            if (p < 0)
+            {
+                p += walk.ry2 + 2 * walk.ry2 * (x + 1);
+            }
+            else
+            {
+                y--;
+                p += walk.ry2 + 2 * walk.ry2 * (x + 1) - 2 * walk.rx2 * y;
+            }
         }
-        else
+    }
+
+    /* --- Region 2: Slope dx/dy >= 1 (Side steep parts), over the rows on the layer --- */
+    abs_range(-(long long)yc, (long long)layer->height - 1 - yc, &first, &last);
+    if (last > walk.y_end)
+        last = walk.y_end;
+    if (first <= last)
+    {
+        long long y = last;
+        long long x = ellipse_region2_column(&walk, y);
+        long long p = ellipse_decision2(&walk, x, y);
+        for (; y >= first; y--)
         {
-            d = d + 4 * x + 6;
+            // Draw 4 quadrants
+            plot_quadrants(layer, xc, yc, (int)x, (int)y, color);
+
+            if (p > 0)
+            {
+                p += walk.rx2 - 2 * walk.rx2 * (y - 1);
+            }
+            else
+            {
+                x++;
+                p += walk.rx2 - 2 * walk.rx2 * (y - 1) + 2 * walk.ry2 * x;
+            }
         }
     }
 }
 
-void draw_circle_filled(Layer *layer, int xc, int yc, int r, uint32_t color)
+// Widest column the ellipse walk reaches on row dy, for 0 <= dy <= ry
+static long long ellipse_half_width(const EllipseWalk *walk, long long rx, long long dy)
 {
-    int x = 0;
-    int y = r;
-    int d = 3 - 2 * r;
+    // Region 2 takes one column per row, right of every column of region 1
+    if (dy <= walk->y_end)
+        return ellipse_region2_column(walk, dy);
 
-    while (y >= x)
+    // Region 1 reaches the row over several columns; search the last one. The walk
+    // stays within a row of the true ellipse, which brackets the search
+    long long ry = walk->ry, x_last = walk->x_end - 1;
+    double scale = (double)rx / (double)ry;
+    double e_lo = (double)(ry - dy - 1) * (double)(ry + dy + 1);
+    double e_hi = (double)(ry - dy + 1) * (double)(ry + dy - 1);
+    long long lo = e_lo > 0 ? (long long)(scale * sqrt(e_lo)) - 1 : 0;
+    long long hi = (long long)(scale * sqrt(e_hi)) + 2;
+    if (lo < 0 || lo > x_last || ellipse_region1_row(walk, lo) < dy)
+        lo = 0;
+    if (hi > x_last || hi <= lo || ellipse_region1_row(walk, hi) >= dy)
+        hi = x_last + 1;
+    while (hi - lo > 1)
     {
-        // Draw horizontal lines between octant points
-        // Line between (xc - x, yc + y) and (xc + x, yc + y)
-        draw_line(layer, xc - x, yc + y, xc + x, yc + y, color);
+        long long mid = lo + (hi - lo) / 2;
+        if (ellipse_region1_row(walk, mid) >= dy)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void rasterize_ellipse_filled(Layer *layer, int xc, int yc, int rx, int ry, uint32_t color)
+{
+    if (ry < 0)
+        return;
 
-        // Line between (xc - x, yc - y) and (xc + x, yc - y)
-        draw_line(layer, xc - x, yc - y, xc + x, yc - y, color);
+    EllipseWalk walk;
+    init_ellipse_walk(&walk, rx, ry);
 
-        // Line between (xc - y, yc + x) and (xc + y, yc + x)
-        draw_line(layer, xc - y, yc + x, xc + y, yc + x, color);
+    // One span per row on the layer, as wide as the midpoint walk reaches on it
+    long long first, last;
+    abs_range(-(long long)yc, (long long)layer->height - 1 - yc, &first, &last);
+    if (last > ry)
+        last = ry;
 
-        // Line between (xc - y, yc - x) and (xc + y, yc - x)
-        draw_line(layer, xc - y, yc - x, xc + y, yc - x, color);
+    for (long long dy = first; dy <= last; dy++)
+    {
+        fill_symmetric_span(layer, xc, yc, dy, ellipse_half_width(&walk, llabs((long long)rx), dy), color);
+    }
+}
 
-        x++;
-        if (d > 0)
+// Clips the box [x0, x1) x [y0, y1) to non-negative coordinates, where x + w fits in an int
+static ImageRect clamp_bounds(long long x0, long long y0, long long x1, long long y1)
+{
+    x0 = x0 < 0 ? 0 : x0 > INT_MAX ? INT_MAX : x0;
+    y0 = y0 < 0 ? 0 : y0 > INT_MAX ? INT_MAX : y0;
+    x1 = x1 < x0 ? x0 : x1 > INT_MAX ? INT_MAX : x1;
+    y1 = y1 < y0 ? y0 : y1 > INT_MAX ? INT_MAX : y1;
+    ImageRect bounds = {(int)x0, (int)y0, (int)(x1 - x0), (int)(y1 - y0)};
+    return bounds;
+}
+
+ImageRect draw_command_bounds(const DrawCommand *cmd)
+{
+    // Shapes can reach past the int range, so the box is computed in long long
+    long long x0 = cmd->x0, y0 = cmd->y0, x1 = cmd->x1, y1 = cmd->y1;
+    switch (cmd->type)
+    {
+    case DRAW_COMMAND_PIXEL:
+        return clamp_bounds(x0, y0, x0 + 1, y0 + 1);
+    case DRAW_COMMAND_LINE:
+        return clamp_bounds(x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, (x0 > x1 ? x0 : x1) + 1, (y0 > y1 ? y0 : y1) + 1);
+    case DRAW_COMMAND_RECT_FILLED:
+        return clamp_bounds(x0, y0, x0 + x1, y0 + y1);
+    case DRAW_COMMAND_RECT_OUTLINE:
+    {
+        // degenerate sizes still draw the columns x and x + w - 1 (and rows alike)
+        long long x_last = x0 + x1 - 1, y_last = y0 + y1 - 1;
+        return clamp_bounds(x0 < x_last ? x0 : x_last, y0 < y_last ? y0 : y_last, (x0 > x_last ? x0 : x_last) + 1,
+                            (y0 > y_last ? y0 : y_last) + 1);
+    }
+    case DRAW_COMMAND_CIRCLE_FILLED:
+    case DRAW_COMMAND_CIRCLE_OUTLINE:
+        if (x1 < 0)
+            break;
+        return clamp_bounds(x0 - x1, y0 - x1, x0 + x1 + 1, y0 + x1 + 1);
+    case DRAW_COMMAND_ELLIPSE_FILLED:
+    case DRAW_COMMAND_ELLIPSE_OUTLINE:
+    {
+        if (y1 < 0)
+            break;
+        // the midpoint walk can step one pixel past rx, so pad the box by one
+        long long rx = llabs(x1);
+        return clamp_bounds(x0 - rx - 1, y0 - y1, x0 + rx + 2, y0 + y1 + 1);
+    }
+    }
+    return clamp_bounds(x0, y0, x0, y0);
+}
+
+void rasterize_command(Layer *layer, const DrawCommand *cmd)
+{
+    switch (cmd->type)
+    {
+    case DRAW_COMMAND_PIXEL:
+        plot_pixel(layer, cmd->x0, cmd->y0, cmd->color);
+        break;
+    case DRAW_COMMAND_LINE:
+        rasterize_line(layer, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color);
+        break;
+    case DRAW_COMMAND_RECT_FILLED:
+        rasterize_rect_filled(layer, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color);
+        break;
+    case DRAW_COMMAND_RECT_OUTLINE:
+        rasterize_rect_outline(layer, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color);
+        break;
+    case DRAW_COMMAND_CIRCLE_FILLED:
+        rasterize_circle_filled(layer, cmd->x0, cmd->y0, cmd->x1, cmd->color);
+        break;
+    case DRAW_COMMAND_CIRCLE_OUTLINE:
+        rasterize_circle_outline(layer, cmd->x0, cmd->y0, cmd->x1, cmd->color);
+        break;
+    case DRAW_COMMAND_ELLIPSE_FILLED:
+        rasterize_ellipse_filled(layer, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color);
+        break;
+    case DRAW_COMMAND_ELLIPSE_OUTLINE:
+        rasterize_ellipse_outline(layer, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color);
+        break;
+    }
+}
+
+int prepare_draw_command(Layer *layer, DrawCommand *cmd)
+{
+    // blending a transparent color changes nothing, so the layer is not marked dirty
+    if (layer->paint_mode == PAINT_MODE_BLEND && GET_A(cmd->color) == 0)
+        return 1;
+
+    ImageRect bounds = draw_command_bounds(cmd);
+    if (begin_layer_write(layer, bounds.x, bounds.y, bounds.w, bounds.h) != 0)
+        return 1;
+    cmd->color = layer_pixel_color(layer, cmd->color);
+    return 0;
+}
+
+// Immediate mode: records the change and draws the shape right away
+static void draw_command(Layer *layer, DrawCommand cmd)
+{
+    if (prepare_draw_command(layer, &cmd) == 0)
+        rasterize_command(layer, &cmd);
+}
+
+/* =========================================================================
+ * PRIMITIVES
+ * ========================================================================= */
+
+void draw_pixel_safe(Layer *layer, int x, int y, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_PIXEL, x, y, 0, 0, color});
+}
+
+void fill_layer(Layer *layer, uint32_t color)
+{
+    int blend = layer->paint_mode == PAINT_MODE_BLEND && GET_A(color) != 255;
+    if (blend && GET_A(color) == 0)
+        return;
+    if (begin_layer_write(layer, 0, 0, layer->width, layer->height) != 0)
+        return;
+    color = layer_pixel_color(layer, color);
+
+    if (blend)
+    {
+        // blending over every pixel, unallocated tiles included; coverage is reclassified lazily
+        for (int y = 0; y < layer->height; y++)
         {
-            y--;
-            d = d + 4 * (x - y) + 10;
+            fill_layer_span(layer, y, 0, layer->width, color);
         }
-        else
+        return;
+    }
+
+    if (layer->data && layer->stride == (size_t)layer->width)
+    {
+        fill_pixels(layer->data, (size_t)layer->width * layer->height, color);
+    }
+    else if (layer->data)
+    {
+        for (int y = 0; y < layer->height; y++)
         {
-            d = d + 4 * x + 6;
+            fill_layer_span(layer, y, 0, layer->width, color);
         }
     }
+    else if (color == 0)
+    {
+        // transparent black is what unallocated tiles read as
+        free_layer_tiles(layer);
+    }
+    else
+    {
+        unsigned int alpha = GET_A(color);
+        TileCoverage coverage = alpha == 255 ? TILE_COVERAGE_OPAQUE : alpha == 0 ? TILE_COVERAGE_TRANSPARENT : TILE_COVERAGE_MIXED;
+        for (int ty = 0; ty < layer->tiles_y; ty++)
+        {
+            for (int tx = 0; tx < layer->tiles_x; tx++)
+            {
+                // a tile that cannot be allocated stays unallocated and reads as transparent
+                uint32_t *tile = allocate_layer_tile(layer, tx, ty);
+                if (tile)
+                    fill_pixels(tile, LAYER_TILE_SIZE * LAYER_TILE_SIZE, color);
+                layer->tile_coverage[(size_t)ty * layer->tiles_x + tx] = tile ? coverage : TILE_COVERAGE_TRANSPARENT;
+            }
+        }
+        return;
+    }
+
+    // every tile now has the alpha of the fill color
+    unsigned int alpha = GET_A(color);
+    set_layer_coverage(layer, alpha == 255 ? TILE_COVERAGE_OPAQUE : alpha == 0 ? TILE_COVERAGE_TRANSPARENT : TILE_COVERAGE_MIXED);
+}
+
+void draw_rect_filled(Layer *layer, int x, int y, int w, int h, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_RECT_FILLED, x, y, w, h, color});
+}
+
+void draw_rect_outline(Layer *layer, int x, int y, int w, int h, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_RECT_OUTLINE, x, y, w, h, color});
+}
+
+void draw_line(Layer *layer, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_LINE, x0, y0, x1, y1, color});
+}
+
+void draw_circle_outline(Layer *layer, int xc, int yc, int r, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_CIRCLE_OUTLINE, xc, yc, r, 0, color});
+}
+
+void draw_circle_filled(Layer *layer, int xc, int yc, int r, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_CIRCLE_FILLED, xc, yc, r, 0, color});
 }
 
 void draw_ellipse_outline(Layer *layer, int xc, int yc, int rx, int ry, uint32_t color)
 {
-    long long rx2 = (long long)rx * rx;
-    long long ry2 = (long long)ry * ry;
-    long long twoRx2 = 2 * rx2;
-    long long twoRy2 = 2 * ry2;
-    long long p;
-    long long x = 0;
-    long long y = ry;
-    long long px = 0;
-    long long py = twoRx2 * y;
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_ELLIPSE_OUTLINE, xc, yc, rx, ry, color});
+}
 
-    /* --- Region 1: Slope dx/dy < 1 (Top and Bottom flat parts) --- */
-    // Initial decision parameter for Region 1
-    p = (long long)(ry2 - (rx2 * ry) + (0.25 * rx2));
+void draw_ellipse_filled(Layer *layer, int xc, int yc, int rx, int ry, uint32_t color)
+{
+    draw_command(layer, (DrawCommand){DRAW_COMMAND_ELLIPSE_FILLED, xc, yc, rx, ry, color});
+}
+
+/* =========================================================================
+ * POLYGONS
+ *
+ * Scanline fill with a sorted edge table and an active edge list. Each row is
+ * sampled at pixel centers (y + 0.5), where every active edge crosses it at
+ * x = x0 + (y + 0.5 - y0) * dx / dy. The first pixel right of that crossing,
+ * ceil(x - 0.5), is tracked exactly in integers as a quotient and remainder
+ * that are stepped once per row, so long edges never drift.
+ * ========================================================================= */
 
-    while (px < py)
+typedef struct
+{
+    int y_top, y_end; // first row crossed and one past the last, clipped to the layer
+    int winding;      // +1 for edges going down, -1 for edges going up
+    long long q, r;   // the crossing minus one half is q + r / den: first pixel q + (r > 0)
+    long long step_q, step_r;
+    long long den;
+} PolygonEdge;
+
+static long long floor_div(long long n, long long d)
+{
+    long long q = n / d;
+    return (n % d != 0 && (n < 0) != (d < 0)) ? q - 1 : q;
+}
+
+static int compare_edge_tops(const void *a, const void *b)
+{
+    const PolygonEdge *ea = (const PolygonEdge *)a;
+    const PolygonEdge *eb = (const PolygonEdge *)b;
+    return (ea->y_top > eb->y_top) - (ea->y_top < eb->y_top);
+}
+
+static inline long long edge_column(const PolygonEdge *edge)
+{
+    return edge->q + (edge->r > 0);
+}
+
+// Builds the edge of (x0, y0) -> (x1, y1) positioned on its first visible row; returns 0 if it crosses none
+static int make_polygon_edge(ImagePoint a, ImagePoint b, int height, PolygonEdge *edge)
+{
+    if (a.y == b.y)
+        return 0; // horizontal edges cross no row center
+
+    edge->winding = a.y < b.y ? 1 : -1;
+    if (a.y > b.y)
     {
-        // Draw 4 quadrants
-        draw_pixel_safe(layer, xc + x, yc + y, color);
-        draw_pixel_safe(layer, xc - x, yc + y, color);
-        draw_pixel_safe(layer, xc + x, yc - y, color);
-        draw_pixel_safe(layer, xc - x, yc - y, color);
+        ImagePoint t = a;
+        a = b;
+        b = t;
+    }
 
-        x++;
-        px += twoRy2;
-        if (p < 0)
-        {
-            p += ry2 + px;
-        }
-        else
+    edge->y_top = a.y < 0 ? 0 : a.y;
+    edge->y_end = b.y > height ? height : b.y;
+    if (edge->y_top >= edge->y_end)
+        return 0;
+
+    // crossing of row y minus one half: x0 + ((2 * (y - y0) + 1) * dx - dy) / (2 * dy)
+    long long dx = (long long)b.x - a.x;
+    long long dy = (long long)b.y - a.y;
+    long long num = (2 * ((long long)edge->y_top - a.y) + 1) * dx - dy;
+    edge->den = 2 * dy;
+    edge->q = floor_div(num, edge->den);
+    edge->r = num - edge->q * edge->den;
+    edge->q += a.x;
+    edge->step_q = floor_div(2 * dx, edge->den);
+    edge->step_r = 2 * dx - edge->step_q * edge->den;
+    return 1;
+}
+
+static void fill_polygon_row(Layer *layer, int y, PolygonEdge **active, int num_active, FillRule rule, uint32_t color)
+{
+    // The edges only swap where they intersect, so insertion sort is nearly linear
+    for (int i = 1; i < num_active; i++)
+    {
+        PolygonEdge *edge = active[i];
+        long long x = edge_column(edge);
+        int j = i;
+        for (; j > 0 && edge_column(active[j - 1]) > x; j--)
         {
-            y--;
-            py -= twoRx2;
-            p += ry2 + px - py;
+            active[j] = active[j - 1];
         }
+        active[j] = edge;
     }
 
-    /* --- Region 2: Slope dx/dy >= 1 (Side steep parts) --- */
-    // Initial decision parameter for Region 2
-    p = (long long)(ry2 * (x + 0.5) * (x + 0.5) + rx2 * (y - 1) * (y - 1) - rx2 * ry2);
-
-    while (y >= 0)
+    int winding = 0;
+    long long span_start = 0;
+    for (int i = 0; i < num_active; i++)
     {
-        // Draw 4 quadrants
-        draw_pixel_safe(layer, xc + x, yc + y, color);
-        draw_pixel_safe(layer, xc - x, yc + y, color);
-        draw_pixel_safe(layer, xc + x, yc - y, color);
-        draw_pixel_safe(layer, xc - x, yc - y, color);
+        long long x = edge_column(active[i]);
+        int was_inside = rule == FILL_RULE_EVEN_ODD ? (i & 1) : winding != 0;
+        winding += active[i]->winding;
+        int inside = rule == FILL_RULE_EVEN_ODD ? !(i & 1) : winding != 0;
 
-        y--;
-        py -= twoRx2;
-        if (p > 0)
+        if (!was_inside && inside)
         {
-            p += rx2 - py;
+            span_start = x;
         }
-        else
+        else if (was_inside && !inside && x > span_start)
         {
-            x++;
-            px += twoRy2;
-            p += rx2 - py + px;
+            // clamp before narrowing; fill_layer_span clips the rest
+            int x0 = span_start < 0 ? 0 : span_start > layer->width ? layer->width : (int)span_start;
+            int x1 = x < 0 ? 0 : x > layer->width ? layer->width : (int)x;
+            fill_layer_span(layer, y, x0, x1, color);
         }
     }
 }
 
-void draw_ellipse_filled(Layer *layer, int xc, int yc, int rx, int ry, uint32_t color)
+void draw_path_filled(Layer *layer, const ImagePoint *points, const int *contour_sizes, int num_contours,
+                      FillRule rule, uint32_t color)
 {
-    long long rx2 = (long long)rx * rx;
-    long long ry2 = (long long)ry * ry;
-    long long twoRx2 = 2 * rx2;
-    long long twoRy2 = 2 * ry2;
-    long long p;
-    long long x = 0;
-    long long y = ry;
-    long long px = 0;
-    long long py = twoRx2 * y;
+    if (!layer || !points || !contour_sizes || num_contours <= 0)
+        return;
 
-    /* --- Region 1 --- */
-    p = (long long)(ry2 - (rx2 * ry) + (0.25 * rx2));
-
-    while (px < py)
+    int num_points = 0;
+    int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+    for (int c = 0; c < num_contours; c++)
     {
-        // Draw horizontal lines connecting the left and right sides
-        // We do this for both upper and lower halves
-        draw_line(layer, xc - x, yc + y, xc + x, yc + y, color);
-        draw_line(layer, xc - x, yc - y, xc + x, yc - y, color);
-
-        x++;
-        px += twoRy2;
-        if (p < 0)
+        if (contour_sizes[c] < 0)
+            return;
+        for (int i = num_points; i < num_points + contour_sizes[c]; i++)
         {
-            p += ry2 + px;
+            min_x = points[i].x < min_x ? points[i].x : min_x;
+            min_y = points[i].y < min_y ? points[i].y : min_y;
+            max_x = points[i].x > max_x ? points[i].x : max_x;
+            max_y = points[i].y > max_y ? points[i].y : max_y;
         }
-        else
+        num_points += contour_sizes[c];
+    }
+    if (num_points < 3)
+        return;
+
+    // Filled pixels lie in [min_x, max_x) x [min_y, max_y)
+    if (layer->paint_mode == PAINT_MODE_BLEND && GET_A(color) == 0)
+        return;
+    if (begin_layer_write(layer, min_x, min_y, (int)((long long)max_x - min_x), (int)((long long)max_y - min_y)) != 0)
+        return;
+    color = layer_pixel_color(layer, color);
+
+    // 1. Edge table, sorted by first row
+    PolygonEdge *edges = (PolygonEdge *)malloc((size_t)num_points * sizeof(PolygonEdge));
+    PolygonEdge **active = (PolygonEdge **)malloc((size_t)num_points * sizeof(PolygonEdge *));
+    if (!edges || !active)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for polygon edges.\n");
+        free(edges);
+        free(active);
+        return;
+    }
+
+    int num_edges = 0;
+    const ImagePoint *contour = points;
+    for (int c = 0; c < num_contours; c++)
+    {
+        for (int i = 0; i < contour_sizes[c]; i++)
         {
-            y--;
-            py -= twoRx2;
-            p += ry2 + px - py;
+            if (make_polygon_edge(contour[i], contour[(i + 1) % contour_sizes[c]], layer->height, &edges[num_edges]))
+                num_edges++;
         }
+        contour += contour_sizes[c];
     }
+    qsort(edges, (size_t)num_edges, sizeof(PolygonEdge), compare_edge_tops);
 
-    /* --- Region 2 --- */
-    p = (long long)(ry2 * (x + 0.5) * (x + 0.5) + rx2 * (y - 1) * (y - 1) - rx2 * ry2);
-
-    while (y >= 0)
+    // 2. Walk the rows with the active edge list
+    int next_edge = 0;
+    int num_active = 0;
+    int y = num_edges > 0 ? edges[0].y_top : 0;
+    while (next_edge < num_edges || num_active > 0)
     {
-        draw_line(layer, xc - x, yc + y, xc + x, yc + y, color);
-        draw_line(layer, xc - x, yc - y, xc + x, yc - y, color);
+        // rows no edge crosses are skipped at once
+        if (num_active == 0 && edges[next_edge].y_top > y)
+            y = edges[next_edge].y_top;
 
-        y--;
-        py -= twoRx2;
-        if (p > 0)
+        while (next_edge < num_edges && edges[next_edge].y_top == y)
         {
-            p += rx2 - py;
+            active[num_active++] = &edges[next_edge++];
         }
-        else
+
+        fill_polygon_row(layer, y, active, num_active, rule, color);
+
+        // step to the next row, dropping the edges that end here
+        y++;
+        int kept = 0;
+        for (int i = 0; i < num_active; i++)
         {
-            x++;
-            px += twoRy2;
-            p += rx2 - py + px;
+            PolygonEdge *edge = active[i];
+            if (edge->y_end <= y)
+                continue;
+            edge->q += edge->step_q;
+            edge->r += edge->step_r;
+            if (edge->r >= edge->den)
+            {
+                edge->r -= edge->den;
+                edge->q++;
+            }
+            active[kept++] = edge;
         }
+        num_active = kept;
     }
+
+    free(edges);
+    free(active);
+}
+
+void draw_polygon_filled(Layer *layer, const ImagePoint *points, int count, FillRule rule, uint32_t color)
+{
+    draw_path_filled(layer, points, &count, 1, rule, color);
 }
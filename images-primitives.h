@@ -3,6 +3,16 @@
 
 // --- Drawing Primitives ---
 
+/*
+ * Sets how the drawing primitives below write to the layer.
+ * PAINT_MODE_REPLACE (the default) overwrites pixels with the color.
+ * PAINT_MODE_BLEND composites the color over the existing pixels (source-over,
+ * so translucent layer pixels stay correct), which lets translucent shapes be
+ * drawn on one layer instead of one layer each. Every pixel of a shape is
+ * blended once, even where the outline of a shape meets itself.
+ */
+void set_layer_paint_mode(Layer *layer, PaintMode mode);
+
 /*
  * Sets a single pixel at (x, y).
  * Safely ignores coordinates outside layer bounds.
@@ -17,6 +27,43 @@ void fill_layer(Layer *layer, uint32_t color);
  */
 void draw_rect_filled(Layer *layer, int x, int y, int w, int h, uint32_t color);
 
+/*
+ * A vertex of a polygon, in pixel coordinates.
+ */
+typedef struct
+{
+    int x, y;
+} ImagePoint;
+
+/*
+ * Decides which parts of a self-intersecting polygon (or of overlapping
+ * contours) are inside.
+ */
+typedef enum
+{
+    FILL_RULE_EVEN_ODD = 0, // inside where a ray crosses the outline an odd number of times
+    FILL_RULE_NON_ZERO,     // inside where the outline winds around the point at least once
+} FillRule;
+
+/*
+ * Draws a filled polygon; the last point connects back to the first.
+ * Any number of vertices and self-intersecting outlines are supported.
+ * A pixel is filled when its center is inside the outline; centers exactly on a
+ * left or top edge are inside and those on a right or bottom edge are not, so
+ * polygons sharing an edge never overlap and a rectangle fills the same pixels
+ * as draw_rect_filled. Cost grows with the number of edges and spans, not pixels.
+ */
+void draw_polygon_filled(Layer *layer, const ImagePoint *points, int count, FillRule rule, uint32_t color);
+
+/*
+ * Draws a filled path made of several closed contours, like draw_polygon_filled.
+ * Contour i uses the next contour_sizes[i] points. With FILL_RULE_NON_ZERO,
+ * a contour wound against the outer one cuts a hole; with FILL_RULE_EVEN_ODD
+ * any nested contour does.
+ */
+void draw_path_filled(Layer *layer, const ImagePoint *points, const int *contour_sizes, int num_contours,
+                      FillRule rule, uint32_t color);
+
 /*
  * Draws a 1px outline of a rectangle.
  */
@@ -0,0 +1,446 @@
+#include "images-resample.h"
+#include "images-flatten.h"
+#include "images-internal.h"
+#include "images-threads.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGES_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Fixed-point precision of the filter taps: 1.0 is 1 << RESAMPLE_PRECISION
+#define RESAMPLE_PRECISION 14
+// Rows per parallel task in both passes
+#define RESAMPLE_BAND_ROWS 16
+
+/* =========================================================================
+ * FILTER WEIGHTS
+ * ========================================================================= */
+
+static double filter_bilinear(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double filter_bicubic(double x)
+{
+    const double a = -0.5;
+    x = fabs(x);
+    if (x < 1.0)
+        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+    if (x < 2.0)
+        return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+    return 0.0;
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_lanczos3(double x)
+{
+    return x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+/**
+ * Taps of one pass: output i reads taps[i] source samples starting at first[i],
+ * weighted by coeffs[i * max_taps ...]. Every row of weights sums to exactly
+ * 1 << RESAMPLE_PRECISION, so flat areas stay flat.
+ */
+typedef struct
+{
+    int *first;
+    int *taps;
+    int16_t *coeffs;
+    int max_taps;
+} ResampleWeights;
+
+static void free_weights(ResampleWeights *weights)
+{
+    free(weights->first);
+    free(weights->taps);
+    free(weights->coeffs);
+}
+
+static int compute_weights(ResampleWeights *weights, int in_size, int out_size, ResampleFilter filter)
+{
+    double (*kernel)(double) = filter_bilinear;
+    double support = 1.0;
+    if (filter == RESAMPLE_FILTER_BICUBIC)
+    {
+        kernel = filter_bicubic;
+        support = 2.0;
+    }
+    else if (filter == RESAMPLE_FILTER_LANCZOS3)
+    {
+        kernel = filter_lanczos3;
+        support = 3.0;
+    }
+
+    // Downscaling stretches the filter over the source pixels of one output pixel
+    double scale = (double)in_size / out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    support *= filter_scale;
+
+    weights->max_taps = (int)ceil(support) * 2 + 1;
+    weights->first = (int *)malloc((size_t)out_size * sizeof(int));
+    weights->taps = (int *)malloc((size_t)out_size * sizeof(int));
+    weights->coeffs = (int16_t *)calloc((size_t)out_size * weights->max_taps, sizeof(int16_t));
+    double *w = (double *)malloc((size_t)weights->max_taps * sizeof(double));
+    if (!weights->first || !weights->taps || !weights->coeffs || !w)
+    {
+        free(w);
+        free_weights(weights);
+        return 1;
+    }
+
+    for (int i = 0; i < out_size; i++)
+    {
+        double center = (i + 0.5) * scale;
+        int first = (int)(center - support + 0.5);
+        int last = (int)(center + support + 0.5);
+        if (first < 0)
+            first = 0;
+        if (last > in_size)
+            last = in_size;
+        int taps = last - first;
+        if (taps > weights->max_taps)
+            taps = weights->max_taps;
+
+        double total = 0.0;
+        for (int k = 0; k < taps; k++)
+        {
+            w[k] = kernel((first + k - center + 0.5) / filter_scale);
+            total += w[k];
+        }
+
+        // Round to fixed point and put the rounding error on the largest tap
+        int16_t *coeffs = weights->coeffs + (size_t)i * weights->max_taps;
+        int sum = 0, largest = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            coeffs[k] = (int16_t)lround(total != 0.0 ? w[k] / total * (1 << RESAMPLE_PRECISION) : 0.0);
+            sum += coeffs[k];
+            if (coeffs[k] > coeffs[largest])
+                largest = k;
+        }
+        if (taps > 0)
+            coeffs[largest] = (int16_t)(coeffs[largest] + (1 << RESAMPLE_PRECISION) - sum);
+
+        weights->first[i] = first;
+        weights->taps[i] = taps;
+    }
+
+    free(w);
+    return 0;
+}
+
+/* =========================================================================
+ * SCALAR KERNELS
+ * ========================================================================= */
+
+static inline uint32_t clamp_channel(int sum)
+{
+    sum >>= RESAMPLE_PRECISION;
+    return sum < 0 ? 0 : sum > 255 ? 255 : (uint32_t)sum;
+}
+
+#define RESAMPLE_ROUND (1 << (RESAMPLE_PRECISION - 1))
+
+static void resample_row_scalar(const uint32_t *src, uint32_t *dst, int out_width, const ResampleWeights *weights)
+{
+    for (int x = 0; x < out_width; x++)
+    {
+        const uint32_t *pixels = src + weights->first[x];
+        const int16_t *coeffs = weights->coeffs + (size_t)x * weights->max_taps;
+        int a = RESAMPLE_ROUND, r = RESAMPLE_ROUND, g = RESAMPLE_ROUND, b = RESAMPLE_ROUND;
+        for (int k = 0; k < weights->taps[x]; k++)
+        {
+            a += (int)GET_A(pixels[k]) * coeffs[k];
+            r += (int)GET_R(pixels[k]) * coeffs[k];
+            g += (int)GET_G(pixels[k]) * coeffs[k];
+            b += (int)GET_B(pixels[k]) * coeffs[k];
+        }
+        dst[x] = COLOR(clamp_channel(a), clamp_channel(r), clamp_channel(g), clamp_channel(b));
+    }
+}
+
+// Output pixels x0 to width - 1 of a vertical pass over rows[0 .. taps - 1]
+static void resample_column_scalar(const uint32_t *const *rows, const int16_t *coeffs, int taps,
+                                   uint32_t *dst, int x0, int width)
+{
+    for (int x = x0; x < width; x++)
+    {
+        int a = RESAMPLE_ROUND, r = RESAMPLE_ROUND, g = RESAMPLE_ROUND, b = RESAMPLE_ROUND;
+        for (int k = 0; k < taps; k++)
+        {
+            uint32_t pixel = rows[k][x];
+            a += (int)GET_A(pixel) * coeffs[k];
+            r += (int)GET_R(pixel) * coeffs[k];
+            g += (int)GET_G(pixel) * coeffs[k];
+            b += (int)GET_B(pixel) * coeffs[k];
+        }
+        dst[x] = COLOR(clamp_channel(a), clamp_channel(r), clamp_channel(g), clamp_channel(b));
+    }
+}
+
+/* =========================================================================
+ * SSE2 KERNELS
+ *
+ * _mm_madd_epi16 multiplies two samples by two taps and adds the products in
+ * one 32-bit lane, so the samples of two neighboring taps are interleaved per
+ * channel first. The sums are the same integers as in the scalar kernels, and
+ * the saturating packs clamp them to 0..255 like clamp_channel.
+ * ========================================================================= */
+
+#ifdef IMAGES_X86_SIMD
+
+__attribute__((target("sse2"))) static inline __m128i tap_pair_sse2(int16_t c0, int16_t c1)
+{
+    return _mm_set1_epi32((int)((uint32_t)(uint16_t)c0 | (uint32_t)(uint16_t)c1 << 16));
+}
+
+__attribute__((target("sse2"))) static void resample_row_sse2(const uint32_t *src, uint32_t *dst, int out_width, const ResampleWeights *weights)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int x = 0; x < out_width; x++)
+    {
+        const uint32_t *pixels = src + weights->first[x];
+        const int16_t *coeffs = weights->coeffs + (size_t)x * weights->max_taps;
+        int taps = weights->taps[x];
+        __m128i sum = _mm_set1_epi32(RESAMPLE_ROUND);
+        int k = 0;
+
+        for (; k + 2 <= taps; k += 2)
+        {
+            // b0 g0 r0 a0 b1 g1 r1 a1 -> b0 b1 g0 g1 r0 r1 a0 a1
+            __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pixels + k)), zero);
+            p = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(p, tap_pair_sse2(coeffs[k], coeffs[k + 1])));
+        }
+        if (k < taps)
+        {
+            __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)pixels[k]), zero);
+            p = _mm_unpacklo_epi16(p, zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(p, tap_pair_sse2(coeffs[k], 0)));
+        }
+
+        sum = _mm_srai_epi32(sum, RESAMPLE_PRECISION);
+        sum = _mm_packs_epi32(sum, sum);
+        dst[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    }
+}
+
+// Four output pixels per iteration; the remainder goes through the scalar kernel
+__attribute__((target("sse2"))) static void resample_column_sse2(const uint32_t *const *rows, const int16_t *coeffs, int taps,
+                                                                 uint32_t *dst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i s0 = _mm_set1_epi32(RESAMPLE_ROUND), s1 = s0, s2 = s0, s3 = s0;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            __m128i r1 = k + 1 < taps ? _mm_loadu_si128((const __m128i *)(rows[k + 1] + x)) : zero;
+            __m128i c = tap_pair_sse2(coeffs[k], k + 1 < taps ? coeffs[k + 1] : 0);
+
+            // the same channel of both rows side by side
+            __m128i lo = _mm_unpacklo_epi8(r0, r1);
+            __m128i hi = _mm_unpackhi_epi8(r0, r1);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), c));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), c));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), c));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), c));
+        }
+
+        __m128i p01 = _mm_packs_epi32(_mm_srai_epi32(s0, RESAMPLE_PRECISION), _mm_srai_epi32(s1, RESAMPLE_PRECISION));
+        __m128i p23 = _mm_packs_epi32(_mm_srai_epi32(s2, RESAMPLE_PRECISION), _mm_srai_epi32(s3, RESAMPLE_PRECISION));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(p01, p23));
+    }
+
+    resample_column_scalar(rows, coeffs, taps, dst, x, width);
+}
+
+#endif // IMAGES_X86_SIMD
+
+/* =========================================================================
+ * PASSES
+ * ========================================================================= */
+
+typedef struct
+{
+    Layer *src;
+    Layer *dst;
+    ResampleWeights horizontal, vertical;
+    uint32_t *rows; // horizontally filtered source rows, dst->width pixels each, premultiplied
+    int simd;
+    int failed;
+} ResampleJob;
+
+// Copies source row y into buffer, premultiplied; unallocated tiles read as transparent
+static void load_source_row(const Layer *layer, int y, uint32_t *buffer)
+{
+    for (int x = 0; x < layer->width; x += LAYER_TILE_SIZE)
+    {
+        int n = layer->width - x < LAYER_TILE_SIZE ? layer->width - x : LAYER_TILE_SIZE;
+        const uint32_t *src = layer_read_ptr(layer, x, y);
+        if (!src)
+            memset(buffer + x, 0, (size_t)n * sizeof(uint32_t));
+        else if (layer->premultiplied)
+            memcpy(buffer + x, src, (size_t)n * sizeof(uint32_t));
+        else
+        {
+            for (int i = 0; i < n; i++)
+            {
+                buffer[x + i] = GET_A(src[i]) == 255 ? src[i] : premultiply_color(src[i]);
+            }
+        }
+    }
+}
+
+static void resample_horizontal_band(void *ctx, int band)
+{
+    ResampleJob *job = (ResampleJob *)ctx;
+    const Layer *src = job->src;
+    int y0 = band * RESAMPLE_BAND_ROWS;
+    int y1 = y0 + RESAMPLE_BAND_ROWS < src->height ? y0 + RESAMPLE_BAND_ROWS : src->height;
+
+    // Dense premultiplied layers are read in place
+    int direct = src->data && src->premultiplied;
+    uint32_t *buffer = NULL;
+    if (!direct && !(buffer = (uint32_t *)malloc((size_t)src->width * sizeof(uint32_t))))
+    {
+        job->failed = 1;
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        const uint32_t *row = buffer;
+        if (direct)
+            row = src->data + (size_t)y * src->stride;
+        else
+            load_source_row(src, y, buffer);
+
+        uint32_t *out = job->rows + (size_t)y * job->dst->width;
+#ifdef IMAGES_X86_SIMD
+        if (job->simd)
+        {
+            resample_row_sse2(row, out, job->dst->width, &job->horizontal);
+            continue;
+        }
+#endif
+        resample_row_scalar(row, out, job->dst->width, &job->horizontal);
+    }
+
+    free(buffer);
+}
+
+static void resample_vertical_band(void *ctx, int band)
+{
+    ResampleJob *job = (ResampleJob *)ctx;
+    Layer *dst = job->dst;
+    int y0 = band * RESAMPLE_BAND_ROWS;
+    int y1 = y0 + RESAMPLE_BAND_ROWS < dst->height ? y0 + RESAMPLE_BAND_ROWS : dst->height;
+
+    const uint32_t **rows = (const uint32_t **)malloc((size_t)job->vertical.max_taps * sizeof(uint32_t *));
+    if (!rows)
+    {
+        job->failed = 1;
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        int first = job->vertical.first[y], taps = job->vertical.taps[y];
+        const int16_t *coeffs = job->vertical.coeffs + (size_t)y * job->vertical.max_taps;
+        for (int k = 0; k < taps; k++)
+        {
+            rows[k] = job->rows + (size_t)(first + k) * dst->width;
+        }
+
+        uint32_t *out = dst->data + (size_t)y * dst->stride;
+#ifdef IMAGES_X86_SIMD
+        if (job->simd)
+            resample_column_sse2(rows, coeffs, taps, out, dst->width);
+        else
+#endif
+            resample_column_scalar(rows, coeffs, taps, out, 0, dst->width);
+
+        // Ringing filters can leave a channel above alpha; keep the pixels valid premultiplied colors
+        for (int x = 0; x < dst->width; x++)
+        {
+            uint32_t pixel = out[x];
+            unsigned int a = GET_A(pixel);
+            if (a != 255 && (GET_R(pixel) > a || GET_G(pixel) > a || GET_B(pixel) > a))
+            {
+                pixel = COLOR(a, GET_R(pixel) < a ? GET_R(pixel) : a, GET_G(pixel) < a ? GET_G(pixel) : a,
+                              GET_B(pixel) < a ? GET_B(pixel) : a);
+            }
+            out[x] = dst->premultiplied ? pixel : unpremultiply_color(pixel);
+        }
+    }
+
+    free(rows);
+}
+
+Layer *resample_layer(Layer *layer, int width, int height, ResampleFilter filter)
+{
+    if (!layer || width <= 0 || height <= 0 || layer->width <= 0 || layer->height <= 0)
+    {
+        fprintf(stderr, "Error: Invalid arguments to resample_layer\n");
+        return NULL;
+    }
+
+    ResampleJob job = {layer, NULL, {0}, {0}, NULL, get_simd_level() != SIMD_LEVEL_SCALAR, 0};
+    if (compute_weights(&job.horizontal, layer->width, width, filter) != 0)
+        goto resample_err_alloc;
+    if (compute_weights(&job.vertical, layer->height, height, filter) != 0)
+    {
+        free_weights(&job.horizontal);
+        goto resample_err_alloc;
+    }
+
+    job.rows = (uint32_t *)malloc((size_t)width * layer->height * sizeof(uint32_t));
+    job.dst = alloc_layer(width, height, LAYER_ALLOC_UNINITIALIZED);
+    if (!job.rows || !job.dst)
+        goto resample_err_passes;
+
+    job.dst->premultiplied = layer->premultiplied;
+    job.dst->paint_mode = layer->paint_mode;
+
+    parallel_for((layer->height + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS, resample_horizontal_band, &job);
+    if (!job.failed)
+        parallel_for((height + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS, resample_vertical_band, &job);
+    if (job.failed)
+        goto resample_err_passes;
+
+    mark_layer_dirty(job.dst, 0, 0, width, height);
+    free(job.rows);
+    free_weights(&job.horizontal);
+    free_weights(&job.vertical);
+    return job.dst;
+
+resample_err_passes:
+    release_layer(job.dst);
+    free(job.rows);
+    free_weights(&job.horizontal);
+    free_weights(&job.vertical);
+resample_err_alloc:
+    fprintf(stderr, "Error: Unable to allocate memory for resampling\n");
+    return NULL;
+}
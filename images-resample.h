@@ -0,0 +1,40 @@
+#pragma once
+#include "images.h"
+
+/* =========================================================================
+ * RESAMPLING
+ *
+ * Separable resizing of layers: every output row is first filtered
+ * horizontally, then the rows are filtered vertically. Filter weights are
+ * computed once per resize as 14-bit fixed-point taps, and the inner loops
+ * run on SSE2 when the flatten engine uses SIMD (see set_simd_level); every
+ * level gives identical output. Both passes run in bands on the thread pool
+ * (see set_thread_count). When downscaling, filters are widened by the scale
+ * factor, so every source pixel contributes and large-to-small resizes do not
+ * alias. Pixels are filtered premultiplied by alpha, so transparent areas do
+ * not bleed their color into the edges of opaque ones.
+ * ========================================================================= */
+
+/**
+ * Interpolation filters, from fastest to sharpest.
+ */
+typedef enum
+{
+    RESAMPLE_FILTER_BILINEAR, // triangle filter, support 1
+    RESAMPLE_FILTER_BICUBIC,  // Catmull-Rom cubic (a = -0.5), support 2
+    RESAMPLE_FILTER_LANCZOS3, // windowed sinc, support 3
+} ResampleFilter;
+
+/**
+ * @brief Creates a new layer holding a resized copy of a layer.
+ * * The new layer is dense, has refcount 1 and the same pixel representation
+ * (straight or premultiplied) and paint mode as the source. Dense, tiled and
+ * view layers can be resampled. To resize a whole Image, flatten it first
+ * (for example with export_to_buffer into a wrap_layer_pixels layer).
+ * * @param layer The source layer (not modified).
+ * @param width Width of the new layer, greater than 0.
+ * @param height Height of the new layer, greater than 0.
+ * @param filter The interpolation filter.
+ * @return The new layer, or NULL on invalid arguments or allocation failure.
+ */
+Layer *resample_layer(Layer *layer, int width, int height, ResampleFilter filter);
@@ -0,0 +1,169 @@
+#include "images-stats.h"
+#include "images-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int image_stats_enabled;
+ImageStats image_stats;
+
+typedef struct
+{
+    const char *name; // a string literal
+    uint64_t start, end;
+    int thread;
+} TraceEvent;
+
+static int stats_flags;
+static TraceEvent *trace_events;
+static uint64_t trace_origin; // clock at enable_image_stats; trace timestamps are relative to it
+static int next_trace_thread;
+static __thread int trace_thread; // 1-based id of the calling thread in the trace, 0 until its first event
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int enable_image_stats(int flags)
+{
+    if ((flags & IMAGE_STATS_TRACE) && !trace_events)
+    {
+        trace_events = (TraceEvent *)malloc(IMAGE_STATS_MAX_TRACE_EVENTS * sizeof(TraceEvent));
+        if (!trace_events)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for trace events\n");
+            return 1;
+        }
+    }
+
+    if (flags & IMAGE_STATS_TRACE)
+    {
+        trace_origin = stats_now();
+        __atomic_store_n(&image_stats.trace_events, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&image_stats.trace_events_dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&stats_flags, flags, __ATOMIC_RELEASE);
+    __atomic_store_n(&image_stats_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void disable_image_stats(void)
+{
+    __atomic_store_n(&image_stats_enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stats_flags, 0, __ATOMIC_RELEASE);
+    free(trace_events);
+    trace_events = NULL;
+}
+
+// ImageStats is made of uint64_t counters only, so it can be walked as an array
+#define STATS_WORDS (sizeof(ImageStats) / sizeof(uint64_t))
+
+void reset_image_stats(void)
+{
+    uint64_t *words = (uint64_t *)&image_stats;
+    for (size_t i = 0; i < STATS_WORDS; i++)
+    {
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+    }
+    trace_origin = stats_now();
+}
+
+void get_image_stats(ImageStats *stats)
+{
+    if (!stats)
+        return;
+
+    uint64_t *dst = (uint64_t *)stats;
+    uint64_t *words = (uint64_t *)&image_stats;
+    for (size_t i = 0; i < STATS_WORDS; i++)
+    {
+        dst[i] = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+    }
+
+    // events past the buffer were counted but not kept
+    if (stats->trace_events > IMAGE_STATS_MAX_TRACE_EVENTS)
+        stats->trace_events = IMAGE_STATS_MAX_TRACE_EVENTS;
+}
+
+uint64_t stats_clock(void)
+{
+    if (!__atomic_load_n(&image_stats_enabled, __ATOMIC_RELAXED))
+        return 0;
+
+    uint64_t now = stats_now();
+    return now ? now : 1;
+}
+
+void stats_add_time(ImageStage stage, uint64_t nanoseconds)
+{
+    __atomic_add_fetch(&image_stats.stages[stage].calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&image_stats.stages[stage].nanoseconds, nanoseconds, __ATOMIC_RELAXED);
+}
+
+void stats_trace(const char *name, uint64_t start, uint64_t end)
+{
+    if (!start || !(__atomic_load_n(&stats_flags, __ATOMIC_ACQUIRE) & IMAGE_STATS_TRACE))
+        return;
+
+    uint64_t index = __atomic_fetch_add(&image_stats.trace_events, 1, __ATOMIC_RELAXED);
+    if (index >= IMAGE_STATS_MAX_TRACE_EVENTS)
+    {
+        __atomic_add_fetch(&image_stats.trace_events_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (!trace_thread)
+        trace_thread = __atomic_add_fetch(&next_trace_thread, 1, __ATOMIC_RELAXED);
+
+    TraceEvent *event = &trace_events[index];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->thread = trace_thread;
+}
+
+void stats_end_stage(ImageStage stage, const char *name, uint64_t start)
+{
+    if (!start)
+        return;
+
+    uint64_t end = stats_now();
+    stats_add_time(stage, end - start);
+    stats_trace(name, start, end);
+}
+
+int write_image_trace(const char *filename)
+{
+    if (!filename || !trace_events)
+        return 1;
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Could not open file %s for writing\n", filename);
+        return 1;
+    }
+
+    uint64_t count = __atomic_load_n(&image_stats.trace_events, __ATOMIC_ACQUIRE);
+    if (count > IMAGE_STATS_MAX_TRACE_EVENTS)
+        count = IMAGE_STATS_MAX_TRACE_EVENTS;
+
+    // Complete ("X") events, timestamps and durations in microseconds
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const TraceEvent *event = &trace_events[i];
+        uint64_t start = event->start > trace_origin ? event->start - trace_origin : 0;
+        fprintf(fp, "%s{\"name\": \"%s\", \"cat\": \"images\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                i ? ",\n" : "", event->name, event->thread, start / 1000.0, (event->end - event->start) / 1000.0);
+    }
+    fprintf(fp, "\n]}\n");
+
+    return fclose(fp) != 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+
+/* =========================================================================
+ * INSTRUMENTATION
+ *
+ * Opt-in counters and stage timers for the library's hot paths. While
+ * disabled (the default) every instrumented path costs one predictable
+ * branch. While enabled, counters are updated with relaxed atomics once per
+ * row or per call, never per pixel, and the clock is read a few times per
+ * row, so the numbers can be collected in live traffic.
+ * ========================================================================= */
+
+// enable_image_stats flags
+#define IMAGE_STATS_TRACE 1 // also record trace events for write_image_trace
+
+// Trace events kept after enable_image_stats; later events are counted in trace_events_dropped
+#define IMAGE_STATS_MAX_TRACE_EVENTS 65536
+
+/**
+ * Timed stages of the library.
+ */
+typedef enum
+{
+    IMAGE_STAGE_PARSE,   // decoding files (parse_image_file, parse_bitmap_file, read_image_rows)
+    IMAGE_STAGE_FLATTEN, // compositing the layer stack into rows
+    IMAGE_STAGE_CONVERT, // converting flattened rows into an output format
+    IMAGE_STAGE_WRITE,   // fwrite of encoded rows (save_image, the streaming writer)
+    IMAGE_STAGE_COUNT,
+} ImageStage;
+
+typedef struct
+{
+    uint64_t calls;       // timed sections (files, bands, write calls)
+    uint64_t nanoseconds; // time summed over every thread, so it can exceed the wall time
+} ImageStageStats;
+
+/**
+ * Counters since enable_image_stats (or the last reset_image_stats).
+ */
+typedef struct
+{
+    ImageStageStats stages[IMAGE_STAGE_COUNT]; // indexed by ImageStage
+
+    uint64_t pixels_decoded;   // pixels produced by the parsers
+    uint64_t pixels_blended;   // layer pixels run through a blend kernel while flattening
+    uint64_t pixels_copied;    // layer pixels copied as-is because their tile is opaque (enable_tile_culling)
+    uint64_t pixels_skipped;   // layer pixels never read: transparent tiles, or hidden under an opaque tile
+    uint64_t pixels_converted; // flattened pixels converted to an output format
+
+    uint64_t bytes_read;        // size of the files parsed
+    uint64_t bytes_written;     // encoded bytes written to files
+    uint64_t bytes_allocated;   // pixel buffer bytes taken from the allocator (pool hits excluded)
+    uint64_t buffers_allocated; // pixel buffers taken from the allocator
+
+    uint64_t layers_created;
+    uint64_t layers_freed;
+
+    uint64_t trace_events;         // trace events recorded
+    uint64_t trace_events_dropped; // trace events lost because the buffer was full
+} ImageStats;
+
+/**
+ * @brief Starts collecting statistics.
+ * * Calling it again while enabled keeps the counters and changes the flags.
+ * Enabling IMAGE_STATS_TRACE clears the trace events recorded so far.
+ * * @param flags A combination of the IMAGE_STATS_* flags.
+ * @return 0 on success, 1 if the trace buffer could not be allocated.
+ */
+int enable_image_stats(int flags);
+
+/**
+ * @brief Stops collecting statistics and frees the trace buffer.
+ * * The counters keep their values. Call it while no other thread uses the library.
+ */
+void disable_image_stats(void);
+
+/**
+ * @brief Clears every counter and the recorded trace events.
+ */
+void reset_image_stats(void);
+
+/**
+ * @brief Copies the current counters.
+ * * @param[out] stats Filled in with the counters.
+ */
+void get_image_stats(ImageStats *stats);
+
+/**
+ * @brief Writes the recorded trace events as Chrome trace-event JSON.
+ * * The file loads in chrome://tracing or Perfetto: every parse, save,
+ * export, flattened band and file write is a slice on the thread that ran it.
+ * Call it while no other thread uses the library.
+ * * @param filename The output path.
+ * @return 0 on success, 1 if tracing is off or the file cannot be written.
+ */
+int write_image_trace(const char *filename);
@@ -0,0 +1,141 @@
+#include "images-threads.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREAD_POOL_MAX_THREADS 256
+
+typedef struct
+{
+    ParallelTask task;
+    void *ctx;
+    int count;
+    int next;   // next index to hand out (atomic)
+    int active; // threads currently running this job (guarded by pool_lock)
+} ParallelJob;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+
+// Only one job runs on the pool at a time; other callers run inline
+static pthread_mutex_t pool_submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ParallelJob *pool_job = NULL;
+static unsigned int pool_generation = 0;
+static int pool_workers = 0;      // worker threads started so far
+static int pool_thread_count = 1; // requested threads, including the caller
+
+static void run_job(ParallelJob *job)
+{
+    int index;
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        job->task(job->ctx, index);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    int worker_index = (int)(size_t)arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;)
+    {
+        while (pool_generation == seen)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        seen = pool_generation;
+
+        // Workers beyond the current thread count stay parked
+        ParallelJob *job = pool_job;
+        if (!job || worker_index + 1 >= pool_thread_count)
+            continue;
+
+        job->active++;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--job->active == 0)
+            pthread_cond_broadcast(&pool_idle);
+    }
+    return NULL;
+}
+
+// Starts workers until count - 1 are available. Must hold pool_lock.
+static void start_workers(int count)
+{
+    while (pool_workers < count - 1)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void *)(size_t)pool_workers) != 0)
+        {
+            fprintf(stderr, "Error: Unable to start worker thread\n");
+            return;
+        }
+        pthread_detach(thread);
+        pool_workers++;
+    }
+}
+
+void set_thread_count(int count)
+{
+    if (count <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+    if (count > THREAD_POOL_MAX_THREADS)
+        count = THREAD_POOL_MAX_THREADS;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_thread_count = count;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int get_thread_count(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    int count = pool_thread_count;
+    pthread_mutex_unlock(&pool_lock);
+    return count;
+}
+
+void parallel_for(int count, ParallelTask task, void *ctx)
+{
+    ParallelJob job = {task, ctx, count, 0, 1};
+
+    if (count <= 0)
+        return;
+
+    // Sequential path: threading disabled, trivial job, or the pool is busy
+    if (count == 1 || get_thread_count() <= 1 || pthread_mutex_trylock(&pool_submit_lock) != 0)
+    {
+        for (int i = 0; i < count; i++)
+            task(ctx, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    start_workers(pool_thread_count);
+    pool_job = &job;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    // The calling thread works too
+    run_job(&job);
+
+    pthread_mutex_lock(&pool_lock);
+    job.active--;
+    while (job.active > 0)
+        pthread_cond_wait(&pool_idle, &pool_lock);
+    pool_job = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_mutex_unlock(&pool_submit_lock);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+/* =========================================================================
+ * THREAD POOL
+ *
+ * A small persistent worker pool shared by the library. It is disabled by
+ * default (one thread): every call then runs on the calling thread.
+ * ========================================================================= */
+
+/**
+ * A unit of parallel work. Called once for every index in [0, count).
+ */
+typedef void (*ParallelTask)(void *ctx, int index);
+
+/**
+ * @brief Sets how many threads the library may use for parallel work.
+ * * The calling thread counts as one of them, so 1 disables threading (default).
+ * Passing 0 or a negative value uses the number of online CPUs.
+ * Workers are started lazily the first time they are needed.
+ * * @param count The number of threads to use.
+ */
+void set_thread_count(int count);
+
+/**
+ * @brief Returns the number of threads the library may use for parallel work.
+ */
+int get_thread_count(void);
+
+/**
+ * @brief Runs task(ctx, i) for every i in [0, count) on the thread pool and waits for completion.
+ * * Indices are handed out dynamically, so tasks may take uneven time.
+ * If the pool is already busy (another thread or a nested call is using it),
+ * the tasks run sequentially on the calling thread instead.
+ * * @param count Number of task indices.
+ * @param task The function to run for each index.
+ * @param ctx Opaque pointer passed to every call.
+ */
+void parallel_for(int count, ParallelTask task, void *ctx);
@@ -1,16 +1,19 @@
 #include "images.h"
+#include "images-internal.h"
+#include "images-flatten.h"
+#include "images-threads.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
 
-// Refcounting functions for Layer
+// Refcounting functions for Layer (atomic, so layers can be shared between threads)
 void retain_layer(Layer *layer)
 {
     if (layer)
     {
-        layer->refcount++;
+        __atomic_add_fetch(&layer->refcount, 1, __ATOMIC_RELAXED);
     }
 }
 
@@ -18,13 +21,20 @@ void release_layer(Layer *layer)
 {
     if (layer)
     {
-        layer->refcount--;
-
-        if (layer->refcount <= 0)
+        if (__atomic_sub_fetch(&layer->refcount, 1, __ATOMIC_ACQ_REL) == 0)
         {
-            printf("Freeing layer memory\n");
-            free(layer->data);
+            STATS_ADD(layers_freed, 1);
+            Layer *parent = layer->parent;
+            release_layer_storage(layer->storage);
+            free(layer->tile_coverage);
             free(layer);
+
+            // a view keeps its parent (and the pixels it points into) alive
+            if (parent)
+            {
+                __atomic_sub_fetch(&parent->num_views, 1, __ATOMIC_RELEASE);
+                release_layer(parent);
+            }
         }
     }
 }
@@ -42,6 +52,8 @@ Image *create_image(int width, int height)
     img->height = height;
     img->num_layers = 0;
     img->layer_capacity = IMAGE_INITIAL_LAYER_CAPACITY;
+    img->cache = NULL;
+    img->tile_culling = 0;
 
     img->layers = (Layer **)malloc(img->layer_capacity * sizeof(Layer *));
     if (!img->layers)
@@ -57,34 +69,382 @@ crate_image_err_alloc:
     return NULL;
 }
 
+// Source of Layer.id; ids are never reused, unlike Layer pointers
+static uint64_t next_layer_id = 0;
+
 /*
-This function creates a new layer with the specified width and height.
-It allocates memory for the Layer structure and its pixel data.
-Its refcount is initialized to 1. (if used as a temporary layer, it should be released after use)
+Allocates the Layer struct and its tile metadata. Dense layers get a zeroed
+pixel buffer (left uninitialized with LAYER_ALLOC_UNINITIALIZED) with packed
+rows, or rows padded to 64 bytes with LAYER_ALLOC_ALIGNED; tiled layers only
+get an empty tile table and allocate each tile on first write.
+With LAYER_ALLOC_NO_PIXELS the caller points data (and stride) at external memory.
 */
-Layer *create_layer(int width, int height)
+Layer *alloc_layer(int width, int height, int flags)
 {
-    Layer *layer = (Layer *)malloc(sizeof(Layer));
+    Layer *layer = (Layer *)calloc(1, sizeof(Layer));
     if (!layer)
         goto crate_image_layer_alloc;
 
     layer->width = width;
     layer->height = height;
-    layer->data = (uint32_t *)malloc(width * height * sizeof(uint32_t));
-    memset(layer->data, 0, width * height * sizeof(uint32_t)); // initialize to transparent black
+    layer->stride = (size_t)width;
+    layer->tiles_x = (width + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE;
+    layer->tiles_y = (height + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE;
+    size_t num_tiles = (size_t)layer->tiles_x * layer->tiles_y;
+
+    layer->storage = (LayerStorage *)calloc(1, sizeof(LayerStorage));
+    if (!layer->storage)
+        goto crate_image_layer_alloc;
+    layer->storage->refcount = 1;
+    layer->storage->num_tiles = num_tiles;
+
+    if (flags & LAYER_ALLOC_TILED)
+    {
+        layer->tiles = (uint32_t **)calloc(num_tiles, sizeof(uint32_t *)); // every tile starts unallocated (transparent)
+        if (!layer->tiles && num_tiles > 0)
+            goto crate_image_layer_alloc;
+    }
+    else if (flags & LAYER_ALLOC_NO_PIXELS)
+    {
+        layer->storage->external = 1;
+    }
+    else
+    {
+        int buffer_flags = 0;
+        if (flags & LAYER_ALLOC_ALIGNED)
+        {
+            layer->stride = ((size_t)width + 15) & ~(size_t)15; // 16 pixels = 64 bytes
+            buffer_flags |= PIXEL_BUFFER_ALIGNED;
+        }
+        // initialized to transparent black unless the caller overwrites every pixel
+        if (flags & LAYER_ALLOC_UNINITIALIZED)
+            buffer_flags |= PIXEL_BUFFER_UNINITIALIZED;
+
+        layer->data = acquire_pixel_buffer((int)layer->stride, height, buffer_flags);
+        if (!layer->data)
+            goto crate_image_layer_alloc;
+        layer->storage->buffer_flags = buffer_flags & PIXEL_BUFFER_ALIGNED;
+    }
+    layer->storage->data = layer->data;
+    layer->storage->width = (int)layer->stride;
+    layer->storage->height = height;
+    layer->storage->tiles = layer->tiles;
 
-    if (!layer->data)
+    layer->tile_coverage = (uint8_t *)malloc(num_tiles);
+    if (!layer->tile_coverage && num_tiles > 0)
         goto crate_image_layer_alloc;
 
     layer->refcount = 1; // initial refcount
+
+    // a fresh layer is fully transparent and has no recorded changes
+    layer->id = __atomic_add_fetch(&next_layer_id, 1, __ATOMIC_RELAXED);
+    layer->version = 0;
+    layer->num_dirty = 0;
+    layer->blend_mode = BLEND_MODE_NORMAL;
+    layer->opacity = 255;
+    layer->visible = 1;
+
+    // Tiles are classified on first flatten, so pixels written directly
+    // before the first export are still picked up
+    set_layer_coverage(layer, TILE_COVERAGE_UNKNOWN);
+    STATS_ADD(layers_created, 1);
     return layer;
 
 crate_image_layer_alloc:
-    free(layer->data);
+    if (layer)
+    {
+        free(layer->tiles);
+        if (layer->storage)
+            recycle_pixel_buffer(layer->data, (int)layer->stride, height, layer->storage->buffer_flags);
+        free(layer->storage);
+        free(layer->tile_coverage);
+    }
     free(layer);
     return NULL;
 }
 
+/*
+This function creates a new layer with the specified width and height.
+It allocates memory for the Layer structure and its pixel data.
+Its refcount is initialized to 1. (if used as a temporary layer, it should be released after use)
+*/
+Layer *create_layer(int width, int height)
+{
+    return alloc_layer(width, height, 0);
+}
+
+Layer *create_tiled_layer(int width, int height)
+{
+    return alloc_layer(width, height, LAYER_ALLOC_TILED);
+}
+
+Layer *create_aligned_layer(int width, int height)
+{
+    return alloc_layer(width, height, LAYER_ALLOC_ALIGNED);
+}
+
+Layer *wrap_layer_pixels(uint32_t *pixels, int width, int height, size_t stride)
+{
+    if (!pixels || width <= 0 || height <= 0 || stride < (size_t)width)
+    {
+        fprintf(stderr, "Error: Invalid arguments to wrap_layer_pixels\n");
+        return NULL;
+    }
+
+    Layer *layer = alloc_layer(width, height, LAYER_ALLOC_NO_PIXELS);
+    if (!layer)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for layer\n");
+        return NULL;
+    }
+
+    layer->data = layer->storage->data = pixels;
+    layer->stride = stride;
+    layer->storage->width = (int)stride;
+    layer->version = 1; // the caller's pixels are not known to be transparent
+    return layer;
+}
+
+Layer *create_layer_view(Layer *parent, int x, int y, int width, int height)
+{
+    if (!parent || width <= 0 || height <= 0 || x < 0 || y < 0 ||
+        x > parent->width - width || y > parent->height - height)
+    {
+        fprintf(stderr, "Error: View rectangle does not fit in the parent layer\n");
+        return NULL;
+    }
+    if (!parent->data)
+    {
+        fprintf(stderr, "Error: Views of tiled layers are not supported\n");
+        return NULL;
+    }
+
+    // The parent's pixels must not move while views point into them: give it
+    // private pixels now; share_layer copies layers with views eagerly after this
+    if (make_layer_writable(parent) != 0)
+        return NULL;
+
+    Layer *view = alloc_layer(width, height, LAYER_ALLOC_NO_PIXELS);
+    if (!view)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for layer view\n");
+        return NULL;
+    }
+
+    view->data = view->storage->data = parent->data + (size_t)y * parent->stride + x;
+    view->stride = parent->stride;
+    view->storage->width = (int)parent->stride;
+    view->premultiplied = parent->premultiplied;
+    view->paint_mode = parent->paint_mode;
+    view->version = 1; // shows whatever the parent holds
+    view->parent = parent;
+    view->parent_x = x;
+    view->parent_y = y;
+
+    retain_layer(parent);
+    __atomic_add_fetch(&parent->num_views, 1, __ATOMIC_ACQ_REL);
+    return view;
+}
+
+uint32_t *allocate_layer_tile(Layer *layer, int tx, int ty)
+{
+    uint32_t **slot = &layer->tiles[(size_t)ty * layer->tiles_x + tx];
+    if (!*slot)
+    {
+        // pixels of a new tile are transparent black, like an unallocated one
+        *slot = acquire_pixel_buffer(LAYER_TILE_SIZE, LAYER_TILE_SIZE, 0);
+        if (!*slot)
+            fprintf(stderr, "Error: Unable to allocate memory for layer tile\n");
+    }
+    return *slot;
+}
+
+void free_layer_tiles(Layer *layer)
+{
+    if (!layer->tiles)
+        return;
+
+    for (size_t i = 0; i < (size_t)layer->tiles_x * layer->tiles_y; i++)
+    {
+        recycle_pixel_buffer(layer->tiles[i], LAYER_TILE_SIZE, LAYER_TILE_SIZE, 0);
+        layer->tiles[i] = NULL;
+    }
+}
+
+void release_layer_storage(LayerStorage *storage)
+{
+    if (!storage || __atomic_sub_fetch(&storage->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if (storage->tiles)
+    {
+        for (size_t i = 0; i < storage->num_tiles; i++)
+        {
+            recycle_pixel_buffer(storage->tiles[i], LAYER_TILE_SIZE, LAYER_TILE_SIZE, 0);
+        }
+    }
+    free(storage->tiles);
+    if (!storage->external)
+        recycle_pixel_buffer(storage->data, storage->width, storage->height, storage->buffer_flags);
+    free(storage);
+}
+
+/*
+Gives the layer a private copy of its pixels if other layers share them.
+The copy is made before the shared storage is released, so two layers
+detaching at the same time both end up with valid private pixels.
+*/
+int make_layer_writable(Layer *layer)
+{
+    if (!layer)
+        return 1;
+
+    LayerStorage *shared = layer->storage;
+    if (__atomic_load_n(&shared->refcount, __ATOMIC_ACQUIRE) == 1)
+        return 0;
+
+    LayerStorage *copy = (LayerStorage *)calloc(1, sizeof(LayerStorage));
+    if (!copy)
+        goto make_writable_err_alloc;
+    copy->refcount = 1;
+    copy->num_tiles = shared->num_tiles;
+
+    if (shared->data)
+    {
+        // same stride as the shared pixels, so the copy is a single memcpy
+        size_t bytes = layer->stride * layer->height * sizeof(uint32_t);
+        copy->width = (int)layer->stride;
+        copy->height = layer->height;
+        copy->buffer_flags = shared->buffer_flags;
+        copy->data = acquire_pixel_buffer(copy->width, copy->height, copy->buffer_flags | PIXEL_BUFFER_UNINITIALIZED);
+        if (!copy->data)
+            goto make_writable_err_alloc;
+        memcpy(copy->data, shared->data, bytes);
+    }
+    else
+    {
+        copy->tiles = (uint32_t **)calloc(shared->num_tiles, sizeof(uint32_t *));
+        if (!copy->tiles && shared->num_tiles > 0)
+            goto make_writable_err_alloc;
+
+        for (size_t i = 0; i < shared->num_tiles; i++)
+        {
+            if (!shared->tiles[i])
+                continue;
+            copy->tiles[i] = acquire_pixel_buffer(LAYER_TILE_SIZE, LAYER_TILE_SIZE, PIXEL_BUFFER_UNINITIALIZED);
+            if (!copy->tiles[i])
+                goto make_writable_err_alloc;
+            memcpy(copy->tiles[i], shared->tiles[i], LAYER_TILE_SIZE * LAYER_TILE_SIZE * sizeof(uint32_t));
+        }
+    }
+
+    layer->storage = copy;
+    layer->data = copy->data;
+    layer->tiles = copy->tiles;
+    release_layer_storage(shared);
+    return 0;
+
+make_writable_err_alloc:
+    fprintf(stderr, "Error: Unable to allocate memory for layer copy\n");
+    release_layer_storage(copy);
+    return 1;
+}
+
+// share_layer for views and layers with views: their pixels are copied right away
+static Layer *copy_layer(Layer *layer)
+{
+    Layer *copy = alloc_layer(layer->width, layer->height, LAYER_ALLOC_UNINITIALIZED);
+    if (!copy)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for layer copy\n");
+        return NULL;
+    }
+
+    for (int y = 0; y < layer->height; y++)
+    {
+        memcpy(copy->data + (size_t)y * copy->stride, layer->data + (size_t)y * layer->stride,
+               (size_t)layer->width * sizeof(uint32_t));
+    }
+    copy->premultiplied = layer->premultiplied;
+    copy->paint_mode = layer->paint_mode;
+    copy->blend_mode = layer->blend_mode;
+    copy->opacity = layer->opacity;
+    copy->visible = layer->visible;
+    copy->version = 1;
+    return copy;
+}
+
+Layer *share_layer(Layer *layer)
+{
+    if (!layer)
+        return NULL;
+
+    if (layer->parent || __atomic_load_n(&layer->num_views, __ATOMIC_ACQUIRE) > 0)
+        return copy_layer(layer);
+
+    Layer *share = (Layer *)calloc(1, sizeof(Layer));
+    if (!share)
+        goto share_layer_err_alloc;
+
+    size_t num_tiles = (size_t)layer->tiles_x * layer->tiles_y;
+    share->tile_coverage = (uint8_t *)malloc(num_tiles);
+    if (!share->tile_coverage && num_tiles > 0)
+        goto share_layer_err_alloc;
+    memcpy(share->tile_coverage, layer->tile_coverage, num_tiles);
+
+    share->width = layer->width;
+    share->height = layer->height;
+    share->stride = layer->stride;
+    share->tiles_x = layer->tiles_x;
+    share->tiles_y = layer->tiles_y;
+    share->storage = layer->storage;
+    share->data = layer->data;
+    share->tiles = layer->tiles;
+    share->premultiplied = layer->premultiplied;
+    share->paint_mode = layer->paint_mode;
+    share->blend_mode = layer->blend_mode;
+    share->opacity = layer->opacity;
+    share->visible = layer->visible;
+    __atomic_add_fetch(&share->storage->refcount, 1, __ATOMIC_RELAXED);
+
+    share->refcount = 1;
+
+    // A new identity: caches treat it as a new layer. Version 0 would mean "never
+    // drawn on" (transparent), which is not true of the shared pixels.
+    share->id = __atomic_add_fetch(&next_layer_id, 1, __ATOMIC_RELAXED);
+    share->version = 1;
+    share->num_dirty = 0;
+    STATS_ADD(layers_created, 1);
+    return share;
+
+share_layer_err_alloc:
+    fprintf(stderr, "Error: Unable to allocate memory for shared layer\n");
+    if (share)
+        free(share->tile_coverage);
+    free(share);
+    return NULL;
+}
+
+int begin_layer_write(Layer *layer, int x, int y, int w, int h)
+{
+    if (layer->parent)
+    {
+        // The pixels belong to the parent: record the change there too, within the view
+        int x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+        int x1 = x + w > layer->width ? layer->width : x + w;
+        int y1 = y + h > layer->height ? layer->height : y + h;
+        if (x1 > x0 && y1 > y0 &&
+            begin_layer_write(layer->parent, layer->parent_x + x0, layer->parent_y + y0, x1 - x0, y1 - y0) != 0)
+            return 1;
+    }
+
+    if (make_layer_writable(layer) != 0)
+        return 1;
+
+    mark_layer_dirty(layer, x, y, w, h);
+    return 0;
+}
+
 int add_existing_layer(Image *img, Layer *layer)
 {
     if (!img || !layer)
@@ -117,14 +477,13 @@ int add_existing_layer(Image *img, Layer *layer)
     return 0;
 }
 
-Layer *add_layer(Image *img)
+// Creates a layer with the image dimensions and attaches it; the image holds the only reference
+static Layer *add_new_layer(Image *img, int flags)
 {
     if (!img)
         return NULL;
 
-    Layer *new_layer = create_layer(img->width, img->height);
-    new_layer->refcount = 0; // the refcount will be incremented in add_existing_layer
-
+    Layer *new_layer = alloc_layer(img->width, img->height, flags);
     if (!new_layer)
     {
         fprintf(stderr, "Error: Unable to allocate memory for layer data\n");
@@ -137,9 +496,34 @@ Layer *add_layer(Image *img)
         return NULL;
     }
 
+    release_layer(new_layer); // the image now owns it
     return new_layer;
 }
 
+Layer *add_layer(Image *img)
+{
+    return add_new_layer(img, 0);
+}
+
+Layer *add_tiled_layer(Image *img)
+{
+    return add_new_layer(img, LAYER_ALLOC_TILED);
+}
+
+Layer *add_shared_layer(Image *img, Layer *layer)
+{
+    if (!img || !layer)
+        return NULL;
+
+    Layer *share = share_layer(layer);
+    if (!share)
+        return NULL;
+
+    int failed = add_existing_layer(img, share);
+    release_layer(share); // the image holds the only reference (or none on failure)
+    return failed ? NULL : share;
+}
+
 void remove_layer(Image *img, int index)
 {
     if (index < 0 || index >= img->num_layers)
@@ -159,6 +543,8 @@ void remove_layer(Image *img, int index)
 
 void free_image(Image *img)
 {
+    disable_image_cache(img);
+
     for (int i = 0; i < img->num_layers; i++)
     {
         release_layer(img->layers[i]);
@@ -167,6 +553,139 @@ void free_image(Image *img)
     free(img);
 }
 
+static int rect_contains(const ImageRect *outer, const ImageRect *inner)
+{
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->w <= outer->x + outer->w &&
+           inner->y + inner->h <= outer->y + outer->h;
+}
+
+static ImageRect rect_union(const ImageRect *a, const ImageRect *b)
+{
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+    ImageRect r = {x0, y0, x1 - x0, y1 - y0};
+    return r;
+}
+
+/*
+Each change bumps the layer version and is logged with that version, so every
+image holding the layer can find what changed since the version it last saw.
+Records are never dropped: when the log is full the two oldest are merged,
+which only makes consumers that are far behind recomposite a larger area.
+*/
+void mark_layer_dirty(Layer *layer, int x, int y, int w, int h)
+{
+    if (!layer)
+        return;
+
+    // clip to the layer bounds
+    if (x < 0)
+    {
+        w += x;
+        x = 0;
+    }
+    if (y < 0)
+    {
+        h += y;
+        y = 0;
+    }
+    if (x + w > layer->width)
+        w = layer->width - x;
+    if (y + h > layer->height)
+        h = layer->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    ImageRect rect = {x, y, w, h};
+
+    // the touched tiles have to be classified again
+    for (int ty = y / LAYER_TILE_SIZE; ty <= (y + h - 1) / LAYER_TILE_SIZE; ty++)
+    {
+        memset(layer->tile_coverage + (size_t)ty * layer->tiles_x + x / LAYER_TILE_SIZE,
+               TILE_COVERAGE_UNKNOWN, (x + w - 1) / LAYER_TILE_SIZE - x / LAYER_TILE_SIZE + 1);
+    }
+
+    layer->version++;
+    if (layer->version == 0)
+        layer->version = 1; // 0 is reserved for untouched layers
+
+    // Repeated drawing in the same area only refreshes the newest record
+    if (layer->num_dirty > 0 && rect_contains(&layer->dirty[layer->num_dirty - 1].rect, &rect))
+    {
+        layer->dirty[layer->num_dirty - 1].version = layer->version;
+        return;
+    }
+
+    if (layer->num_dirty == LAYER_DIRTY_LOG_SIZE)
+    {
+        layer->dirty[1].rect = rect_union(&layer->dirty[0].rect, &layer->dirty[1].rect);
+        memmove(&layer->dirty[0], &layer->dirty[1], (LAYER_DIRTY_LOG_SIZE - 1) * sizeof(DirtyRegion));
+        layer->num_dirty--;
+    }
+
+    layer->dirty[layer->num_dirty].rect = rect;
+    layer->dirty[layer->num_dirty].version = layer->version;
+    layer->num_dirty++;
+}
+
+void set_layer_coverage(Layer *layer, TileCoverage coverage)
+{
+    memset(layer->tile_coverage, coverage, (size_t)layer->tiles_x * layer->tiles_y);
+}
+
+static TileCoverage classify_tile(const Layer *layer, int tx, int ty)
+{
+    int x0 = tx * LAYER_TILE_SIZE;
+    int y0 = ty * LAYER_TILE_SIZE;
+    int x1 = x0 + LAYER_TILE_SIZE < layer->width ? x0 + LAYER_TILE_SIZE : layer->width;
+    int y1 = y0 + LAYER_TILE_SIZE < layer->height ? y0 + LAYER_TILE_SIZE : layer->height;
+
+    // unallocated tiles read as transparent
+    if (!layer_read_ptr(layer, x0, y0))
+        return TILE_COVERAGE_TRANSPARENT;
+
+    // AND and OR of every alpha byte: all 255 means opaque, all 0 transparent
+    uint32_t all = 0xFF000000, any = 0;
+    for (int y = y0; y < y1; y++)
+    {
+        const uint32_t *row = layer_read_ptr(layer, x0, y);
+        for (int x = 0; x < x1 - x0; x++)
+        {
+            all &= row[x];
+            any |= row[x];
+        }
+        if ((all & 0xFF000000) != 0xFF000000 && (any & 0xFF000000) != 0)
+            return TILE_COVERAGE_MIXED;
+    }
+
+    if ((all & 0xFF000000) == 0xFF000000)
+        return TILE_COVERAGE_OPAQUE;
+    if ((any & 0xFF000000) == 0)
+        return TILE_COVERAGE_TRANSPARENT;
+    return TILE_COVERAGE_MIXED;
+}
+
+TileCoverage get_tile_coverage(Layer *layer, int tx, int ty)
+{
+    // writes through the parent do not reach a view's cache, so never trust it
+    if (layer->parent)
+        return TILE_COVERAGE_MIXED;
+
+    uint8_t *slot = layer->tile_coverage + (size_t)ty * layer->tiles_x + tx;
+
+    // Concurrent flattening threads may classify the same tile; they store the same value
+    TileCoverage coverage = (TileCoverage)__atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (coverage == TILE_COVERAGE_UNKNOWN)
+    {
+        coverage = classify_tile(layer, tx, ty);
+        __atomic_store_n(slot, (uint8_t)coverage, __ATOMIC_RELAXED);
+    }
+    return coverage;
+}
+
 void print_image_info(const Image *img)
 {
     if (!img)
@@ -176,7 +695,7 @@ void print_image_info(const Image *img)
     for (int i = 0; i < img->num_layers; i++)
     {
         Layer *layer = img->layers[i];
-        printf("  Layer %d: %dx%d, Refcount: %d\n", i, layer->width, layer->height, layer->refcount);
+        printf("  Layer %d: %dx%d, Refcount: %u\n", i, layer->width, layer->height, layer->refcount);
     }
 }
 
@@ -203,193 +722,198 @@ uint32_t blend_pixels(uint32_t bg_color, uint32_t fg_color)
     return COLOR(255, r, g, b);
 }
 
-int save_image_ppm(FILE *fp, const Image *img)
+uint32_t premultiply_color(uint32_t color)
 {
-    // 1. Write PPM Header (P6 = Binary RGB, width, height, max_val)
-    fprintf(fp, "P6\n%d %d\n255\n", img->width, img->height);
+    unsigned int alpha = GET_A(color);
+    if (alpha == 255)
+        return color;
 
-    // Buffer to hold the RGB data for one row (3 bytes per pixel)
-    size_t row_size = img->width * 3;
-    unsigned char *row_buffer = (unsigned char *)malloc(row_size);
+    // round(c * alpha / 255) without a division
+    unsigned int r = GET_R(color) * alpha + 128;
+    unsigned int g = GET_G(color) * alpha + 128;
+    unsigned int b = GET_B(color) * alpha + 128;
+    return COLOR(alpha, (r + (r >> 8)) >> 8, (g + (g >> 8)) >> 8, (b + (b >> 8)) >> 8);
+}
 
-    if (!row_buffer)
+uint32_t unpremultiply_color(uint32_t color)
+{
+    unsigned int alpha = GET_A(color);
+    if (alpha == 255)
+        return color;
+    if (alpha == 0)
+        return 0;
+
+    unsigned int r = (GET_R(color) * 255 + alpha / 2) / alpha;
+    unsigned int g = (GET_G(color) * 255 + alpha / 2) / alpha;
+    unsigned int b = (GET_B(color) * 255 + alpha / 2) / alpha;
+    return COLOR(alpha, r > 255 ? 255 : r, g > 255 ? 255 : g, b > 255 ? 255 : b);
+}
+
+static void convert_pixels(uint32_t *pixels, size_t count, uint32_t (*convert)(uint32_t))
+{
+    for (size_t i = 0; i < count; i++)
     {
-        fprintf(stderr, "Error: Memory allocation failed for row buffer.\n");
-        return 1;
+        pixels[i] = convert(pixels[i]);
     }
+}
 
-    // Loop through every row (y)
-    for (int y = 0; y < img->height; y++)
-    {
-        // 2. Loop through every pixel in the current row (x)
-        for (int x = 0; x < img->width; x++)
-        {
-            uint32_t final_color = BACKGROUND_COLOR; // Start with Black
+int set_layer_premultiplied(Layer *layer, int premultiplied)
+{
+    if (!layer)
+        return 1;
 
-            // Calculate the 1D index
-            size_t pixel_index = y * img->width + x;
+    premultiplied = premultiplied != 0;
+    if (layer->premultiplied == premultiplied)
+        return 0;
 
-            // Blend all layers for the current pixel
-            for (int i = 0; i < img->num_layers; i++)
-            {
-                Layer *layer = img->layers[i];
-                uint32_t layer_pixel = layer->data[pixel_index];
-                final_color = blend_pixels(final_color, layer_pixel);
-            }
+    if (layer->parent || __atomic_load_n(&layer->num_views, __ATOMIC_ACQUIRE) > 0)
+    {
+        fprintf(stderr, "Error: Cannot convert a layer view or a layer with views\n");
+        return 1;
+    }
 
-            // Write the R, G, B bytes into the buffer (PPM P6 format is R, G, B triplets)
-            size_t buf_index = x * 3;
-            row_buffer[buf_index + 0] = (unsigned char)GET_R(final_color);
-            row_buffer[buf_index + 1] = (unsigned char)GET_G(final_color);
-            row_buffer[buf_index + 2] = (unsigned char)GET_B(final_color);
-        }
+    if (begin_layer_write(layer, 0, 0, layer->width, layer->height) != 0)
+        return 1;
 
-        // 3. Write the entire row buffer to the file
-        if (fwrite(row_buffer, 1, row_size, fp) != row_size)
+    uint32_t (*convert)(uint32_t) = premultiplied ? premultiply_color : unpremultiply_color;
+    if (layer->data)
+    {
+        for (int y = 0; y < layer->height; y++)
         {
-            fprintf(stderr, "Error: Failed to write full row to file.\n");
-            free(row_buffer);
-            return 1;
+            convert_pixels(layer->data + (size_t)y * layer->stride, (size_t)layer->width, convert);
+        }
+    }
+    else
+    {
+        // unallocated tiles are transparent black in both representations
+        for (size_t i = 0; i < (size_t)layer->tiles_x * layer->tiles_y; i++)
+        {
+            if (layer->tiles[i])
+                convert_pixels(layer->tiles[i], LAYER_TILE_SIZE * LAYER_TILE_SIZE, convert);
         }
     }
 
-    free(row_buffer);
+    layer->premultiplied = premultiplied;
     return 0;
 }
 
-int save_image_pgm(FILE *fp, const Image *img)
+// The pixels stay the same, but every image holding the layer has to composite it again
+static void mark_layer_composite_changed(Layer *layer)
 {
-    // 1. Write PPM Header (P5 = Binary Grayscale, width, height, max_val)
-    fprintf(fp, "P5\n%d %d\n255\n", img->width, img->height);
-
-    // Buffer to hold the grayscale data for one row (1 byte per pixel)
-    size_t row_size = img->width;
-    unsigned char *row_buffer = (unsigned char *)malloc(row_size);
+    mark_layer_dirty(layer, 0, 0, layer->width, layer->height);
+}
 
-    if (!row_buffer)
-    {
-        fprintf(stderr, "Error: Memory allocation failed for row buffer.\n");
+int set_layer_blend_mode(Layer *layer, BlendMode mode)
+{
+    if (!layer || mode < BLEND_MODE_NORMAL || mode >= BLEND_MODE_COUNT)
         return 1;
-    }
 
-    // Loop through every row (y)
-    for (int y = 0; y < img->height; y++)
+    if (layer->blend_mode != mode)
     {
-        // 2. Loop through every pixel in the current row (x)
-        for (int x = 0; x < img->width; x++)
-        {
-            uint32_t final_color = BACKGROUND_COLOR; // Start with Black
-
-            // Calculate the 1D index
-            size_t pixel_index = y * img->width + x;
-
-            // Blend all layers for the current pixel
-            for (int i = 0; i < img->num_layers; i++)
-            {
-                Layer *layer = img->layers[i];
-                uint32_t layer_pixel = layer->data[pixel_index];
-                final_color = blend_pixels(final_color, layer_pixel);
-            }
+        layer->blend_mode = mode;
+        mark_layer_composite_changed(layer);
+    }
+    return 0;
+}
 
-            // Write the grayscale byte into the buffer
-            size_t buf_index = x * 1;
-            // Convert to grayscale
-            unsigned char gray = (unsigned char)(0.299 * GET_R(final_color) +
-                                                 0.587 * GET_G(final_color) +
-                                                 0.114 * GET_B(final_color));
-            row_buffer[buf_index] = gray;
-        }
+void set_layer_opacity(Layer *layer, int opacity)
+{
+    if (!layer)
+        return;
 
-        // 3. Write the entire row buffer to the file
-        if (fwrite(row_buffer, 1, row_size, fp) != row_size)
-        {
-            fprintf(stderr, "Error: Failed to write full row to file.\n");
-            free(row_buffer);
-            return 1;
-        }
+    opacity = opacity < 0 ? 0 : opacity > 255 ? 255 : opacity;
+    if (layer->opacity != opacity)
+    {
+        layer->opacity = opacity;
+        mark_layer_composite_changed(layer);
     }
-
-    free(row_buffer);
-    return 0;
 }
 
-int save_image_pbm(FILE *fp, const Image *img)
+void set_layer_visible(Layer *layer, int visible)
 {
-    // 1. Write PBM Header (P4 = Binary Bitmap, width, height)
-    // NOTE: PBM does NOT have a "Max Value" line like PGM/PPM.
-    fprintf(fp, "P4\n%d %d\n", img->width, img->height);
+    if (!layer)
+        return;
 
-    // Calculate bytes per row: ceil(width / 8)
-    // Example: Width 10 -> needs 2 bytes (8 bits + 2 bits)
-    size_t row_size = (img->width + 7) / 8;
+    visible = visible != 0;
+    if (layer->visible != visible)
+    {
+        layer->visible = visible;
+        mark_layer_composite_changed(layer);
+    }
+}
 
-    // Allocate buffer for one packed row
-    unsigned char *row_buffer = (unsigned char *)calloc(row_size, 1); // Use calloc to ensure padding bits are 0
+/*
+Flattens the image through the flatten engine, converts it to the given format
+and writes it to the file in order. Each converted row is row_size bytes long;
+packed formats start every row on a byte boundary.
+Rows are processed in groups of one band per thread, so the bands of a group are
+composited in parallel while the output stays byte-identical to a single thread.
+*/
+static int write_flattened_rows(FILE *fp, const Image *img, ArrayDataFormat format, size_t row_size)
+{
+    int group_rows = FLATTEN_BAND_ROWS * get_thread_count();
+    if (group_rows > img->height)
+        group_rows = img->height > 0 ? img->height : 1;
 
-    if (!row_buffer)
+    // calloc keeps PBM padding bits at 0
+    unsigned char *group_buffer = (unsigned char *)calloc((size_t)group_rows * row_size, 1);
+    if (!group_buffer)
     {
         fprintf(stderr, "Error: Memory allocation failed for row buffer.\n");
         return 1;
     }
 
-    // Loop through every row (y)
-    for (int y = 0; y < img->height; y++)
+    for (int y = 0; y < img->height; y += group_rows)
     {
-        // Reset buffer to 0 for the new row (crucial because we use bitwise OR)
-        memset(row_buffer, 0, row_size);
+        int rows = img->height - y < group_rows ? img->height - y : group_rows;
+        size_t bytes = (size_t)rows * row_size;
 
-        // 2. Loop through every pixel in the current row (x)
-        for (int x = 0; x < img->width; x++)
+        if (flatten_rows(img, y, rows, format, group_buffer, row_size * 8) != 0)
         {
-            uint32_t final_color = BACKGROUND_COLOR;
-
-            // Calculate the 1D index
-            size_t pixel_index = y * img->width + x;
-
-            // Blend all layers
-            for (int i = 0; i < img->num_layers; i++)
-            {
-                Layer *layer = img->layers[i];
-                uint32_t layer_pixel = layer->data[pixel_index];
-                final_color = blend_pixels(final_color, layer_pixel);
-            }
-
-            // Convert to grayscale intensity
-            unsigned char gray = (unsigned char)(0.299 * GET_R(final_color) +
-                                                 0.587 * GET_G(final_color) +
-                                                 0.114 * GET_B(final_color));
-
-            // 3. Convert to Black & White (Thresholding)
-            // PBM Standard: 1 = Black, 0 = White.
-            // Logic: If intensity is low (dark), it's a 1. If high (bright), it's a 0.
-            if (gray < 128)
-            {
-                // We have a black pixel, so we need to set the bit to 1.
-
-                // Which byte is this pixel in?
-                size_t byte_index = x / 8;
-
-                // Which bit inside that byte? (MSB is first, so 7 - remainder)
-                int bit_index = 7 - (x % 8);
-
-                // Set the bit
-                row_buffer[byte_index] |= (1 << bit_index);
-            }
+            free(group_buffer);
+            return 1;
         }
 
-        // 4. Write the packed row to the file
-        if (fwrite(row_buffer, 1, row_size, fp) != row_size)
+        uint64_t write_start = stats_clock();
+        size_t written = fwrite(group_buffer, 1, bytes, fp);
+        stats_end_stage(IMAGE_STAGE_WRITE, "fwrite", write_start);
+        STATS_ADD(bytes_written, written);
+        if (written != bytes)
         {
             fprintf(stderr, "Error: Failed to write full row to file.\n");
-            free(row_buffer);
+            free(group_buffer);
             return 1;
         }
     }
 
-    free(row_buffer);
+    free(group_buffer);
     return 0;
 }
 
+int save_image_ppm(FILE *fp, const Image *img)
+{
+    // P6 = Binary RGB, width, height, max_val; 3 bytes per pixel
+    fprintf(fp, "P6\n%d %d\n255\n", img->width, img->height);
+    return write_flattened_rows(fp, img, ARRAY_DATA_FORMAT_RGB24, (size_t)img->width * 3);
+}
+
+int save_image_pgm(FILE *fp, const Image *img)
+{
+    // P5 = Binary Grayscale, width, height, max_val; 1 byte per pixel
+    fprintf(fp, "P5\n%d %d\n255\n", img->width, img->height);
+    return write_flattened_rows(fp, img, ARRAY_DATA_FORMAT_GRAYSCALE8, (size_t)img->width);
+}
+
+int save_image_pbm(FILE *fp, const Image *img)
+{
+    // P4 = Binary Bitmap, width, height
+    // NOTE: PBM does NOT have a "Max Value" line like PGM/PPM.
+    fprintf(fp, "P4\n%d %d\n", img->width, img->height);
+
+    // Bytes per row: ceil(width / 8), PBM Standard: 1 = Black, 0 = White.
+    return write_flattened_rows(fp, img, ARRAY_DATA_FORMAT_BINARY1, ((size_t)img->width + 7) / 8);
+}
+
 int save_image(const Image *img, const char *filename, ImageFileType type)
 {
     if (!img || !filename)
@@ -403,6 +927,7 @@ int save_image(const Image *img, const char *filename, ImageFileType type)
         return 1;
     }
 
+    uint64_t start = stats_clock();
     switch (type)
     {
     case IMAGE_FILE_PPM:
@@ -422,6 +947,7 @@ int save_image(const Image *img, const char *filename, ImageFileType type)
     }
 
     fclose(f);
+    stats_trace("save_image", start, stats_now());
     return 0;
 
 image_save_err:
@@ -429,104 +955,307 @@ image_save_err:
     return 1;
 }
 
-int export_to_array(const Image *img, void **out_array, size_t *len, ArrayDataFormat format)
+Bitmap *create_bitmap(int width, int height)
 {
-    if (!img)
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    Bitmap *bitmap = (Bitmap *)malloc(sizeof(Bitmap));
+    if (!bitmap)
+        goto create_bitmap_err_alloc;
+
+    bitmap->width = width;
+    bitmap->height = height;
+    bitmap->stride = ((size_t)width + 7) / 8;
+    bitmap->bits = (uint8_t *)calloc(bitmap->stride * height, 1); // 0 = white
+    if (!bitmap->bits)
+        goto create_bitmap_err_alloc;
+    return bitmap;
+
+create_bitmap_err_alloc:
+    fprintf(stderr, "Error: Unable to allocate memory for bitmap\n");
+    free(bitmap);
+    return NULL;
+}
+
+void free_bitmap(Bitmap *bitmap)
+{
+    if (bitmap)
+    {
+        free(bitmap->bits);
+        free(bitmap);
+    }
+}
+
+int save_bitmap(const Bitmap *bitmap, const char *filename)
+{
+    if (!bitmap || !filename)
         return 1;
 
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Error: Could not open file %s for writing\n", filename);
+        return 1;
+    }
+
+    // The bits are already a P4 body
+    fprintf(f, "P4\n%d %d\n", bitmap->width, bitmap->height);
+    size_t size = bitmap->stride * bitmap->height;
+    if (fwrite(bitmap->bits, 1, size, f) != size)
+    {
+        fprintf(stderr, "Error: Failed to write full bitmap to file.\n");
+        fclose(f);
+        return 1;
+    }
+
+    return fclose(f) != 0;
+}
+
+// Bits per pixel of an array data format, 0 if unknown
+static size_t format_pixel_bits(ArrayDataFormat format)
+{
     switch (format)
     {
     case ARRAY_DATA_FORMAT_RGBA32:
-        *len = img->width * img->height;
-        *out_array = malloc(*len * sizeof(uint32_t));
-        break;
+        return 32;
     case ARRAY_DATA_FORMAT_RGB24:
-        *len = img->width * img->height * 3;
-        printf("Calculated array length for RGB24: %d\n", *len);
-        *out_array = malloc(*len * sizeof(uint8_t));
-        break;
+        return 24;
     case ARRAY_DATA_FORMAT_GRAYSCALE8:
-        *len = img->width * img->height;
-        *out_array = malloc(*len * sizeof(uint8_t));
-        break;
+        return 8;
     case ARRAY_DATA_FORMAT_BINARY1:
-        *len = (img->width * img->height + 7) / 8;
-        *out_array = malloc(*len * sizeof(uint8_t));
-        *out_array = memset(*out_array, 0, *len); // initialize all bits to 0 (white)
-        break;
+        return 1;
     default:
-        break;
+        return 0;
+    }
+}
+
+int export_to_buffer(const Image *img, int x, int y, int w, int h, void *dst, size_t stride, ArrayDataFormat format)
+{
+    size_t pixel_bits = format_pixel_bits(format);
+    if (!img || !dst || pixel_bits == 0)
+        return 1;
+
+    if (w <= 0 || h <= 0 || x < 0 || y < 0 || x > img->width - w || y > img->height - h)
+    {
+        fprintf(stderr, "Error: Export rectangle does not fit in the image\n");
+        return 1;
+    }
+
+    // A stride of 0 packs the rows back to back (bit by bit for BINARY1)
+    size_t row_bits = (size_t)w * pixel_bits;
+    if (stride != 0 && stride < (row_bits + 7) / 8)
+    {
+        fprintf(stderr, "Error: Export stride is smaller than a row\n");
+        return 1;
     }
+    size_t bit_stride = stride != 0 ? stride * 8 : row_bits;
 
+    uint64_t start = stats_clock();
+    ImageRect rect = {x, y, w, h};
+    int result = flatten_rect(img, rect, format, (uint8_t *)dst, bit_stride);
+    stats_trace("export_to_buffer", start, stats_now());
+    return result;
+}
+
+int export_to_array(const Image *img, void **out_array, size_t *len, ArrayDataFormat format)
+{
+    size_t pixel_bits = format_pixel_bits(format);
+    if (!img || !out_array || !len || pixel_bits == 0)
+        return 1;
+
+    size_t bytes = ((size_t)img->width * img->height * pixel_bits + 7) / 8;
+    *out_array = malloc(bytes);
     if (!*out_array)
         return 1;
 
-    for (int y = 0; y < img->height; y++)
+    // RGBA32 lengths count pixels, the other formats count bytes
+    *len = format == ARRAY_DATA_FORMAT_RGBA32 ? bytes / sizeof(uint32_t) : bytes;
+    if (format == ARRAY_DATA_FORMAT_BINARY1)
+        memset(*out_array, 0, bytes); // the packed rows only replace their own bits
+
+    if (export_to_buffer(img, 0, 0, img->width, img->height, *out_array, 0, format) != 0)
     {
-        for (int x = 0; x < img->width; x++)
+        free(*out_array);
+        *out_array = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* =========================================================================
+ * STREAMING WRITER
+ * ========================================================================= */
+
+struct ImageWriter
+{
+    FILE *fp;
+    int width, height;
+    int next_row;
+
+    RowConverter convert;
+    size_t row_size;         // encoded bytes per row
+    uint32_t *argb_row;      // one row composited over the background
+    unsigned char *out_row;  // one encoded row
+    int failed;
+};
+
+ImageWriter *open_image_writer(const char *filename, ImageFileType type, int width, int height)
+{
+    if (!filename || width <= 0 || height <= 0)
+        return NULL;
+
+    ImageWriter *writer = (ImageWriter *)calloc(1, sizeof(ImageWriter));
+    if (!writer)
+        return NULL;
+
+    writer->width = width;
+    writer->height = height;
+
+    switch (type)
+    {
+    case IMAGE_FILE_PPM:
+        writer->convert = get_row_converter(ARRAY_DATA_FORMAT_RGB24);
+        writer->row_size = (size_t)width * 3;
+        break;
+    case IMAGE_FILE_PGM:
+        writer->convert = get_row_converter(ARRAY_DATA_FORMAT_GRAYSCALE8);
+        writer->row_size = (size_t)width;
+        break;
+    case IMAGE_FILE_PBM:
+        writer->convert = get_row_converter(ARRAY_DATA_FORMAT_BINARY1);
+        writer->row_size = ((size_t)width + 7) / 8;
+        break;
+    default:
+        fprintf(stderr, "Error: Unsupported file type for writer\n");
+        goto open_writer_err;
+    }
+
+    writer->argb_row = (uint32_t *)malloc((size_t)width * sizeof(uint32_t));
+    writer->out_row = (unsigned char *)calloc(writer->row_size, 1); // calloc keeps PBM padding bits at 0
+    if (!writer->argb_row || !writer->out_row)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for row buffer.\n");
+        goto open_writer_err;
+    }
+
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp)
+    {
+        fprintf(stderr, "Error: Could not open file %s for writing\n", filename);
+        goto open_writer_err;
+    }
+
+    // Same headers as save_image; PBM has no max value line
+    if (type == IMAGE_FILE_PBM)
+        fprintf(writer->fp, "P4\n%d %d\n", width, height);
+    else
+        fprintf(writer->fp, "P%d\n%d %d\n255\n", (int)type, width, height);
+
+    return writer;
+
+open_writer_err:
+    free(writer->argb_row);
+    free(writer->out_row);
+    free(writer);
+    return NULL;
+}
+
+int write_image_rows(ImageWriter *writer, const uint32_t *rows, size_t stride, int count)
+{
+    if (!writer || !rows || writer->failed || count < 0 || count > writer->height - writer->next_row)
+        return 1;
+
+    // Like flatten_band, the clock is read between the stages of every row while statistics are on
+    uint64_t start = stats_clock(), flatten_time = 0, convert_time = 0, write_time = 0;
+    int result = 0;
+    for (int r = 0; r < count; r++)
+    {
+        uint64_t t0 = start ? stats_now() : 0;
+        // Composite over the background exactly like a one-layer image would be
+        for (int x = 0; x < writer->width; x++)
+        {
+            writer->argb_row[x] = BACKGROUND_COLOR;
+        }
+        blend_row(writer->argb_row, rows + (size_t)r * stride, writer->width);
+        uint64_t t1 = start ? stats_now() : 0;
+        writer->convert(writer->argb_row, writer->width, writer->out_row, 0);
+        uint64_t t2 = start ? stats_now() : 0;
+
+        size_t written = fwrite(writer->out_row, 1, writer->row_size, writer->fp);
+        STATS_ADD(bytes_written, written);
+        if (start)
         {
-            uint32_t final_color = BACKGROUND_COLOR; // Start with Black
+            flatten_time += t1 - t0;
+            convert_time += t2 - t1;
+            write_time += stats_now() - t2;
+        }
+        if (written != writer->row_size)
+        {
+            fprintf(stderr, "Error: Failed to write full row to file.\n");
+            writer->failed = 1;
+            result = 1;
+            break;
+        }
+        writer->next_row++;
+        STATS_ADD(pixels_converted, writer->width);
+    }
 
-            // Calculate the 1D index
-            size_t pixel_index = y * img->width + x;
+    if (start)
+    {
+        stats_add_time(IMAGE_STAGE_FLATTEN, flatten_time);
+        stats_add_time(IMAGE_STAGE_CONVERT, convert_time);
+        stats_add_time(IMAGE_STAGE_WRITE, write_time);
+        stats_trace("write_image_rows", start, stats_now());
+    }
+    return result;
+}
 
-            // Blend all layers for the current pixel
-            for (int i = 0; i < img->num_layers; i++)
-            {
-                Layer *layer = img->layers[i];
-                uint32_t layer_pixel = layer->data[pixel_index];
-                final_color = blend_pixels(final_color, layer_pixel);
-            }
+int write_image_strips(ImageWriter *writer, int strip_rows, StripRenderer render, void *ctx)
+{
+    if (!writer || !render || strip_rows <= 0)
+        return 1;
 
-            // Store in the requested format
-            switch (format)
-            {
-            case ARRAY_DATA_FORMAT_RGBA32:
-            {
-                uint32_t *arr = (uint32_t *)(*out_array);
-                arr[pixel_index] = final_color;
-                break;
-            }
-            case ARRAY_DATA_FORMAT_RGB24:
-            {
-                uint8_t *arr = (uint8_t *)(*out_array);
-                size_t base_index = pixel_index * 3;
-                arr[base_index + 0] = (uint8_t)GET_R(final_color);
-                arr[base_index + 1] = (uint8_t)GET_G(final_color);
-                arr[base_index + 2] = (uint8_t)GET_B(final_color);
-                break;
-            }
-            case ARRAY_DATA_FORMAT_GRAYSCALE8:
-            {
-                uint8_t *arr = (uint8_t *)(*out_array);
-                arr[pixel_index] = (uint8_t)(0.299 * GET_R(final_color) +
-                                             0.587 * GET_G(final_color) +
-                                             0.114 * GET_B(final_color));
-                break;
-            }
-            case ARRAY_DATA_FORMAT_BINARY1:
-            {
-                uint8_t *arr = (uint8_t *)(*out_array);
-                size_t byte_index = pixel_index / 8;
-                int bit_index = 7 - (pixel_index % 8);
-                unsigned char gray = (unsigned char)(0.299 * GET_R(final_color) +
-                                                     0.587 * GET_G(final_color) +
-                                                     0.114 * GET_B(final_color));
-                if (gray < 128)
-                {
-                    arr[byte_index] |= (1 << bit_index);
-                }
-                else
-                {
-                    arr[byte_index] &= ~(1 << bit_index);
-                }
-                break;
-            }
-            default:
-                break;
-            }
+    uint32_t *strip = (uint32_t *)malloc((size_t)strip_rows * writer->width * sizeof(uint32_t));
+    if (!strip)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for strip buffer.\n");
+        return 1;
+    }
+
+    int result = 0;
+    while (writer->next_row < writer->height)
+    {
+        int y = writer->next_row;
+        int rows = writer->height - y < strip_rows ? writer->height - y : strip_rows;
+
+        if (render(ctx, y, rows, strip, (size_t)writer->width) != 0 ||
+            write_image_rows(writer, strip, (size_t)writer->width, rows) != 0)
+        {
+            result = 1;
+            break;
         }
     }
 
-    return 0;
+    free(strip);
+    return result;
+}
+
+int close_image_writer(ImageWriter *writer)
+{
+    if (!writer)
+        return 1;
+
+    int result = writer->failed || writer->next_row != writer->height;
+    if (writer->next_row != writer->height)
+        fprintf(stderr, "Error: Writer closed after %d of %d rows\n", writer->next_row, writer->height);
+
+    if (fclose(writer->fp) != 0)
+        result = 1;
+
+    free(writer->argb_row);
+    free(writer->out_row);
+    free(writer);
+    return result;
 }
@@ -32,15 +32,118 @@ typedef enum
     ARRAY_DATA_FORMAT_BINARY1     // 1 bit per pixel (packed)
 } ArrayDataFormat;
 
+/**
+ * An axis-aligned rectangle in pixel coordinates.
+ */
+typedef struct
+{
+    int x, y;
+    int w, h;
+} ImageRect;
+
+// Side of the square tiles used for per-layer coverage metadata
+#define LAYER_TILE_SIZE 64
+
+/**
+ * What a tile of a layer contributes when flattening.
+ * Opaque tiles hide every layer below them; transparent tiles are skipped.
+ */
+typedef enum
+{
+    TILE_COVERAGE_UNKNOWN = 0, // changed since last classified
+    TILE_COVERAGE_TRANSPARENT, // every pixel has alpha 0
+    TILE_COVERAGE_OPAQUE,      // every pixel has alpha 255
+    TILE_COVERAGE_MIXED,
+} TileCoverage;
+
+/**
+ * How the drawing primitives put a color on a layer (see set_layer_paint_mode).
+ */
+typedef enum
+{
+    PAINT_MODE_REPLACE = 0, // pixels are overwritten with the color, alpha included
+    PAINT_MODE_BLEND,       // the color is alpha-composited over the existing pixels
+} PaintMode;
+
+/**
+ * How a layer is composited over the layers below it when the image is
+ * flattened (see set_layer_blend_mode). Every mode is applied per channel to
+ * the straight colors, then mixed with the backdrop by the layer's alpha
+ * times its opacity, like NORMAL.
+ */
+typedef enum
+{
+    BLEND_MODE_NORMAL = 0, // source-over, as blend_pixels
+    BLEND_MODE_MULTIPLY,   // fg * bg / 255: darkens
+    BLEND_MODE_SCREEN,     // fg + bg - fg * bg / 255: lightens
+    BLEND_MODE_ADD,        // min(fg + bg, 255)
+    BLEND_MODE_DIFFERENCE, // |fg - bg|
+    BLEND_MODE_COUNT,
+} BlendMode;
+
+// Number of change records kept per layer; older records are merged when it fills up
+#define LAYER_DIRTY_LOG_SIZE 16
+
+/**
+ * A region of a layer that changed, tagged with the layer version of its latest change.
+ */
 typedef struct
+{
+    ImageRect rect;
+    uint32_t version;
+} DirtyRegion;
+
+typedef struct Layer
 {
     // the pixel data is stored as a 32-bit integer 0xAARRGGBB
-    uint32_t *data; // ARGB pixel data
+    uint32_t *data; // ARGB pixel data, NULL for tiled layers
     int width, height;
+    size_t stride; // pixels between the starts of two rows: pixel (x, y) is data[y * stride + x]
+
+    // Tiled layers (create_tiled_layer) store pixels in LAYER_TILE_SIZE square tiles
+    // of LAYER_TILE_SIZE * LAYER_TILE_SIZE pixels, row-major, allocated on first write.
+    // Unallocated tiles (NULL) read as transparent. NULL for dense layers.
+    uint32_t **tiles;
+
+    uint32_t refcount; // updated atomically by retain_layer / release_layer
+
+    // Pixel memory, possibly shared copy-on-write with other layers (see share_layer).
+    // data and tiles above always point into it.
+    struct LayerStorage *storage;
 
-    uint8_t refcount;
+    // Change tracking (see mark_layer_dirty)
+    uint64_t id;      // unique for the lifetime of the process, never reused
+    uint32_t version; // bumped on every recorded change; 0 means untouched since creation
+    DirtyRegion dirty[LAYER_DIRTY_LOG_SIZE];
+    int num_dirty;
+
+    // One TileCoverage per LAYER_TILE_SIZE square tile, row-major; tiles touched by
+    // mark_layer_dirty become TILE_COVERAGE_UNKNOWN and are reclassified on the next flatten
+    uint8_t *tile_coverage;
+    int tiles_x, tiles_y;
+
+    // Pixels are stored premultiplied by their alpha (see set_layer_premultiplied).
+    // Colors passed to the drawing primitives are always straight ARGB.
+    int premultiplied;
+
+    // How the drawing primitives write to this layer (see set_layer_paint_mode)
+    PaintMode paint_mode;
+
+    // How the layer is composited (see set_layer_blend_mode, set_layer_opacity,
+    // set_layer_visible). Hidden and zero-opacity layers are skipped when flattening.
+    BlendMode blend_mode;
+    int opacity; // 0 to 255, multiplies the alpha of every pixel
+    int visible;
+
+    // Views (create_layer_view) point into the pixels of their parent, which they retain
+    struct Layer *parent;   // NULL unless this layer is a view
+    int parent_x, parent_y; // position of the view in its parent
+    uint32_t num_views;     // live views of this layer (atomic)
 } Layer;
 
+// Flattened copy of an image kept between exports (see enable_image_cache)
+struct CompositeCache;
+
 typedef struct
 {
     Layer **layers; // Dynamic array of pointers to Layers
@@ -49,6 +152,9 @@ typedef struct
     int width, height;
 
     int layer_capacity;
+
+    struct CompositeCache *cache; // NULL unless enable_image_cache was called
+    int tile_culling;             // 1 after enable_tile_culling
 } Image;
 
 /* =========================================================================
@@ -57,6 +163,8 @@ typedef struct
 
 /**
  * @brief Increments the reference count of a specific layer.
+ * * Reference counts are updated atomically, so a layer may be retained and
+ * released from several threads.
  * * This ensures the layer is not freed while it is still being used
  * by another part of the system (e.g., added to an image).
  * * @param layer A pointer to the Layer struct to retain.
@@ -65,12 +173,33 @@ void retain_layer(Layer *layer);
 
 /**
  * @brief Decrements the reference count of a layer and frees it if the count reaches zero.
- * * If the refcount drops to 0 or less, the function frees the pixel data
- * and the Layer struct itself.
+ * * If the refcount drops to 0, the function frees the Layer struct and releases
+ * its pixel data (which is only freed once no shared layer uses it).
  * * @param layer A pointer to the Layer struct to release.
  */
 void release_layer(Layer *layer);
 
+/**
+ * @brief Creates a new layer that shares the pixels of an existing one copy-on-write.
+ * * No pixels are copied up front. The first write through the drawing API to
+ * either layer while the pixels are shared gives that layer its own private
+ * copy, so many Images (and threads) can share one large decoded layer safely.
+ * The new layer has a reference count of 1.
+ * * @param layer The layer to share.
+ * @return The new layer, or NULL on allocation failure.
+ */
+Layer *share_layer(Layer *layer);
+
+/**
+ * @brief Makes sure the pixels of a layer are not shared with any other layer.
+ * * The drawing primitives call this for you. Call it before writing to
+ * layer->data (or layer->tiles) directly on a layer created by share_layer or
+ * add_shared_layer, or on the layer it was shared from.
+ * * @param layer The layer about to be modified.
+ * @return 0 on success, 1 on failure (memory error).
+ */
+int make_layer_writable(Layer *layer);
+
 /* =========================================================================
  * CREATION & INITIALIZATION
  * ========================================================================= */
@@ -94,6 +223,60 @@ Image *create_image(int width, int height);
  */
 Layer *create_layer(int width, int height);
 
+/**
+ * @brief Allocates a sparse Layer whose pixels are stored in tiles.
+ * * Tiles of LAYER_TILE_SIZE x LAYER_TILE_SIZE pixels are only allocated when
+ * something is drawn into them, so a mostly empty overlay costs memory for its
+ * drawn pixels only. layer->data is NULL: use the drawing primitives, which
+ * understand both storage kinds, rather than writing pixels directly.
+ * The reference count is initialized to 1.
+ * * @param width The width of the layer in pixels.
+ * @param height The height of the layer in pixels.
+ * @return A pointer to the new Layer, or NULL on allocation failure.
+ */
+Layer *create_tiled_layer(int width, int height);
+
+/**
+ * @brief Allocates a Layer whose rows are padded and aligned to 64 bytes.
+ * * layer->data is 64-byte aligned and layer->stride is a multiple of 16 pixels,
+ * so every row starts on a cache line. Otherwise it behaves like create_layer.
+ * * @param width The width of the layer in pixels.
+ * @param height The height of the layer in pixels.
+ * @return A pointer to the new Layer, or NULL on allocation failure.
+ */
+Layer *create_aligned_layer(int width, int height);
+
+/**
+ * @brief Creates a layer that draws into and reads from memory owned by the caller.
+ * * No pixels are copied: the layer uses pixels directly (for example a camera
+ * frame), so the memory must outlive the layer and is never freed by it.
+ * The reference count is initialized to 1.
+ * * @param pixels The ARGB pixels; pixel (x, y) is pixels[y * stride + x].
+ * @param width The width of the layer in pixels.
+ * @param height The height of the layer in pixels.
+ * @param stride Distance between rows in pixels (at least width).
+ * @return A pointer to the new Layer, or NULL on failure.
+ */
+Layer *wrap_layer_pixels(uint32_t *pixels, int width, int height, size_t stride);
+
+/**
+ * @brief Creates a view of a rectangle of a dense layer, without copying.
+ * * The view reads and writes the pixels of its parent: drawing on the view
+ * changes the parent (and marks that area of the parent dirty), and the view
+ * sees every change made to the parent. It retains the parent until it is released.
+ * Changes made to the parent directly are not recorded on the view: call
+ * mark_layer_dirty on the view if an image caching it must see them.
+ * Sharing a view or a layer that has views (share_layer) copies its pixels right away.
+ * The reference count is initialized to 1.
+ * * @param parent The layer to view (not a tiled layer); may itself be a view.
+ * @param x Left edge of the view in the parent.
+ * @param y Top edge of the view in the parent.
+ * @param width Width of the view, which must fit inside the parent.
+ * @param height Height of the view, which must fit inside the parent.
+ * @return A pointer to the new view, or NULL on failure.
+ */
+Layer *create_layer_view(Layer *parent, int x, int y, int width, int height);
+
 /* =========================================================================
  * LAYER MANAGEMENT
  * ========================================================================= */
@@ -115,6 +298,24 @@ int add_existing_layer(Image *img, Layer *layer);
  */
 Layer *add_layer(Image *img);
 
+/**
+ * @brief Creates a new tiled layer (see create_tiled_layer) and immediately adds it to the image.
+ * * @param img The target image.
+ * @return A pointer to the newly created Layer, or NULL on failure.
+ */
+Layer *add_tiled_layer(Image *img);
+
+/**
+ * @brief Attaches a copy-on-write share of a layer to the image (see share_layer).
+ * * Unlike add_existing_layer, drawing on the returned layer never changes the
+ * original layer or any other image sharing it. The caller keeps ownership of
+ * the original layer.
+ * * @param img The target image.
+ * @param layer The layer whose pixels to share.
+ * @return The image's own layer, or NULL on failure.
+ */
+Layer *add_shared_layer(Image *img, Layer *layer);
+
 /**
  * @brief Removes a layer from the image at the specified index.
  * * Releases the layer (decrementing refcount) and shifts subsequent layers.
@@ -123,6 +324,59 @@ Layer *add_layer(Image *img);
  */
 void remove_layer(Image *img, int index);
 
+/* =========================================================================
+ * CHANGE TRACKING & COMPOSITE CACHE
+ * ========================================================================= */
+
+/**
+ * @brief Records that a rectangle of a layer has been modified.
+ * * All drawing primitives, fill_layer and parse_image_file call this for you.
+ * Call it yourself after writing to layer->data directly, otherwise images
+ * with a composite cache or tile culling keep showing the old pixels.
+ * The rectangle is clipped to the layer bounds; empty rectangles are ignored.
+ * * @param layer The modified layer.
+ * @param x Left edge of the modified area.
+ * @param y Top edge of the modified area.
+ * @param w Width of the modified area.
+ * @param h Height of the modified area.
+ */
+void mark_layer_dirty(Layer *layer, int x, int y, int w, int h);
+
+/**
+ * @brief Keeps a flattened copy of the image between exports.
+ * * Once enabled, save_image and export_to_array only recomposite the areas
+ * that changed since the previous export (as recorded by mark_layer_dirty)
+ * or the whole frame when the layer stack itself changed. Adding or removing
+ * layers that were never drawn on does not invalidate the cache.
+ * Costs width * height * 4 bytes of memory.
+ * * @param img The image.
+ * @return 0 on success, 1 on failure (memory error).
+ */
+int enable_image_cache(Image *img);
+
+/**
+ * @brief Frees the flattened copy created by enable_image_cache.
+ * * @param img The image.
+ */
+void disable_image_cache(Image *img);
+
+/**
+ * @brief Lets exports skip layers per tile using each layer's tile coverage.
+ * * Once enabled, flattening classifies the 64x64 tiles of every layer once
+ * (see TileCoverage) and reuses the result: layers below a fully opaque tile
+ * are never read, and fully transparent tiles are skipped. Like the composite
+ * cache, this relies on mark_layer_dirty being called after direct writes to
+ * layer->data. Without it, only unallocated tiles of tiled layers are skipped.
+ * * @param img The image.
+ */
+void enable_tile_culling(Image *img);
+
+/**
+ * @brief Stops trusting tile coverage; every allocated tile is blended again.
+ * * @param img The image.
+ */
+void disable_tile_culling(Image *img);
+
 /* =========================================================================
  * CLEANUP & UTILITIES
  * ========================================================================= */
@@ -154,6 +408,67 @@ void print_image_info(const Image *img);
  */
 uint32_t blend_pixels(uint32_t bg_color, uint32_t fg_color);
 
+/**
+ * @brief Converts a straight ARGB color to premultiplied ARGB.
+ * * Each color channel becomes round(channel * alpha / 255); alpha is unchanged.
+ * * @param color The straight ARGB color.
+ * @return The premultiplied color.
+ */
+uint32_t premultiply_color(uint32_t color);
+
+/**
+ * @brief Converts a premultiplied ARGB color back to straight ARGB.
+ * * Fully transparent colors become 0. Precision lost by premultiplying
+ * low-alpha colors is not recovered.
+ * * @param color The premultiplied ARGB color.
+ * @return The straight color.
+ */
+uint32_t unpremultiply_color(uint32_t color);
+
+/**
+ * @brief Switches the pixel representation of a layer.
+ * * Premultiplied layers composite with one multiply-add per channel instead of
+ * two multiplies and a division, which pays off on stacks of translucent layers.
+ * The current pixels are converted in place. Drawing primitives keep taking straight
+ * colors and convert them, and opaque pixels (such as those returned by
+ * parse_image_file) are the same in both representations, so only code reading or
+ * writing layer->data directly has to care about the flag.
+ * Where translucent layers overlap, flattened output may differ from the straight
+ * representation by a unit or two per channel, due to rounding.
+ * * @param layer The layer to convert.
+ * Views and layers that have views cannot be converted.
+ * * @param premultiplied Non-zero to store premultiplied pixels, 0 for straight alpha.
+ * @return 0 on success, 1 on failure.
+ */
+int set_layer_premultiplied(Layer *layer, int premultiplied);
+
+/**
+ * @brief Sets how a layer is composited over the layers below it.
+ * * Layers start in BLEND_MODE_NORMAL. Composite caches holding the layer
+ * recomposite it on the next export.
+ * * @param layer The layer.
+ * @param mode One of the BLEND_MODE_* values.
+ * @return 0 on success, 1 on failure (unknown mode).
+ */
+int set_layer_blend_mode(Layer *layer, BlendMode mode);
+
+/**
+ * @brief Sets the opacity a layer is composited with.
+ * * The alpha of every pixel is multiplied by opacity / 255 while flattening;
+ * the pixels themselves are not touched. Layers start at 255.
+ * * @param layer The layer.
+ * @param opacity 0 (invisible) to 255 (as drawn); other values are clamped.
+ */
+void set_layer_opacity(Layer *layer, int opacity);
+
+/**
+ * @brief Shows or hides a layer without removing it from its images.
+ * * Hidden layers are skipped when flattening. Layers start visible.
+ * * @param layer The layer.
+ * @param visible Non-zero to show the layer, 0 to hide it.
+ */
+void set_layer_visible(Layer *layer, int visible);
+
 /* =========================================================================
  * FILE I/O & EXPORT
  * ========================================================================= */
@@ -168,6 +483,40 @@ uint32_t blend_pixels(uint32_t bg_color, uint32_t fg_color);
  */
 int save_image(const Image *img, const char *filename, ImageFileType type);
 
+/**
+ * A 1-bit-per-pixel black and white image, stored exactly like a PBM (P4) body:
+ * MSB-first, a set bit is black, and every row starts on a byte boundary.
+ * Reading and re-writing bitmaps this way never expands them to 32-bit pixels
+ * (see parse_bitmap_file in images-parser.h).
+ */
+typedef struct
+{
+    uint8_t *bits;
+    int width, height;
+    size_t stride; // bytes per row, (width + 7) / 8
+} Bitmap;
+
+/**
+ * @brief Allocates an all-white bitmap.
+ * * @param width The bitmap width in pixels.
+ * @param height The bitmap height in pixels.
+ * @return The new bitmap, or NULL on failure.
+ */
+Bitmap *create_bitmap(int width, int height);
+
+/**
+ * @brief Frees a bitmap and its bits.
+ */
+void free_bitmap(Bitmap *bitmap);
+
+/**
+ * @brief Saves a bitmap as a PBM (P4) file, copying its rows unchanged.
+ * * @param bitmap The bitmap to save.
+ * @param filename The output file path.
+ * @return 0 on success, 1 on failure.
+ */
+int save_bitmap(const Bitmap *bitmap, const char *filename);
+
 /**
  * @brief Flattens and exports a multi-layered image into a single raw data array.
  *
@@ -202,3 +551,78 @@ int save_image(const Image *img, const char *filename, ImageFileType type);
  * are set to 1 (bit set), others are 0. Bits are packed MSB-first.
  */
 int export_to_array(const Image *img, void **out_array, size_t *len, ArrayDataFormat format);
+
+/**
+ * @brief Flattens a rectangle of the image into a buffer owned by the caller.
+ * * Works like export_to_array without allocating, so the pixels can go straight
+ * into shared memory or an upload staging buffer. Row r of the rectangle starts
+ * at dst + r * stride bytes; bytes between the end of a row and the next one are
+ * left untouched, and BINARY1 rows only replace their own bits.
+ * * @param img Pointer to the source Image structure.
+ * @param x Left edge of the rectangle to export.
+ * @param y Top edge of the rectangle to export.
+ * @param w Width of the rectangle, which must fit inside the image.
+ * @param h Height of the rectangle, which must fit inside the image.
+ * @param dst The destination buffer.
+ * @param stride Distance between rows in bytes, at least one row of w pixels in the
+ * format. 0 packs the rows back to back, as export_to_array does.
+ * @param format The desired ArrayDataFormat (RGBA32, RGB24, GRAYSCALE8, BINARY1).
+ * @return 0 on success, or 1 on failure (invalid rectangle, stride or format).
+ */
+int export_to_buffer(const Image *img, int x, int y, int w, int h, void *dst, size_t stride, ArrayDataFormat format);
+
+/* =========================================================================
+ * STREAMING WRITER
+ *
+ * Encodes a PPM, PGM or PBM file strip by strip, so huge outputs never need
+ * full-frame layers: peak memory is one strip plus a couple of rows.
+ * ========================================================================= */
+
+typedef struct ImageWriter ImageWriter;
+
+/**
+ * Fills one strip for write_image_strips.
+ * Must write rows * width ARGB pixels; row r of the strip starts at strip + r * stride.
+ * y is the image row of the first strip row. Returns 0 on success, non-zero to abort.
+ */
+typedef int (*StripRenderer)(void *ctx, int y, int rows, uint32_t *strip, size_t stride);
+
+/**
+ * @brief Creates a file and writes the header for a streamed image.
+ * * @param filename The output file path.
+ * @param type The format to write (PPM, PGM or PBM).
+ * @param width The image width in pixels.
+ * @param height The image height in pixels.
+ * @return A writer expecting the first row, or NULL on failure.
+ */
+ImageWriter *open_image_writer(const char *filename, ImageFileType type, int width, int height);
+
+/**
+ * @brief Encodes the next rows of the image.
+ * * Pixels are ARGB and are composited over BACKGROUND_COLOR, so the file is the
+ * same as save_image would produce for an image holding these pixels in one layer.
+ * * @param writer An open writer.
+ * @param rows The first pixel of the first row.
+ * @param stride Distance between rows in pixels.
+ * @param count Number of rows to write.
+ * @return 0 on success, 1 on failure (write error or more rows than the image has).
+ */
+int write_image_rows(ImageWriter *writer, const uint32_t *rows, size_t stride, int count);
+
+/**
+ * @brief Writes every remaining row, asking a callback to render one strip at a time.
+ * * A single strip buffer of strip_rows * width pixels is reused for the whole image.
+ * * @param writer An open writer.
+ * @param strip_rows Height of each strip (the last one may be shorter).
+ * @param render Callback that composites or generates each strip.
+ * @param ctx Opaque pointer passed to the callback.
+ * @return 0 on success, 1 on failure or if the callback aborted.
+ */
+int write_image_strips(ImageWriter *writer, int strip_rows, StripRenderer render, void *ctx);
+
+/**
+ * @brief Finishes the file and frees the writer.
+ * * @param writer The writer to close.
+ * @return 0 if every row was written successfully, 1 otherwise.
+ */
+int close_image_writer(ImageWriter *writer);